@@ -22,22 +22,7 @@
 #include <string.h>
 #include "bs1770.h"
 
-#define IS_DEN(x) \
-    (fabs(den_tmp=(x))<1.0e-15)
-#define DEN(x) \
-    (IS_DEN(x)?0.0:den_tmp)
-
-#define GET(buf,offs,i) \
-    ((buf)[(get_tmp=(offs)+(i))<0?BS1770_BUF_SIZE+get_tmp:get_tmp])
-
-#define GETX(buf,offs,i)  GET(buf,offs,i)
-#define GETY(buf,offs,i)  GET(buf,(offs)-6,i)
-#define GETZ(buf,offs,i)  GET(buf,(offs)-3,i)
-
-#define MIN(x,y) \
-  ((x)<(y)?x:y)
-
-double BS1770_G[BS1770_MAX_CHANNELS]={
+double BS1770_G[BS1770_G_SIZE]={
   1.0,
   1.0,
   1.0,
@@ -81,10 +66,161 @@ static biquad_t rlb48000={
 #endif
 };
 
+// K-weighting filters for the common sample rates as biquad_requantize()
+// derives them from the 48 kHz filters above, written out exactly.  Arming
+// a context for one of these rates is a lookup, and the coefficients do not
+// depend on the tan()/atan() of the platform's math library.
+static const struct bs1770_kw_coef {
+  biquad_t pre;
+  biquad_t rlb;
+} bs1770_kw_coef[]={
+  {
+    {
+      8000, -0.29338078241492238, 0.18687510604540813, 1.3216235689299791, -0.72625549131568867, 0.29812624601620269
+    },
+    {
+      8000, -1.9410133428292142, 0.94188430416850244, 0.97557308186599301, -1.951146163731986, 0.97557308186599301
+    }
+  },
+  {
+    {
+      11025, -0.72810153802114663, 0.26693211946465639, 1.3865361929457172, -1.3115139199368602, 0.46380830843465737
+    },
+    {
+      11025, -1.9570257313221755, 0.95748801950181883, 0.98351658763165384, -1.9670331752633077, 0.98351658763165384
+    }
+  },
+  {
+    {
+      12000, -0.82398044060334064, 0.29429059828525678, 1.4010163859611839, -1.4434314196402018, 0.51272519136093797
+    },
+    {
+      12000, -1.9604831799520119, 0.96087407552357029, 0.98523600944769774, -1.9704720188953955, 0.98523600944769774
+    }
+  },
+  {
+    {
+      16000, -1.1015337691069951, 0.39491236874986374, 1.4432952234913594, -1.8315753812604587, 0.68165875741197068
+    },
+    {
+      16000, -1.9702895280044326, 0.97051049053584348, 0.99012097887193162, -1.9802419577438632, 0.99012097887193162
+    }
+  },
+  {
+    {
+      22050, -1.3383053360661337, 0.50824455891360187, 1.4798253509777464, -2.1707286128568284, 0.86084248472655167
+    },
+    {
+      22050, -1.9783976025901189, 0.97851441950325113, 0.99416909921666485, -1.9883381984333297, 0.99416909921666485
+    }
+  },
+  {
+    {
+      24000, -1.3902346051928205, 0.5368384812603979, 1.4879002209622763, -2.2462054681411359, 0.90490912324643824
+    },
+    {
+      24000, -1.9801441262289325, 0.98024281785927669, 0.9950421689362261, -1.9900843378724522, 0.9950421689362261
+    }
+  },
+  {
+    {
+      32000, -1.5390450962506408, 0.62696685598155921, 1.5111778995687648, -2.4648894133601416, 1.0416332735222957
+    },
+    {
+      32000, -1.9850896689886883, 0.98514532066955152, 0.99751647782627362, -1.9950329556525472, 0.99751647782627362
+    }
+  },
+  {
+    {
+      44100, -1.6636551132560204, 0.7125954280732254, 1.5308412300503476, -2.6509799951547293, 1.1690790799215869
+    },
+    {
+      44100, -1.9891696736297957, 0.98919903578703938, 0.99956006454251445, -1.9991201290850289, 0.99956006454251445
+    }
+  },
+  {
+    {
+      48000, -1.69065929318241, 0.73248077421585001, 1.53512485958697, -2.6916961894063798, 1.1983928108528501
+    },
+    {
+      48000, -1.9900474548339799, 0.99007225036621005, 1, -2, 1
+    }
+  },
+  {
+    {
+      64000, -1.7673863782762409, 0.79175893605868541, 1.547342776025203, -2.8081956085511313, 1.2852253903083732
+    },
+    {
+      64000, -1.9925309579488959, 0.99254492277826856, 1.001245232780436, -2.002490465560872, 1.001245232780436
+    }
+  },
+  {
+    {
+      88200, -1.8309199879623321, 0.84414226108785273, 1.5575153755796536, -2.9056270799263446, 1.3613339774722122
+    },
+    {
+      88200, -1.9945775154503445, 0.99458487587805489, 1.0022719633573822, -2.0045439267147644, 1.0022719633573822
+    }
+  },
+  {
+    {
+      96000, -1.8446094698901085, 0.85584332293064136, 1.5597142289757964, -2.9267415782510819, 1.3782612023158185
+    },
+    {
+      96000, -1.9950175447247156, 0.99502375904092333, 1.0024927889863429, -2.0049855779726857, 1.0024927889863429
+    }
+  },
+  {
+    {
+      128000, -1.8833689499289428, 0.88980647900280352, 1.5659539650181113, -2.9867675097071693, 1.4272510737629187
+    },
+    {
+      128000, -1.9962619968843016, 0.99626549461365221, 1.0031174404833987, -2.0062348809667974, 1.0031174404833987
+    }
+  },
+  {
+    {
+      176400, -1.9153293168330516, 0.91877174416000751, 1.571115317741846, -3.0365445024046522, 1.468871611989762
+    },
+    {
+      176400, -1.9972869224238139, 0.99728876502606822, 1.0036320471042128, -2.0072640942084257, 1.0036320471042128
+    }
+  },
+  {
+    {
+      192000, -1.9222022306074886, 0.92511773511682605, 1.5722272150912788, -3.0472830515615508, 1.4779713409796091
+    },
+    {
+      192000, -1.9975072228407, 0.99750877835550966, 1.003742675371436, -2.007485350742872, 1.003742675371436
+    }
+  },
+  {
+    {
+      352800, -1.9576471680091398, 0.95852580240378527, 1.5779729549706936, -3.1028628349677851, 1.5257685143917368
+    },
+    {
+      352800, -1.9986430017647039, 0.99864346272776539, 1.004313126379051, -2.008626252758102, 1.004313126379051
+    }
+  },
+  {
+    {
+      384000, -1.9610874811908132, 0.96183039790454228, 1.5785316857098701, -3.1082755776498106, 1.5304868086536692
+    },
+    {
+      384000, -1.9987532235575531, 0.99875361267863993, 1.0043684944986169, -2.0087369889972337, 1.0043684944986169
+    }
+  }
+};
+
+#define BS1770_KW_COEF_SIZE \
+  (sizeof bs1770_kw_coef/sizeof bs1770_kw_coef[0])
+
 bs1770_t *bs1770_init(bs1770_t *bs1770, bs1770_aggr_t *lufs,
 	bs1770_aggr_t *lra)
 {
   memset(bs1770, 0, sizeof *bs1770);
+  bs1770->kw.ops=bs1770_kw_cpu();
+  bs1770_set_weights(bs1770,0,NULL);
   bs1770->lufs=lufs;
   bs1770->lra=lra;
   bs1770_reset(bs1770);
@@ -99,101 +235,323 @@ bs1770_t *bs1770_cleanup(bs1770_t *bs1770)
 
 bs1770_t *bs1770_reset(bs1770_t *bs1770)
 {
-  bs1770->ring.size=bs1770->ring.offs=0;
+  // the filters are kept, they only depend on the sample rate.
   bs1770->fs=0.0;
   bs1770->channels=0.0;
-  bs1770->pre.fs=0.0;
-  bs1770->rlb.fs=0.0;
+  bs1770->kw.primed=0;
 
   return bs1770;
 }
 
-void bs1770_set_fs(bs1770_t *bs1770, double fs, int channels)
+void bs1770_set_mode(bs1770_t *bs1770, int mode)
+{
+  bs1770->kw.mode=mode;
+  bs1770_reset(bs1770);   // re-arm the kernel with the next samples.
+}
+
+void bs1770_set_weights(bs1770_t *bs1770, int channels, const double *g)
 {
+  bs1770_kw_t *kw=&bs1770->kw;
   int i;
 
+  for (i=0;i<BS1770_MAX_CHANNELS;++i) {
+    if (i<channels)
+      bs1770->g[i]=g[i];
+    else if (i<BS1770_G_SIZE)
+      bs1770->g[i]=BS1770_G[i];
+    else
+      bs1770->g[i]=1.0;
+  }
+
+  // takes effect immediately, the filters' state is kept.
+  for (i=0;i<kw->channels;++i) {
+    kw->dbl.g[i]=bs1770->g[i];
+    kw->flt.g[i]=bs1770->g[i];
+  }
+}
+
+void bs1770_requantize(double fs, biquad_t *pre, biquad_t *rlb)
+{
+  size_t lo=0, hi=BS1770_KW_COEF_SIZE, mid;
+
+  if (pre->fs==fs&&rlb->fs==fs)
+    return;   // still quantized for this rate.
+
+  while (lo<hi) {
+    mid=lo+(hi-lo)/2;
+
+    if (bs1770_kw_coef[mid].pre.fs<fs)
+      lo=mid+1;
+    else
+      hi=mid;
+  }
+
+  if (lo<BS1770_KW_COEF_SIZE&&bs1770_kw_coef[lo].pre.fs==fs) {
+    *pre=bs1770_kw_coef[lo].pre;
+    *rlb=bs1770_kw_coef[lo].rlb;
+    return;
+  }
+
+  pre->fs=fs;
+  biquad_requantize(&pre48000, pre);
+
+  rlb->fs=fs;
+  biquad_requantize(&rlb48000, rlb);
+}
+
+void bs1770_set_fs(bs1770_t *bs1770, double fs, int channels)
+{
   bs1770->fs=fs;
   bs1770->channels=channels;
+  bs1770_requantize(fs, &bs1770->pre, &bs1770->rlb);
+
+  bs1770_kw_reset(&bs1770->kw, channels, bs1770->g);
+}
 
-  bs1770->pre.fs=fs;
-  biquad_requantize(&pre48000, &bs1770->pre);
+// puts the track's histograms in error, its loudness and LRA being NaN
+// until it is reset.
+void bs1770_refuse(bs1770_t *bs1770)
+{
+  if (NULL!=bs1770->lufs)
+    bs1770->lufs->track->error=1;
 
-  bs1770->rlb.fs=fs;
-  biquad_requantize(&rlb48000, &bs1770->rlb);
+  if (NULL!=bs1770->lra)
+    bs1770->lra->track->error=1;
+}
 
-  for (i=0;i<MIN(channels,BS1770_MAX_CHANNELS);++i) {
-    double *buf=bs1770->ring.buf[i];
-    int get_tmp;
+// f64 rate, u32 channels, u32 mode and the weights of all channels as f64,
+// followed by the kernel's state once the rate is set.
+void bs1770_write_state(const bs1770_t *bs1770, bs1770_hist_writer_t *w)
+{
+  int i;
 
-    GETX(buf,0,0)=0.0;
-  }
+  bs1770_hist_put_f64(w,bs1770->fs);
+  bs1770_hist_put(w,bs1770->channels,4);
+  bs1770_hist_put(w,bs1770->kw.mode,4);
 
-  bs1770->ring.size=bs1770->ring.offs=1;
+  for (i=0;i<BS1770_MAX_CHANNELS;++i)
+    bs1770_hist_put_f64(w,bs1770->g[i]);
+
+  if (0.0<bs1770->fs)
+    bs1770_kw_write_state(&bs1770->kw,w);
 }
 
-#if 0
-void bs1770_add_sample(bs1770_t *bs1770, double fs, int channels,
-    bs1770_sample_t sample)
+int bs1770_read_state(bs1770_t *bs1770, bs1770_hist_reader_t *r)
 {
-  biquad_t *pre=&bs1770->pre;
-  biquad_t *rlb=&bs1770->rlb;
-  double wssqs=0.0;
-  double *g=BS1770_G;
-  int offs, size, i;
-  int get_tmp;
-  double den_tmp;
+  double fs=bs1770_hist_get_f64(r);
+  int channels=(int)bs1770_hist_get(r,4);
+  int mode=(int)bs1770_hist_get(r,4);
+  double g[BS1770_MAX_CHANNELS];
+  int i;
 
-  if (bs1770->fs!=fs)
-    bs1770_set_fs(bs1770, fs, channels);
+  for (i=0;i<BS1770_MAX_CHANNELS;++i)
+    g[i]=bs1770_hist_get_f64(r);
 
-  offs=bs1770->ring.offs;
-  size=bs1770->ring.size;
+  if (r->error)
+    return -1;
 
-  for (i=0;i<MIN(channels,BS1770_MAX_CHANNELS);++i) {
-    double *buf=bs1770->ring.buf[i];
-    double x=GETX(buf,offs,0)=DEN(sample[i]);
+  bs1770->kw.mode=mode;
+  bs1770_reset(bs1770);
+  bs1770_set_weights(bs1770,BS1770_MAX_CHANNELS,g);
 
-    if (1<size) {
-      double y=GETY(buf,offs,0)=DEN(pre->b0*x
-        +pre->b1*GETX(buf,offs,-1)+pre->b2*GETX(buf,offs,-2)
-        -pre->a1*GETY(buf,offs,-1)-pre->a2*GETY(buf,offs,-2))
-        ;
-      double z=GETZ(buf,offs,0)=DEN(rlb->b0*y
-        +rlb->b1*GETY(buf,offs,-1)+rlb->b2*GETY(buf,offs,-2)
-        -rlb->a1*GETZ(buf,offs,-1)-rlb->a2*GETZ(buf,offs,-2))
-        ;
-      wssqs+=(*g++)*z*z;
-      ++buf;
-    }
+  if (0.0<fs) {
+    if (channels<1||BS1770_MAX_CHANNELS<channels)
+      return -1;
+
+    bs1770_set_fs(bs1770,fs,channels);
+
+    return bs1770_kw_read_state(&bs1770->kw,r);
   }
 
+  return 0;
+}
+
+static void bs1770_add_sqs(bs1770_t *bs1770, const double *wssqs, size_t n)
+{
+  double fs=bs1770->fs;
+
   if (NULL!=bs1770->lufs)
-    bs1770_aggr_add_sqs(bs1770->lufs,fs,wssqs);
+    bs1770_aggr_add_sqs(bs1770->lufs,fs,wssqs,n);
 
   if (NULL!=bs1770->lra)
-    bs1770_aggr_add_sqs(bs1770->lra,fs,wssqs);
+    bs1770_aggr_add_sqs(bs1770->lra,fs,wssqs,n);
+}
+
+// single precision counterpart of "bs1770_add_frames()", the frames
+// being floats at "kw.fbuf" and the sums going behind them.
+static void bs1770_add_frames_f32(bs1770_t *bs1770, size_t nframes)
+{
+  bs1770_kw_t *kw=&bs1770->kw;
+  float *buf=kw->fbuf;
+  double *wssqs=kw->buf+BS1770_KW_BUF_SIZE-BS1770_KW_FRAMES(kw);
+  int stride=kw->stride;
+  size_t j,n=0;
+  int i;
+
+  if (!kw->primed) {
+    bs1770_kw_prime_f32(kw,buf);
+    wssqs[n++]=0.0;
+    buf+=stride;
+    --nframes;
+  }
+
+  bs1770_kw_filter_f32(kw,&bs1770->pre,&bs1770->rlb,buf,nframes);
+
+  for (j=0;j<nframes;++j) {
+    const float *rp=buf+j*stride;
+    double sum=0.0;
+
+    for (i=0;i<kw->channels;++i)
+      sum+=rp[i];
 
-  if (size<2)
-    ++bs1770->ring.size;
+    wssqs[n++]=sum;
+  }
 
-  if (++bs1770->ring.offs==BS1770_BUF_SIZE)
-    bs1770->ring.offs=0;
+  bs1770_add_sqs(bs1770,wssqs,n);
 }
-#endif
 
-void bs1770_flush(bs1770_t *bs1770)
+// filters the first "nframes" frames staged in "kw.buf" and hands their
+// weighted sums of squares over to the aggregators.
+void bs1770_add_frames(bs1770_t *bs1770, size_t nframes)
 {
-  double fs=bs1770->fs;
-  int channels=bs1770->channels;
+  bs1770_kw_t *kw=&bs1770->kw;
+  double *buf=kw->buf;
+  // the per frame sums are written back to the front of "kw.buf", never
+  // overtaking the frame being read.
+  double *wssqs=kw->buf;
+  int stride=kw->stride;
+  size_t j,n=0;
+  int i;
+
+  if (0==nframes)
+    return;
+  else if (kw->mode&BS1770_MODE_F32) {
+    bs1770_add_frames_f32(bs1770,nframes);
+    return;
+  }
+
+  if (!kw->primed) {
+    // the very first frame only fills the filters' history.
+    bs1770_kw_prime(kw,buf);
+    wssqs[n++]=0.0;
+    buf+=stride;
+    --nframes;
+  }
+
+  bs1770_kw_filter(kw,&bs1770->pre,&bs1770->rlb,buf,nframes);
+
+  for (j=0;j<nframes;++j) {
+    const double *rp=buf+j*stride;
+    double sum=0.0;
+
+    for (i=0;i<kw->channels;++i)
+      sum+=rp[i];
+
+    wssqs[n++]=sum;
+  }
+
+  bs1770_add_sqs(bs1770,wssqs,n);
+}
+
+// channel-major counterpart of "bs1770_add_frames()": filters "nframes"
+// frames given as one contiguous buffer per channel, "x[i]" for channel i,
+// channel by channel and hands the per frame sums over to the aggregators.
+// the sums are gathered behind the channels' runs in "kw.buf", where the
+// converting callers stage no more than BS1770_KW_BLOCK_SIZE() frames.
+void bs1770_add_block(bs1770_t *bs1770, const double *const *x,
+    size_t nframes)
+{
+  bs1770_kw_t *kw=&bs1770->kw;
+  size_t size=BS1770_KW_BLOCK_SIZE(kw);
+  double *wssqs=kw->buf+kw->channels*size;
+  size_t offs=0;
+  size_t n;
+  int i;
+
+  if (0==nframes)
+    return;
 
-  if (1<bs1770->ring.size) {
-    bs1770_sample_f64_t sample;
+  if (!kw->primed) {
+    double frame[BS1770_MAX_CHANNELS];
+
+    for (i=0;i<kw->channels;++i)
+      frame[i]=x[i][0];
+
+    bs1770_kw_prime(kw,frame);
+    wssqs[0]=0.0;
+    bs1770_add_sqs(bs1770,wssqs,1);
+    offs=1;
+  }
+
+  while (offs<nframes) {
+    n=nframes-offs<size?nframes-offs:size;
+    memset(wssqs,0,n*sizeof wssqs[0]);
+
+    for (i=0;i<kw->channels;++i) {
+      bs1770_kw_filter_block(kw,&bs1770->pre,&bs1770->rlb,i,x[i]+offs,
+          wssqs,n);
+    }
+
+    bs1770_add_sqs(bs1770,wssqs,n);
+    offs+=n;
+  }
+}
+
+// single precision counterpart of "bs1770_add_block()" for
+// BS1770_MODE_F32, the converting callers staging their runs at "kw.fbuf".
+void bs1770_add_block_f32(bs1770_t *bs1770, const float *const *x,
+    size_t nframes)
+{
+  bs1770_kw_t *kw=&bs1770->kw;
+  size_t size=BS1770_KW_BLOCK_SIZE(kw);
+  double *wssqs=kw->buf+kw->channels*size;
+  size_t offs=0;
+  size_t n;
+  int i;
+
+  if (0==nframes)
+    return;
+
+  if (!kw->primed) {
+    float frame[BS1770_MAX_CHANNELS];
+
+    for (i=0;i<kw->channels;++i)
+      frame[i]=x[i][0];
+
+    bs1770_kw_prime_f32(kw,frame);
+    wssqs[0]=0.0;
+    bs1770_add_sqs(bs1770,wssqs,1);
+    offs=1;
+  }
+
+  while (offs<nframes) {
+    n=nframes-offs<size?nframes-offs:size;
+    memset(wssqs,0,n*sizeof wssqs[0]);
+
+    for (i=0;i<kw->channels;++i) {
+      bs1770_kw_filter_block_f32(kw,&bs1770->pre,&bs1770->rlb,i,x[i]+offs,
+          wssqs,n);
+    }
+
+    bs1770_add_sqs(bs1770,wssqs,n);
+    offs+=n;
+  }
+}
+
+void bs1770_flush(bs1770_t *bs1770)
+{
+  if (bs1770->kw.primed) {
+    bs1770_kw_t *kw=&bs1770->kw;
     int i;
 
-    for (i=0;i<channels;++i)
-      sample[i]=0.0;
+    for (i=0;i<kw->stride;++i) {
+      if (kw->mode&BS1770_MODE_F32)
+        kw->fbuf[i]=0.0f;
+      else
+        kw->buf[i]=0.0;
+    }
 
-    bs1770_add_sample_f64(bs1770,fs,channels,sample);
+    bs1770_add_frames(bs1770,1);
   }
 
   bs1770_reset(bs1770);
@@ -205,27 +563,38 @@ void bs1770_flush(bs1770_t *bs1770)
     bs1770_aggr_reset(bs1770->lra);
 }
 
-double bs1770_track_lufs(bs1770_t *bs1770, double reference)
+double bs1770_track_lufs(bs1770_t *bs1770, double reference, double *exact)
 {
   double lufs;
 
   bs1770_flush(bs1770);
   lufs=bs1770_hist_get_lufs(bs1770->lufs->track,reference);
+
+  if (NULL!=exact)
+    *exact=bs1770_hist_get_lufs_exact(bs1770->lufs->track,reference);
+
   bs1770_hist_add(bs1770->lufs->album,bs1770->lufs->track);
   bs1770_hist_reset(bs1770->lufs->track);
+  bs1770_aggr_reset_track(bs1770->lufs);
 
   return lufs;
 }
 
-double bs1770_track_lra(bs1770_t *bs1770, double lower, double upper)
+double bs1770_track_lra(bs1770_t *bs1770, double lower, double upper,
+    double *exact)
 {
   double lra=0.0;
 
   if (NULL!=bs1770->lra) {
     bs1770_flush(bs1770);
     lra=bs1770_hist_get_lra(bs1770->lra->track,lower,upper);
+
+    if (NULL!=exact)
+      *exact=bs1770_hist_get_lra_exact(bs1770->lra->track,lower,upper);
+
     bs1770_hist_add(bs1770->lra->album,bs1770->lra->track);
     bs1770_hist_reset(bs1770->lra->track);
+    bs1770_aggr_reset_track(bs1770->lra);
   }
 
   return lra;
@@ -27,24 +27,54 @@ extern "C" {
 #include "biquad.h"
 #include "bs1770_ctx.h"
 
-#define BS1770_BUF_SIZE         9
 #define BS1770_LKFS(count,sum,def) \
   ((count)?-0.691+10.0*log10((sum)/((double)(count))):(double)(def))
 
 typedef unsigned long long bs1770_count_t;
 
-extern double BS1770_G[BS1770_MAX_CHANNELS];
+#define BS1770_G_SIZE           5
+
+extern double BS1770_G[BS1770_G_SIZE];  // default weights L, R, C, Ls, Rs.
+
+/// bs1770_alloc //////////////////////////////////////////////////////////////
+#define BS1770_ARENA_LINE       64    // cache line.
+#define BS1770_ARENA_ALIGN(size) \
+  (((size)+(size_t)(BS1770_ARENA_LINE-1))&~(size_t)(BS1770_ARENA_LINE-1))
+
+// the buffers of a context carved one after another from a single block.
+// Without a block they are taken from the heap and only their total size
+// is kept in "used", which is how the size of a block is found.  What does
+// not fit is taken from the heap as well.  Either way each buffer starts
+// on a cache line and fills whole lines, such that buffers written by the
+// threads of different tracks never share one.
+typedef struct bs1770_arena {
+  unsigned char *base;      // NULL if taken from the heap.
+  size_t size;
+  size_t used;
+} bs1770_arena_t;
+
+// "bs1770_malloc()" and "bs1770_free()" go through the allocator set by
+// "bs1770_set_allocator()", a NULL arena means the heap.
+void *bs1770_malloc(size_t size);
+void bs1770_free(void *p);
+void *bs1770_arena_alloc(bs1770_arena_t *arena, size_t size);
+void bs1770_arena_free(bs1770_arena_t *arena, void *p);
 
 /// bs1770_hist ///////////////////////////////////////////////////////////////
-typedef struct bs1770_hist_bin {
-  double db;
-  double x;
-  double y;
-  bs1770_count_t count;
-} bs1770_hist_bin_t;
+#define BS1770_CHUNK_SIZE       4096  // blocks per chunk, 32 KB.
+
+// a chunk of block energies kept along with the bins by BS1770_PS_EXACT.
+typedef struct bs1770_chunk {
+  struct bs1770_chunk *next;
+  double wmsq[BS1770_CHUNK_SIZE];
+} bs1770_chunk_t;
 
 typedef struct bs1770_hist {
+  const struct bs1770_hist_ops *ops;  // histogram variant.
+  bs1770_arena_t *arena;    // the buffers are taken from, set before init.
   int active;
+  int error;                // a block was lost for want of memory, the
+                            // queries give NaN until the next reset.
   double gate;              // BS1770 gate, e.g. -10.0
 
   struct {
@@ -52,22 +82,110 @@ typedef struct bs1770_hist {
     bs1770_count_t count;   // number of blocks processed.
   } pass1;
 
-  bs1770_hist_bin_t *bin;
+  // blocks per bin.  the bin edges are shared by all histograms, the
+  // counts start out 32 bit and are promoted to 64 bit on overflow.
+  uint32_t *count;          // NULL once promoted.
+  bs1770_count_t *count64;  // NULL until promoted.
+
+  // Fenwick trees over the bins, NULL unless BS1770_PS_INDEXED.
+  struct {
+    bs1770_count_t *count;  // counts, lowest bin first.
+    double *wmsq;           // counts times mean square, highest bin first.
+  } index;
+
+  // the blocks counted, in addition to the bins with BS1770_PS_EXACT.
+  // chunks are only freed on cleanup, a reset starts over with the first.
+  struct {
+    int keep;               // whether blocks are kept.
+    bs1770_chunk_t *head;   // NULL until the first block.
+    bs1770_chunk_t *tail;   // chunk being filled.
+    size_t used;            // blocks in the tail chunk.
+  } blocks;
+
+  // the gated blocks in ascending order as of the last exact LRA, kept
+  // for the next one.
+  struct {
+    double *wmsq;           // NULL until the first exact LRA.
+    size_t size;            // room at "wmsq".
+    size_t used;            // gated blocks at "wmsq".
+    bs1770_count_t count;   // "pass1.count" sorted at, 0 if none.
+  } sorted;
 } bs1770_hist_t;
 
-bs1770_hist_t *bs1770_hist_init(bs1770_hist_t *hist, const bs1770_ps_t *ps);
+// the histogram variants, 0.01 dB and 0.1 dB bins (BS1770_PS_COARSE).
+typedef struct bs1770_hist_ops {
+  bs1770_hist_t *(*init)(bs1770_hist_t *hist, const bs1770_ps_t *ps);
+  void (*reset)(bs1770_hist_t *hist);
+  void (*inc_bin)(bs1770_hist_t *hist, double wmsq);
+  int (*add)(bs1770_hist_t *album, bs1770_hist_t *track);
+  double (*get_lufs)(bs1770_hist_t *hist, double reference);
+  double (*get_lra)(bs1770_hist_t *hist, double lower, double upper);
+  size_t (*write)(const bs1770_hist_t *hist, void *buf, size_t size);
+  size_t (*read)(bs1770_hist_t *album, const void *buf, size_t size,
+      int add);
+  int (*index)(bs1770_hist_t *hist);
+} bs1770_hist_ops_t;
+
+extern const bs1770_hist_ops_t bs1770_hist_fine;
+extern const bs1770_hist_ops_t bs1770_hist_coarse;
+
+bs1770_hist_t *bs1770_hist_init(bs1770_hist_t *hist, const bs1770_ps_t *ps,
+    bs1770_arena_t *arena);
 bs1770_hist_t *bs1770_hist_cleanup(bs1770_hist_t *hist);
 
 void bs1770_hist_reset(bs1770_hist_t *hist);
 void bs1770_hist_inc_bin(bs1770_hist_t *hist, double wmsq);
+// gives the histogram the index of BS1770_PS_INDEXED from now on unless it
+// has it, -1 if memory runs out.
+int bs1770_hist_index(bs1770_hist_t *hist);
 
-void bs1770_hist_add(bs1770_hist_t *album, bs1770_hist_t *track);
+// "bs1770_hist_add" gives -1 if "track" is of another variant or short of
+// blocks, or if memory runs out, leaving "album" in error.
+int bs1770_hist_add(bs1770_hist_t *album, bs1770_hist_t *track);
 double bs1770_hist_get_lufs(bs1770_hist_t *hist, double reference);
 double bs1770_hist_get_lra(bs1770_hist_t *hist, double lower,
    double upper);
+// the same from the blocks kept with BS1770_PS_EXACT rather than the bins,
+// NaN if none are kept.
+double bs1770_hist_get_lufs_exact(bs1770_hist_t *hist, double reference);
+double bs1770_hist_get_lra_exact(bs1770_hist_t *hist, double lower,
+   double upper);
+
+// "bs1770_hist_write" serializes the histogram into "buf" if "size" bytes
+// suffice and returns the size needed.  "bs1770_hist_read" adds a
+// serialized histogram of the same layout and gate to "album" and returns
+// the number of bytes read, 0 on error.  Without "album" it is only parsed.
+// "bs1770_hist_check" parses it as "bs1770_hist_read" would, leaving
+// "album" as it is.
+size_t bs1770_hist_write(const bs1770_hist_t *hist, void *buf, size_t size);
+size_t bs1770_hist_read(bs1770_hist_t *album, const void *buf, size_t size);
+size_t bs1770_hist_check(bs1770_hist_t *album, const void *buf, size_t size);
+
+// little endian fields as used by the serializations.  The writer counts
+// "size" on, dropping what does not fit between "p" and "mp", the reader
+// sets "error" when running over "mp".
+typedef struct bs1770_hist_writer {
+  unsigned char *p;
+  unsigned char *mp;
+  size_t size;
+} bs1770_hist_writer_t;
+
+typedef struct bs1770_hist_reader {
+  const unsigned char *p;
+  const unsigned char *mp;
+  int error;
+} bs1770_hist_reader_t;
+
+void bs1770_hist_put(bs1770_hist_writer_t *w, uint64_t x, int n);
+void bs1770_hist_put_f64(bs1770_hist_writer_t *w, double x);
+uint64_t bs1770_hist_get(bs1770_hist_reader_t *r, int n);
+double bs1770_hist_get_f64(bs1770_hist_reader_t *r);
 
 /// bs1770_aggr ///////////////////////////////////////////////////////////////
+typedef struct bs1770_snap bs1770_snap_t;
+
 typedef struct bs1700_aggr {
+  bs1770_arena_t *arena;  // that of the track's histogram.
   double gate;
   double length;        // BS1170 block length in ms
   int partition;        // BS1770 partition, e.g. 4 (75%)
@@ -81,9 +199,43 @@ typedef struct bs1700_aggr {
     size_t used;        // number of blocks used in ring buffer.
     size_t offs;        // offset of front block.
     size_t count;       // number of samples processed in front block.
+    double sum;         // sum of squares of the current hop.
     double *wmsq;       // allocated blocks.
   } blocks;
 
+  struct {
+    size_t size;        // number of hops in the short-term window.
+    size_t used;        // number of hops in ring buffer.
+    size_t offs;        // offset of the oldest hop.
+    uint64_t count;     // number of hops since the rate was set.
+    double sum;         // sum of squares of the hops in ring buffer.
+    double *sqs;        // allocated sums of squares of the last hops.
+  } hops;
+
+  struct {
+    bs1770_series_t fn; // NULL unless the time series is wanted.
+    void *data;
+  } series;
+
+  struct {
+    double from;        // blocks ending within (from,to] seconds count.
+    double to;
+  } window;
+
+  struct {
+    double momentary;   // mean squares, -1.0 if none yet.
+    double shortterm;   // over complete short-term windows only.
+    double partial;     // short-term of a track shorter than the window.
+  } max;
+
+  struct {
+    double t;           // end of the last block counted in s, 0.0 if none.
+    double momentary;   // mean squares of it and its short-term window.
+    double shortterm;
+  } last;
+
+  bs1770_snap_t *snap;  // NULL unless snapshots are published.
+
   bs1770_hist_t *track;
   bs1770_hist_t *album;
 } bs1770_aggr_t;
@@ -93,7 +245,143 @@ bs1770_aggr_t *bs1770_aggr_init(bs1770_aggr_t *aggr, const bs1770_ps_t *ps,
 bs1770_aggr_t *bs1770_aggr_cleanup(bs1770_aggr_t *aggr);
 
 void bs1770_aggr_reset(bs1770_aggr_t *aggr);
-void bs1770_aggr_add_sqs(bs1770_aggr_t *aggr, double fs, double wssqs);
+void bs1770_aggr_set_series(bs1770_aggr_t *aggr, bs1770_series_t fn,
+    void *data);
+// the window and the maxima survive "bs1770_aggr_reset()" and are only
+// reset along with the track's histogram.
+void bs1770_aggr_reset_track(bs1770_aggr_t *aggr);
+void bs1770_aggr_set_window(bs1770_aggr_t *aggr, double from, double to);
+void bs1770_aggr_set_snap(bs1770_aggr_t *aggr, bs1770_snap_t *snap);
+// takes the snapshot of the track of "aggr", with the LRA of "lra" if not
+// NULL, from the blocks counted so far.  "bs1770_aggr_peek()" does so in
+// logarithmic time for publishing from within the hop, relying on the
+// index "bs1770_ctx_track_publish()" gives the histograms, NaN for the
+// gated loudness and LRA without.
+void bs1770_aggr_snapshot(const bs1770_aggr_t *aggr, const bs1770_aggr_t *lra,
+    bs1770_snapshot_t *snapshot);
+void bs1770_aggr_peek(const bs1770_aggr_t *aggr, const bs1770_aggr_t *lra,
+    bs1770_snapshot_t *snapshot);
+// the state of an aggregator for "bs1770_ctx_state_write()".
+void bs1770_aggr_write_state(const bs1770_aggr_t *aggr,
+    bs1770_hist_writer_t *w);
+int bs1770_aggr_read_state(bs1770_aggr_t *aggr, bs1770_hist_reader_t *r);
+double bs1770_aggr_max_momentary(const bs1770_aggr_t *aggr);
+double bs1770_aggr_max_shortterm(const bs1770_aggr_t *aggr);
+void bs1770_aggr_add_sqs(bs1770_aggr_t *aggr, double fs, const double *wssqs,
+    size_t n);
+
+/// bs1770_kw /////////////////////////////////////////////////////////////////
+#if defined (__GNUC__) && (defined (__x86_64__) || defined (__i386__))
+  #define BS1770_KW_X86
+#endif
+
+#define BS1770_KW_LANES         16    // widest vector in floats (AVX-512).
+#define BS1770_KW_CHANNELS \
+  ((BS1770_MAX_CHANNELS+BS1770_KW_LANES-1)/BS1770_KW_LANES*BS1770_KW_LANES)
+#define BS1770_KW_BUF_SIZE      (128*BS1770_KW_LANES)
+// frames per channel of "buf" in channel-major use, where it holds a run
+// of each channel followed by the run of their per frame sums.  With
+// BS1770_MODE_F32 the runs are floats at "fbuf", the sums stay where they
+// are.
+#define BS1770_KW_BLOCK_SIZE(kw) \
+  (BS1770_KW_BUF_SIZE/((kw)->channels+1))
+// frames of "buf" in frame-major use.  With BS1770_MODE_F32 they are
+// floats at "fbuf" and their per frame sums go to the last as many
+// doubles of "buf", behind them.
+#define BS1770_KW_FRAMES(kw) \
+  ((kw)->mode&BS1770_MODE_F32 \
+      ?2*BS1770_KW_BUF_SIZE/((kw)->stride+2) \
+      :BS1770_KW_BUF_SIZE/(kw)->stride)
+
+// K-weighting state of all channels, laid out lane by lane such that
+// channel i of every quantity sits at index i.  Padding lanes up to
+// "stride" carry a zero weight and stay silent.
+typedef struct bs1770_kw {
+  const struct bs1770_kw_ops *ops;
+  int mode;                 // BS1770_MODE_* flags.
+  int channels;             // number of channels filtered.
+  int lanes;                // vector width of the kernel in use.
+  int stride;               // channels rounded up to the vector width.
+  int primed;               // first frame after reset seen.
+
+  struct {
+    double g[BS1770_KW_CHANNELS];
+    double x1[BS1770_KW_CHANNELS], x2[BS1770_KW_CHANNELS];  // pre input.
+    double y1[BS1770_KW_CHANNELS], y2[BS1770_KW_CHANNELS];  // pre output.
+    double z1[BS1770_KW_CHANNELS], z2[BS1770_KW_CHANNELS];  // rlb output.
+  } dbl;
+
+  struct {
+    float g[BS1770_KW_CHANNELS];
+    float x1[BS1770_KW_CHANNELS], x2[BS1770_KW_CHANNELS];
+    float y1[BS1770_KW_CHANNELS], y2[BS1770_KW_CHANNELS];
+    float z1[BS1770_KW_CHANNELS], z2[BS1770_KW_CHANNELS];
+  } flt;                    // state used with BS1770_MODE_F32.
+
+  // interleaved frames, "stride" apart, staged as floats with
+  // BS1770_MODE_F32.
+  union {
+    double buf[BS1770_KW_BUF_SIZE];
+    float fbuf[2*BS1770_KW_BUF_SIZE];
+  };
+} bs1770_kw_t;
+
+// filters "nframes" frames at "buf" in place, replacing each sample by
+// its weighted square g*z*z.  The single precision variant runs on the
+// "flt" state and float frames.
+typedef void (*bs1770_kw_fn_t)(bs1770_kw_t *kw, const biquad_t *pre,
+    const biquad_t *rlb, double *buf, size_t nframes);
+typedef void (*bs1770_kw_fn_f32_t)(bs1770_kw_t *kw, const biquad_t *pre,
+    const biquad_t *rlb, float *buf, size_t nframes);
+
+// filters "nframes" contiguous samples of channel "ch" adding their
+// weighted squares to "wssqs".
+typedef void (*bs1770_kw_block_fn_t)(bs1770_kw_t *kw, const biquad_t *pre,
+    const biquad_t *rlb, int ch, const double *x, double *wssqs,
+    size_t nframes);
+
+typedef struct bs1770_kw_ops {
+  const char *name;
+  int lanes_f64;            // vector width in doubles.
+  int lanes_f32;            // vector width in floats.
+  bs1770_kw_fn_t filter_f64;
+  bs1770_kw_fn_f32_t filter_f32;
+  bs1770_kw_fn_t filter_f64_ftz;      // without explicit denormal flush,
+  bs1770_kw_fn_f32_t filter_f32_ftz;  // to be run with FTZ/DAZ set.
+  bs1770_kw_block_fn_t lookahead_f64; // vectorized along time, or NULL.
+} bs1770_kw_ops_t;
+
+extern const bs1770_kw_ops_t bs1770_kw_scalar;
+#if defined (BS1770_KW_X86)
+extern const bs1770_kw_ops_t bs1770_kw_sse2;
+extern const bs1770_kw_ops_t bs1770_kw_avx2;
+extern const bs1770_kw_ops_t bs1770_kw_avx512;
+#endif
+
+const bs1770_kw_ops_t *bs1770_kw_cpu(void);
+
+// whether planar input is better filtered channel by channel, i.e. by
+// bs1770_kw_filter_block(), than by the channel parallel kernels.
+#define BS1770_KW_BY_CHANNEL(kw) \
+  (1==(kw)->channels||1==(kw)->lanes \
+      ||(BS1770_MODE_LOOKAHEAD==((kw)->mode \
+          &(BS1770_MODE_LOOKAHEAD|BS1770_MODE_F32))&&(kw)->channels<=2))
+
+void bs1770_kw_reset(bs1770_kw_t *kw, int channels, const double *g);
+void bs1770_kw_write_state(const bs1770_kw_t *kw, bs1770_hist_writer_t *w);
+int bs1770_kw_read_state(bs1770_kw_t *kw, bs1770_hist_reader_t *r);
+void bs1770_kw_prime(bs1770_kw_t *kw, const double *frame);
+void bs1770_kw_prime_f32(bs1770_kw_t *kw, const float *frame);
+void bs1770_kw_filter(bs1770_kw_t *kw, const biquad_t *pre,
+    const biquad_t *rlb, double *buf, size_t nframes);
+void bs1770_kw_filter_f32(bs1770_kw_t *kw, const biquad_t *pre,
+    const biquad_t *rlb, float *buf, size_t nframes);
+void bs1770_kw_filter_block(bs1770_kw_t *kw, const biquad_t *pre,
+    const biquad_t *rlb, int ch, const double *x, double *wssqs,
+    size_t nframes);
+void bs1770_kw_filter_block_f32(bs1770_kw_t *kw, const biquad_t *pre,
+    const biquad_t *rlb, int ch, const float *x, double *wssqs,
+    size_t nframes);
 
 /// bs1770 ////////////////////////////////////////////////////////////////////
 typedef struct bs1770 {
@@ -101,12 +389,8 @@ typedef struct bs1770 {
   int channels;
   biquad_t pre;
   biquad_t rlb;
-
-  struct {
-    double buf[BS1770_MAX_CHANNELS][BS1770_BUF_SIZE];
-    int offs;
-    int size;
-  } ring;
+  double g[BS1770_MAX_CHANNELS];  // channel weights.
+  bs1770_kw_t kw;
 
   bs1770_aggr_t *lufs;
   bs1770_aggr_t *lra;
@@ -118,6 +402,9 @@ bs1770_t *bs1770_cleanup(bs1770_t *bs1770);
 
 bs1770_t *bs1770_reset(bs1770_t *bs1770);
 
+// arms "pre" and "rlb" for "fs", unless they already are.
+void bs1770_requantize(double fs, biquad_t *pre, biquad_t *rlb);
+
 // interleaved
 void bs1770_add_samples_i_i16(bs1770_t *bs1770, double fs, int channels,
     bs1770_i16_t *samples, size_t nsamples);
@@ -148,11 +435,24 @@ void bs1770_add_sample_f32(bs1770_t *bs1770, double fs, int channels,
 void bs1770_add_sample_f64(bs1770_t *bs1770, double fs, int channels,
     bs1770_sample_f64_t sample);
 
+void bs1770_set_mode(bs1770_t *bs1770, int mode);
+void bs1770_set_weights(bs1770_t *bs1770, int channels, const double *g);
 void bs1770_set_fs(bs1770_t *bs1770, double fs, int channels);
+void bs1770_refuse(bs1770_t *bs1770);
+void bs1770_write_state(const bs1770_t *bs1770, bs1770_hist_writer_t *w);
+int bs1770_read_state(bs1770_t *bs1770, bs1770_hist_reader_t *r);
+void bs1770_add_frames(bs1770_t *bs1770, size_t nframes);
+void bs1770_add_block(bs1770_t *bs1770, const double *const *x,
+    size_t nframes);
+void bs1770_add_block_f32(bs1770_t *bs1770, const float *const *x,
+    size_t nframes);
 void bs1770_flush(bs1770_t *bs1770);
 
-double bs1770_track_lufs(bs1770_t *bs1770, double reference);
-double bs1770_track_lra(bs1770_t *bs1770, double lower, double upper);
+// both also give the value from the blocks kept with BS1770_PS_EXACT in
+// "*exact" unless NULL, NaN if none are kept.
+double bs1770_track_lufs(bs1770_t *bs1770, double reference, double *exact);
+double bs1770_track_lra(bs1770_t *bs1770, double lower, double upper,
+    double *exact);
 
 /// bs1770_stats //////////////////////////////////////////////////////////////
 typedef struct bs1770_stats {
@@ -160,22 +460,48 @@ typedef struct bs1770_stats {
   bs1770_hist_t *album;
   bs1770_hist_t track;
   bs1770_aggr_t aggr;
+  double exact;             // of the last track taken, NaN if none.
 } bs1770_stats_t;
 
 bs1770_stats_t *bs1770_stats_init(bs1770_stats_t *stats, bs1770_hist_t *album,
     const bs1770_ps_t *ps);
 bs1770_stats_t *bs1770_stats_cleanup(bs1770_stats_t *stats);
+void bs1770_stats_reset(bs1770_stats_t *stats);
+
+/// bs1770_snap ///////////////////////////////////////////////////////////////
+// the snapshots of a track published by its thread for any other to read,
+// laid out in bs1770_snap.c only, keeping its atomics out of the headers.
+bs1770_snap_t *bs1770_snap_new(bs1770_arena_t *arena);
+void bs1770_snap_free(bs1770_snap_t *snap, bs1770_arena_t *arena);
+
+void bs1770_snap_reset(bs1770_snap_t *snap);
+// publishes every "every" hops of the loudness blocks, 0 for never, with
+// the LRA of "lra" if not NULL.
+void bs1770_snap_set(bs1770_snap_t *snap, uint64_t every,
+    const bs1770_aggr_t *lra);
+// called by the aggregator "lufs" with every hop.
+void bs1770_snap_publish(bs1770_snap_t *snap, const bs1770_aggr_t *lufs);
+// returns 0 if nothing was published yet.
+int bs1770_snap_read(const bs1770_snap_t *snap, bs1770_snapshot_t *snapshot);
 
 /// bs1770_nd /////////////////////////////////////////////////////////////////
 typedef struct bs1770_nd {
   bs1770_stats_t lufs;
   bs1770_stats_t lra;
   bs1770_t bs1770;
+  bs1770_snap_t *snap;
 } bs1770_nd_t;
 
 bs1770_nd_t *bs1770_nd_init(bs1770_nd_t *nd, bs1770_ctx_t *ctx,
     const bs1770_ps_t *lufs, const bs1770_ps_t *lra);
 bs1770_nd_t *bs1770_nd_cleanup(bs1770_nd_t *node);
+void bs1770_nd_reset(bs1770_nd_t *node);
+
+// the album histograms the tracks finished by the node are added to.
+void bs1770_nd_set_album(bs1770_nd_t *node, bs1770_hist_t *lufs,
+    bs1770_hist_t *lra);
+void bs1770_nd_set_mode(bs1770_nd_t *node, int mode);
+void bs1770_nd_set_weights(bs1770_nd_t *node, int channels, const double *g);
 
 // interleaved
 void bs1770_nd_add_samples_i_i16(bs1770_nd_t *node, double fs, int channels,
@@ -210,13 +536,57 @@ void bs1770_nd_add_sample_f64(bs1770_nd_t *node, double fs, int channels,
 double bs1770_nd_track_lufs(bs1770_nd_t *node, double reference);
 double bs1770_nd_track_lra(bs1770_nd_t *node, double lower, double upper);
 
+/// bs1770_batch //////////////////////////////////////////////////////////////
+// K-weighting of all the same-width tracks of a context by a single kernel
+// run, the channels of track i occupying the lanes from i*channels on.  The
+// weighted sums of squares of each track go to the aggregators of its node.
+typedef struct bs1770_batch {
+  double fs;
+  int channels;             // per track.
+  biquad_t pre;
+  biquad_t rlb;
+  bs1770_kw_t kw;
+  double sqs[BS1770_KW_BUF_SIZE];   // per frame sums of one track.
+} bs1770_batch_t;
+
+bs1770_batch_t *bs1770_batch_open(bs1770_ctx_t *ctx);
+void bs1770_batch_close(bs1770_batch_t *batch);
+
+void bs1770_batch_reset(bs1770_batch_t *batch);
+void bs1770_batch_set_fs(bs1770_ctx_t *ctx, double fs, int channels);
+void bs1770_batch_add_frames(bs1770_ctx_t *ctx, size_t nframes);
+void bs1770_batch_flush(bs1770_ctx_t *ctx);
+
 /// bs1770_ctx ////////////////////////////////////////////////////////////////
+// the album histograms of one of the threads driving the tracks of a
+// context, added to the album only on demand.  Each is taken from the
+// arena on cache lines of its own, apart from those of the other threads.
+typedef struct bs1770_shard {
+  bs1770_hist_t lufs;
+  bs1770_hist_t lra;
+} bs1770_shard_t;
+
 struct bs1770_ctx {
+  bs1770_arena_t arena;     // of the histograms, aggregators and nodes.
   bs1770_hist_t lufs;
   bs1770_hist_t lra;
+
+  struct {
+    bs1770_ps_t lufs;       // of the album, for its shards.
+    bs1770_ps_t lra;
+  } ps;
+
   size_t size;
   bs1770_nd_t node;
   bs1770_nd_t *nodes;
+  bs1770_batch_t *batch;    // allocated with the first batched samples.
+  size_t nshards;           // 0 if the tracks add to the album directly.
+  bs1770_shard_t **shards;
+
+  struct {
+    double lufs;            // of the last album taken, NaN if none.
+    double lra;
+  } exact;
 };
 
 bs1770_ctx_t *bs1770_ctx_init(bs1770_ctx_t *ctx, size_t size,
@@ -224,6 +594,18 @@ bs1770_ctx_t *bs1770_ctx_init(bs1770_ctx_t *ctx, size_t size,
 bs1770_ctx_t *bs1770_ctx_init_r128(bs1770_ctx_t *ctx, size_t size);
 bs1770_ctx_t *bs1770_ctx_cleanup(bs1770_ctx_t *ctx);
 
+/// bs1770_pool ///////////////////////////////////////////////////////////////
+struct bs1770_pool {
+  size_t size;              // tracks per context.
+  bs1770_ps_t lufs;
+  bs1770_ps_t lra;
+  int has_lra;
+  size_t layout;            // bytes of a context and its arena, 0 if unknown.
+  size_t max;
+  size_t used;              // number of idle contexts.
+  bs1770_ctx_t **idle;
+};
+
 /// bs1770_default/////////////////////////////////////////////////////////////
 bs1770_ctx_t *bs1770_ctx_init_default(bs1770_ctx_t *ctx, size_t size);
 double bs1770_ctx_track_lufs_default(bs1770_ctx_t *ctx, size_t i);
@@ -21,20 +21,19 @@
 #include "bs1770.h"
 #include "bs1770_types.h"
 
-#define IS_DEN(x) \
-    (fabs(den_tmp=(x))<1.0e-15)
-#define DEN(x) \
-    (IS_DEN(x)?0.0:den_tmp)
-
-#define GET(buf,offs,i) \
-    ((buf)[(get_tmp=(offs)+(i))<0?BS1770_BUF_SIZE+get_tmp:get_tmp])
-
-#define GETX(buf,offs,i)  GET(buf,offs,i)
-#define GETY(buf,offs,i)  GET(buf,(offs)-6,i)
-#define GETZ(buf,offs,i)  GET(buf,(offs)-3,i)
+#if defined (FLOAT)
+  #define CONVERT(x)          ((double)(x))
+#else
+  #define CONVERT(x)          ((double)(x)/MAX)
+#endif
 
-#define MIN(x,y) \
-  ((x)<(y)?x:y)
+#if defined (PLANAR)
+  #define SAMPLE(i,j)         CONVERT(samples[i][offs+(j)])
+#elif defined (INTERLEAVED)
+  #define SAMPLE(i,j)         CONVERT(samples[(j)*channels+(i)])
+#else
+  #define SAMPLE(i,j)         CONVERT(sample[i])
+#endif
 
 #if defined (PLANAR)
 void FN(bs1770_add_samples)(bs1770_t *bs1770, double fs, int channels,
@@ -47,87 +46,122 @@ void FN(bs1770_add_sample)(bs1770_t *bs1770, double fs, int channels,
     TP sample)
 #endif
 {
-  biquad_t *pre=&bs1770->pre;
-  biquad_t *rlb=&bs1770->rlb;
-  double wssqs=0.0;
-  double *g;
-  int offs, size, i;
-  int get_tmp;
-  double den_tmp;
-#if defined (PLANAR)
-  int j;
-#elif defined (INTERLEAVED)
-  TP *max_samples=samples+nsamples*channels;
+  bs1770_kw_t *kw=&bs1770->kw;
+  double *wp;
+  float *fp;
+  int i;
+#if defined (PLANAR) || defined (INTERLEAVED)
+  size_t offs=0;
+  size_t size, n, j;
 #endif
 
+  if (channels<1||BS1770_MAX_CHANNELS<channels) {
+    // rather than measuring only some of the channels.
+    bs1770_refuse(bs1770);
+    return;
+  }
+  else if (bs1770->fs!=fs||bs1770->channels!=channels)
+    bs1770_set_fs(bs1770, fs, channels);
+
 #if defined (PLANAR)
-  for (j=0;j<nsamples;++j) {
-#elif defined (INTERLEAVED)
-  while (samples<max_samples) {
-#endif
-    g=BS1770_G;
-    wssqs=0.0;
+  if (BS1770_KW_BY_CHANNEL(kw)&&(kw->mode&BS1770_MODE_F32)) {
+  #if defined (BS1770_F32)
+    bs1770_add_block_f32(bs1770,(const float *const *)samples,nsamples);
+  #else
+    size=BS1770_KW_BLOCK_SIZE(kw);
 
-    if (bs1770->fs!=fs)
-      bs1770_set_fs(bs1770, fs, channels);
+    while (offs<nsamples) {
+      const float *x[BS1770_MAX_CHANNELS];
 
-    offs=bs1770->ring.offs;
-    size=bs1770->ring.size;
+      n=nsamples-offs<size?nsamples-offs:size;
 
-    for (i=0;i<MIN(channels,BS1770_MAX_CHANNELS);++i) {
-      double *buf=bs1770->ring.buf[i];
-#if defined (PLANAR)
-  #if defined (FLOAT)
-      double y=samples[i][j];
-  #else
-      double y=(double)samples[i][j]/MAX;
-  #endif
-#elif defined (INTERLEAVED)
-  #if defined (FLOAT)
-      double y=*samples++;
-  #else
-      double y=(double)*samples++/MAX;
+      for (i=0;i<kw->channels;++i) {
+        fp=kw->fbuf+i*size;
+        x[i]=fp;
+
+        for (j=0;j<n;++j)
+          fp[j]=(float)SAMPLE(i,j);
+      }
+
+      bs1770_add_block_f32(bs1770,x,n);
+      offs+=n;
+    }
   #endif
-#else
-  #if defined (FLOAT)
-      double y=sample[i];
+
+    return;
+  }
+  else if (BS1770_KW_BY_CHANNEL(kw)) {
+  #if defined (BS1770_F64)
+    bs1770_add_block(bs1770,(const double *const *)samples,nsamples);
   #else
-      double y=(double)sample[i]/MAX;
-  #endif
-#endif
-      double x=GETX(buf,offs,0)=DEN(y);
-
-      if (1<size) {
-        double y=GETY(buf,offs,0)=DEN(pre->b0*x
-          +pre->b1*GETX(buf,offs,-1)+pre->b2*GETX(buf,offs,-2)
-          -pre->a1*GETY(buf,offs,-1)-pre->a2*GETY(buf,offs,-2))
-          ;
-        double z=GETZ(buf,offs,0)=DEN(rlb->b0*y
-          +rlb->b1*GETY(buf,offs,-1)+rlb->b2*GETY(buf,offs,-2)
-          -rlb->a1*GETZ(buf,offs,-1)-rlb->a2*GETZ(buf,offs,-2))
-          ;
-        wssqs+=(*g++)*z*z;
-        ++buf;
+    size=BS1770_KW_BLOCK_SIZE(kw);
+
+    while (offs<nsamples) {
+      const double *x[BS1770_MAX_CHANNELS];
+
+      n=nsamples-offs<size?nsamples-offs:size;
+
+      for (i=0;i<kw->channels;++i) {
+        wp=kw->buf+i*size;
+        x[i]=wp;
+
+        for (j=0;j<n;++j)
+          wp[j]=SAMPLE(i,j);
       }
+
+      bs1770_add_block(bs1770,x,n);
+      offs+=n;
     }
+  #endif
+
+    return;
+  }
+#endif
+
+#if defined (PLANAR) || defined (INTERLEAVED)
+  size=BS1770_KW_FRAMES(kw);
+
+  while (offs<nsamples) {
+    n=nsamples-offs<size?nsamples-offs:size;
 
-    if (NULL!=bs1770->lufs)
-      bs1770_aggr_add_sqs(bs1770->lufs,fs,wssqs);
+    if (kw->mode&BS1770_MODE_F32) {
+      // single precision frames, see BS1770_KW_FRAMES().
+      fp=kw->fbuf;
 
-    if (NULL!=bs1770->lra)
-      bs1770_aggr_add_sqs(bs1770->lra,fs,wssqs);
+      for (j=0;j<n;++j,fp+=kw->stride) {
+        for (i=0;i<kw->channels;++i)
+          fp[i]=(float)SAMPLE(i,j);
+      }
+    }
+    else {
+      wp=kw->buf;
 
-    if (size<2)
-      ++bs1770->ring.size;
+      for (j=0;j<n;++j,wp+=kw->stride) {
+        for (i=0;i<kw->channels;++i)
+          wp[i]=SAMPLE(i,j);
+      }
+    }
 
-    if (++bs1770->ring.offs==BS1770_BUF_SIZE)
-      bs1770->ring.offs=0;
+  #if defined (INTERLEAVED)
+    samples+=n*channels;
+  #endif
+    bs1770_add_frames(bs1770,n);
+    offs+=n;
+  }
+#else
+  if (kw->mode&BS1770_MODE_F32) {
+    fp=kw->fbuf;
 
-#if defined (INTERLEAVED)
-    if (i<channels)
-      samples+=channels-i;
+    for (i=0;i<kw->channels;++i)
+      fp[i]=(float)SAMPLE(i,0);
   }
-#elif defined (PLANAR)
+  else {
+    wp=kw->buf;
+
+    for (i=0;i<kw->channels;++i)
+      wp[i]=SAMPLE(i,0);
   }
+
+  bs1770_add_frames(bs1770,1);
 #endif
 }
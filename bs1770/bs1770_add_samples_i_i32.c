@@ -0,0 +1 @@
+#include "bs1770_add_samples.c"
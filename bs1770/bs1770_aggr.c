@@ -44,8 +44,28 @@ void bs1770_aggr_reset(bs1770_aggr_t *aggr)
   aggr->scale=0.0;
 
   aggr->blocks.wmsq[aggr->blocks.offs=0]=0.0;
+  aggr->blocks.sum=0.0;
   aggr->blocks.count=0;
   aggr->blocks.used=1;
+
+  aggr->hops.used=0;
+  aggr->hops.offs=0;
+  aggr->hops.count=0;
+  aggr->hops.sum=0.0;
+}
+
+void bs1770_aggr_reset_track(bs1770_aggr_t *aggr)
+{
+  aggr->window.from=0.0;
+  aggr->window.to=HUGE_VAL;
+
+  aggr->max.momentary=-1.0;
+  aggr->max.shortterm=-1.0;
+  aggr->max.partial=-1.0;
+
+  aggr->last.t=0.0;
+  aggr->last.momentary=0.0;
+  aggr->last.shortterm=0.0;
 }
 
 static void bs1770_aggr_set_fs(bs1770_aggr_t *aggr, double fs)
@@ -58,53 +78,312 @@ static void bs1770_aggr_set_fs(bs1770_aggr_t *aggr, double fs)
   aggr->scale=1.0/(double)aggr->block_size;
 
   aggr->blocks.wmsq[aggr->blocks.offs=0]=0.0;
+  aggr->blocks.sum=0.0;
   aggr->blocks.count=0;
   aggr->blocks.used=1;
+
+  aggr->hops.used=0;
+  aggr->hops.offs=0;
+  aggr->hops.count=0;
+  aggr->hops.sum=0.0;
+}
+
+#define LUFS(wmsq) \
+  (0.0<(wmsq)?-0.691+10.0*log10(wmsq):-HUGE_VAL)
+
+// pushes the sum of squares of the current hop into the short-term window
+// and returns the window's mean square.
+static double bs1770_aggr_shortterm(bs1770_aggr_t *aggr)
+{
+  double *sqs=aggr->hops.sqs;
+  size_t size=aggr->hops.size;
+  double sum=aggr->blocks.sum;
+  size_t i;
+
+  if (aggr->hops.used<size) {
+    sqs[aggr->hops.used++]=sum;
+    aggr->hops.sum+=sum;
+  }
+  else {
+    aggr->hops.sum+=sum-sqs[aggr->hops.offs];
+    sqs[aggr->hops.offs]=sum;
+
+    if (++aggr->hops.offs==size) {
+      // summed up anew once per window, the running sum would drift.
+      for (sum=0.0,i=0;i<size;++i)
+        sum+=sqs[i];
+
+      aggr->hops.sum=sum;
+      aggr->hops.offs=0;
+    }
+  }
+
+  return aggr->hops.sum/(double)(aggr->hops.used*aggr->overlap_size);
 }
 
-void bs1770_aggr_add_sqs(bs1770_aggr_t *aggr, double fs, double wssqs)
+// closes the current hop: its partial sum is distributed to all the
+// blocks overlapping it and the oldest block, if complete, is handed over
+// to the histogram.
+static void bs1770_aggr_hop(bs1770_aggr_t *aggr)
 {
   double *wmsq=aggr->blocks.wmsq;
+  double *wp=wmsq;
+  double *mp=wp+aggr->blocks.used;
+  double wssqs=aggr->scale*aggr->blocks.sum;
+  size_t next_offs=aggr->blocks.offs+1;
+  double shortterm, t;
+  int inside;
+
+  while (wp<mp)
+    (*wp++)+=wssqs;
+
+  if (next_offs==aggr->blocks.size)
+    next_offs=0;
 
+  ++aggr->hops.count;
+  shortterm=bs1770_aggr_shortterm(aggr);
+  t=(double)(aggr->hops.count*aggr->overlap_size)/aggr->fs;
+  inside=aggr->window.from<t&&t<=aggr->window.to;
+
+  if (inside) {
+    if (aggr->hops.used<aggr->hops.size)
+      aggr->max.partial=shortterm;
+    else if (aggr->max.shortterm<shortterm)
+      aggr->max.shortterm=shortterm;
+  }
+
+  if (inside&&aggr->blocks.used==aggr->blocks.size) {
+    double prev_wmsq=wmsq[next_offs];
+
+    if (aggr->gate<prev_wmsq)
+      bs1770_hist_inc_bin(aggr->track,prev_wmsq);
+
+    if (aggr->max.momentary<prev_wmsq)
+      aggr->max.momentary=prev_wmsq;
+
+    aggr->last.t=t;
+    aggr->last.momentary=prev_wmsq;
+    aggr->last.shortterm=shortterm;
+
+    if (NULL!=aggr->series.fn)
+      aggr->series.fn(aggr->series.data,t,LUFS(prev_wmsq),LUFS(shortterm));
+
+    if (NULL!=aggr->snap)
+      bs1770_snap_publish(aggr->snap,aggr);
+  }
+
+  wmsq[next_offs]=0.0;
+  aggr->blocks.sum=0.0;
+  aggr->blocks.count=0;
+  aggr->blocks.offs=next_offs;
+
+  if (aggr->blocks.used<aggr->blocks.size)
+    ++aggr->blocks.used;
+}
+
+void bs1770_aggr_add_sqs(bs1770_aggr_t *aggr, double fs, const double *wssqs,
+    size_t n)
+{
   if (aggr->fs!=fs)
     bs1770_aggr_set_fs(aggr, fs);
 
-  if (1.0e-15<=wssqs) {
-    double *wp=wmsq;
-    double *mp=wp+aggr->blocks.used;
+  while (0<n) {
+    size_t m=aggr->overlap_size-aggr->blocks.count;
+    const double *mp;
+    double sum;
+
+    if (n<m)
+      m=n;
+
+    mp=wssqs+m;
+    sum=aggr->blocks.sum;
+
+    while (wssqs<mp)
+      sum+=*wssqs++;
 
-    wssqs*=aggr->scale;
+    aggr->blocks.sum=sum;
+    aggr->blocks.count+=m;
+    n-=m;
 
-    while (wp<mp)
-      (*wp++)+=wssqs;
+    if (aggr->blocks.count==aggr->overlap_size)
+      bs1770_aggr_hop(aggr);
   }
+}
+
+void bs1770_aggr_set_series(bs1770_aggr_t *aggr, bs1770_series_t fn,
+    void *data)
+{
+  aggr->series.fn=fn;
+  aggr->series.data=data;
+}
+
+void bs1770_aggr_set_window(bs1770_aggr_t *aggr, double from, double to)
+{
+  aggr->window.from=from;
+  aggr->window.to=to;
+}
 
-  if (++aggr->blocks.count==aggr->overlap_size) {
-    int next_offs=aggr->blocks.offs+1;
+void bs1770_aggr_set_snap(bs1770_aggr_t *aggr, bs1770_snap_t *snap)
+{
+  aggr->snap=snap;
+}
 
-    if (next_offs==aggr->blocks.size)
-      next_offs=0;
+void bs1770_aggr_snapshot(const bs1770_aggr_t *aggr, const bs1770_aggr_t *lra,
+    bs1770_snapshot_t *snapshot)
+{
+  bs1770_aggr_peek(aggr,lra,snapshot);
+  snapshot->lufs=bs1770_hist_get_lufs(aggr->track,-HUGE_VAL);
+  snapshot->lra=NULL!=lra
+      ?bs1770_hist_get_lra(lra->track,BS1770_LOWER,BS1770_UPPER):0.0;
+}
 
-    if (aggr->blocks.used==aggr->blocks.size) {
-      double prev_wmsq=wmsq[next_offs];
+void bs1770_aggr_peek(const bs1770_aggr_t *aggr, const bs1770_aggr_t *lra,
+    bs1770_snapshot_t *snapshot)
+{
+  snapshot->t=aggr->last.t;
+  snapshot->lufs=NULL!=aggr->track->index.count
+      ?bs1770_hist_get_lufs(aggr->track,-HUGE_VAL):NAN;
 
-      if (aggr->gate<prev_wmsq)
-        bs1770_hist_inc_bin(aggr->track,prev_wmsq);
-    }
+  if (NULL==lra)
+    snapshot->lra=0.0;
+  else if (NULL!=lra->track->index.count)
+    snapshot->lra=bs1770_hist_get_lra(lra->track,BS1770_LOWER,BS1770_UPPER);
+  else
+    snapshot->lra=NAN;
+
+  snapshot->momentary=LUFS(aggr->last.momentary);
+  snapshot->shortterm=LUFS(aggr->last.shortterm);
+  snapshot->max_momentary=bs1770_aggr_max_momentary(aggr);
+  snapshot->max_shortterm=bs1770_aggr_max_shortterm(aggr);
+}
+
+// f64 rate, u64 overlap and block size, f64 scale, the block ring as u32
+// size, used and offs, u64 count, f64 sum and f64 blocks, the hop ring
+// likewise and finally the window and the maxima as f64.
+void bs1770_aggr_write_state(const bs1770_aggr_t *aggr,
+    bs1770_hist_writer_t *w)
+{
+  size_t i;
+
+  bs1770_hist_put_f64(w,aggr->fs);
+  bs1770_hist_put(w,aggr->overlap_size,8);
+  bs1770_hist_put(w,aggr->block_size,8);
+  bs1770_hist_put_f64(w,aggr->scale);
+
+  bs1770_hist_put(w,aggr->blocks.size,4);
+  bs1770_hist_put(w,aggr->blocks.used,4);
+  bs1770_hist_put(w,aggr->blocks.offs,4);
+  bs1770_hist_put(w,aggr->blocks.count,8);
+  bs1770_hist_put_f64(w,aggr->blocks.sum);
+
+  for (i=0;i<aggr->blocks.size;++i)
+    bs1770_hist_put_f64(w,aggr->blocks.wmsq[i]);
+
+  bs1770_hist_put(w,aggr->hops.size,4);
+  bs1770_hist_put(w,aggr->hops.used,4);
+  bs1770_hist_put(w,aggr->hops.offs,4);
+  bs1770_hist_put(w,aggr->hops.count,8);
+  bs1770_hist_put_f64(w,aggr->hops.sum);
+
+  for (i=0;i<aggr->hops.size;++i)
+    bs1770_hist_put_f64(w,aggr->hops.sqs[i]);
 
-    aggr->blocks.wmsq[next_offs]=0.0;
-    aggr->blocks.count=0;
-    aggr->blocks.offs=next_offs;
+  bs1770_hist_put_f64(w,aggr->window.from);
+  bs1770_hist_put_f64(w,aggr->window.to);
+  bs1770_hist_put_f64(w,aggr->max.momentary);
+  bs1770_hist_put_f64(w,aggr->max.shortterm);
+  bs1770_hist_put_f64(w,aggr->max.partial);
+}
+
+// into an aggregator of the same block and hop ring sizes, keeping its
+// series callback.  the sizes and the scale follow from the rate and have
+// to match those derived here, or e.g. a zero hop would never end.
+int bs1770_aggr_read_state(bs1770_aggr_t *aggr, bs1770_hist_reader_t *r)
+{
+  double fs=bs1770_hist_get_f64(r);
+  uint64_t overlap_size=bs1770_hist_get(r,8);
+  uint64_t block_size=bs1770_hist_get(r,8);
+  double scale=bs1770_hist_get_f64(r);
+  size_t i;
+
+  if (r->error)
+    return -1;
+  else if (0.0==fs)
+    bs1770_aggr_reset(aggr);  // no samples yet.
+  else if (!(0.0<fs&&fs<HUGE_VAL))
+    return -1;
+  else {
+    bs1770_aggr_set_fs(aggr, fs);
 
-    if (aggr->blocks.used<aggr->blocks.size)
-      ++aggr->blocks.used;
+    if (0==aggr->overlap_size)
+      return -1;
   }
+
+  if ((uint64_t)aggr->overlap_size!=overlap_size
+      ||(uint64_t)aggr->block_size!=block_size||aggr->scale!=scale)
+    return -1;
+  else if ((uint64_t)aggr->blocks.size!=bs1770_hist_get(r,4))
+    return -1;
+
+  aggr->blocks.used=(size_t)bs1770_hist_get(r,4);
+  aggr->blocks.offs=(size_t)bs1770_hist_get(r,4);
+  aggr->blocks.count=(size_t)bs1770_hist_get(r,8);
+  aggr->blocks.sum=bs1770_hist_get_f64(r);
+
+  if (r->error||aggr->blocks.size<aggr->blocks.used||0==aggr->blocks.used
+      ||aggr->blocks.size<=aggr->blocks.offs)
+    return -1;
+  else if (0<aggr->overlap_size?aggr->overlap_size<=aggr->blocks.count
+      :0!=aggr->blocks.count)
+    return -1;
+
+  for (i=0;i<aggr->blocks.size;++i)
+    aggr->blocks.wmsq[i]=bs1770_hist_get_f64(r);
+
+  if ((uint64_t)aggr->hops.size!=bs1770_hist_get(r,4))
+    return -1;
+
+  aggr->hops.used=(size_t)bs1770_hist_get(r,4);
+  aggr->hops.offs=(size_t)bs1770_hist_get(r,4);
+  aggr->hops.count=bs1770_hist_get(r,8);
+  aggr->hops.sum=bs1770_hist_get_f64(r);
+
+  if (r->error||aggr->hops.size<aggr->hops.used
+      ||aggr->hops.size<=aggr->hops.offs)
+    return -1;
+
+  for (i=0;i<aggr->hops.size;++i)
+    aggr->hops.sqs[i]=bs1770_hist_get_f64(r);
+
+  aggr->window.from=bs1770_hist_get_f64(r);
+  aggr->window.to=bs1770_hist_get_f64(r);
+  aggr->max.momentary=bs1770_hist_get_f64(r);
+  aggr->max.shortterm=bs1770_hist_get_f64(r);
+  aggr->max.partial=bs1770_hist_get_f64(r);
+
+  return r->error?-1:0;
+}
+
+double bs1770_aggr_max_momentary(const bs1770_aggr_t *aggr)
+{
+  return LUFS(aggr->max.momentary);
+}
+
+double bs1770_aggr_max_shortterm(const bs1770_aggr_t *aggr)
+{
+  if (0.0<=aggr->max.shortterm)
+    return LUFS(aggr->max.shortterm);
+  else
+    return LUFS(aggr->max.partial);
 }
 
 bs1770_aggr_t *bs1770_aggr_cleanup(bs1770_aggr_t *aggr)
 {
+  if (NULL!=aggr->hops.sqs)
+    bs1770_arena_free(aggr->arena,aggr->hops.sqs);
+
   if (NULL!=aggr->blocks.wmsq)
-    free(aggr->blocks.wmsq);
+    bs1770_arena_free(aggr->arena,aggr->blocks.wmsq);
 
   return aggr;
 }
@@ -112,18 +391,33 @@ bs1770_aggr_t *bs1770_aggr_cleanup(bs1770_aggr_t *aggr)
 bs1770_aggr_t *bs1770_aggr_init(bs1770_aggr_t *aggr, const bs1770_ps_t *ps,
     bs1770_hist_t *track, bs1770_hist_t *album)
 {
-
+  aggr->arena=track->arena;
   aggr->gate=SILENCE_GATE;
   aggr->length=0.001*ps->ms;
   aggr->partition=ps->partition;
 
   aggr->blocks.size=ps->partition;
   aggr->blocks.wmsq=NULL;
+  // hops of length/partition s each.
+  aggr->hops.size=round(0.001*BS1770_SHORT_TERM*ps->partition/aggr->length);
+  aggr->hops.sqs=NULL;
+
+  if (aggr->hops.size<1)
+    aggr->hops.size=1;
+
+  aggr->series.fn=NULL;
+  aggr->series.data=NULL;
+  aggr->snap=NULL;
   
-  if (NULL==(aggr->blocks.wmsq=malloc(BLOCK_SIZE(aggr->blocks.size))))
+  if (NULL==(aggr->blocks.wmsq=bs1770_arena_alloc(aggr->arena,
+      BLOCK_SIZE(aggr->blocks.size))))
+    goto error;
+  else if (NULL==(aggr->hops.sqs=bs1770_arena_alloc(aggr->arena,
+      aggr->hops.size*sizeof aggr->hops.sqs[0])))
     goto error;
 
   bs1770_aggr_reset(aggr);
+  bs1770_aggr_reset_track(aggr);
   aggr->track=track;
   aggr->album=album;
 
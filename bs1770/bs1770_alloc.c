@@ -0,0 +1,122 @@
+/*
+ * bs1770_alloc.c
+ * Copyright (C) 2011, 2012 Peter Belkner <pbelkner@snafu.de>
+ * 
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ * 
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ * 
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston,
+ * MA  02110-1301  USA
+ */
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include "bs1770.h"
+
+static void *bs1770_std_alloc(void *data, size_t size)
+{
+  return malloc(size);
+}
+
+static void bs1770_std_release(void *data, void *p)
+{
+  free(p);
+}
+
+static bs1770_allocator_t bs1770_allocator={
+  bs1770_std_alloc,
+  bs1770_std_release,
+  NULL
+};
+
+void bs1770_set_allocator(const bs1770_allocator_t *allocator)
+{
+  if (NULL!=allocator)
+    bs1770_allocator=*allocator;
+  else {
+    bs1770_allocator.alloc=bs1770_std_alloc;
+    bs1770_allocator.release=bs1770_std_release;
+    bs1770_allocator.data=NULL;
+  }
+}
+
+void *bs1770_malloc(size_t size)
+{
+  return bs1770_allocator.alloc(bs1770_allocator.data,size);
+}
+
+void bs1770_free(void *p)
+{
+  if (NULL!=p)
+    bs1770_allocator.release(bs1770_allocator.data,p);
+}
+
+/// arena /////////////////////////////////////////////////////////////////////
+// a buffer taken from the heap starts on the line following the block
+// actually allocated, right behind a pointer to the latter.
+static void *bs1770_line_malloc(size_t size)
+{
+  unsigned char *q=bs1770_malloc(size+BS1770_ARENA_LINE);
+  unsigned char *p;
+
+  if (NULL==q)
+    return NULL;
+
+  p=q+BS1770_ARENA_LINE-((uintptr_t)q&(BS1770_ARENA_LINE-1));
+  memcpy(p-sizeof q,&q,sizeof q);
+
+  return p;
+}
+
+static void bs1770_line_free(void *p)
+{
+  unsigned char *q;
+
+  if (NULL!=p) {
+    memcpy(&q,(unsigned char *)p-sizeof q,sizeof q);
+    bs1770_free(q);
+  }
+}
+
+void *bs1770_arena_alloc(bs1770_arena_t *arena, size_t size)
+{
+  size_t n=BS1770_ARENA_ALIGN(size);
+  unsigned char *p;
+
+  if (NULL==arena)
+    return bs1770_line_malloc(n);
+  else if (NULL==arena->base) {
+    // only measuring.
+    arena->used+=n;
+
+    return bs1770_line_malloc(n);
+  }
+  else if (arena->size-arena->used<n)
+    return bs1770_line_malloc(n);   // e.g. chunks added while running.
+  else {
+    p=arena->base+arena->used;
+    arena->used+=n;
+
+    return p;
+  }
+}
+
+void bs1770_arena_free(bs1770_arena_t *arena, void *p)
+{
+  unsigned char *q=p;
+
+  if (NULL!=arena&&NULL!=arena->base&&arena->base<=q
+      &&q<arena->base+arena->size)
+    return;   // goes with the arena.
+
+  bs1770_line_free(p);
+}
@@ -0,0 +1,180 @@
+/*
+ * bs1770_batch.c
+ * Copyright (C) 2011, 2012 Peter Belkner <pbelkner@snafu.de>
+ * 
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ * 
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ * 
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston,
+ * MA  02110-1301  USA
+ */
+#include <stdlib.h>
+#include <string.h>
+#include "bs1770.h"
+
+bs1770_batch_t *bs1770_batch_open(bs1770_ctx_t *ctx)
+{
+  bs1770_batch_t *batch;
+
+  if (NULL==(batch=bs1770_malloc(sizeof *batch)))
+    return NULL;
+
+  memset(batch,0,sizeof *batch);
+  batch->kw.ops=bs1770_kw_cpu();
+  batch->kw.mode=ctx->nodes[0].bs1770.kw.mode;
+
+  return batch;
+}
+
+void bs1770_batch_close(bs1770_batch_t *batch)
+{
+  bs1770_free(batch);
+}
+
+void bs1770_batch_reset(bs1770_batch_t *batch)
+{
+  batch->fs=0.0;
+  batch->channels=0;
+  batch->kw.primed=0;
+}
+
+void bs1770_batch_set_fs(bs1770_ctx_t *ctx, double fs, int channels)
+{
+  bs1770_batch_t *batch=ctx->batch;
+  double g[BS1770_MAX_CHANNELS];
+  size_t i;
+  int j;
+
+  batch->fs=fs;
+  batch->channels=channels;
+  bs1770_requantize(fs,&batch->pre,&batch->rlb);
+
+  for (i=0;i<ctx->size;++i) {
+    for (j=0;j<channels;++j)
+      g[i*channels+j]=ctx->nodes[i].bs1770.g[j];
+  }
+
+  bs1770_kw_reset(&batch->kw,ctx->size*channels,g);
+}
+
+// filters the first "nframes" frames staged in "kw.buf", or "kw.fbuf" with
+// BS1770_MODE_F32, and hands the weighted sums of squares of each track
+// over to the aggregators of its node.
+void bs1770_batch_add_frames(bs1770_ctx_t *ctx, size_t nframes)
+{
+  bs1770_batch_t *batch=ctx->batch;
+  bs1770_kw_t *kw=&batch->kw;
+  int f32=kw->mode&BS1770_MODE_F32;
+  double *buf=kw->buf;
+  float *fbuf=kw->fbuf;
+  int stride=kw->stride;
+  size_t i,j;
+  int k;
+
+  if (0==nframes)
+    return;
+
+  if (!kw->primed) {
+    // the very first frame only fills the filters' history.
+    if (f32)
+      bs1770_kw_prime_f32(kw,fbuf);
+    else
+      bs1770_kw_prime(kw,buf);
+
+    batch->sqs[0]=0.0;
+
+    for (i=0;i<ctx->size;++i) {
+      bs1770_t *bs1770=&ctx->nodes[i].bs1770;
+
+      if (NULL!=bs1770->lufs)
+        bs1770_aggr_add_sqs(bs1770->lufs,batch->fs,batch->sqs,1);
+
+      if (NULL!=bs1770->lra)
+        bs1770_aggr_add_sqs(bs1770->lra,batch->fs,batch->sqs,1);
+    }
+
+    buf+=stride;
+    fbuf+=stride;
+    --nframes;
+  }
+
+  if (f32)
+    bs1770_kw_filter_f32(kw,&batch->pre,&batch->rlb,fbuf,nframes);
+  else
+    bs1770_kw_filter(kw,&batch->pre,&batch->rlb,buf,nframes);
+
+  for (i=0;i<ctx->size;++i) {
+    bs1770_t *bs1770=&ctx->nodes[i].bs1770;
+
+    if (f32) {
+      const float *rp=fbuf+i*batch->channels;
+
+      for (j=0;j<nframes;++j,rp+=stride) {
+        double sum=0.0;
+
+        for (k=0;k<batch->channels;++k)
+          sum+=rp[k];
+
+        batch->sqs[j]=sum;
+      }
+    }
+    else {
+      const double *rp=buf+i*batch->channels;
+
+      for (j=0;j<nframes;++j,rp+=stride) {
+        double sum=0.0;
+
+        for (k=0;k<batch->channels;++k)
+          sum+=rp[k];
+
+        batch->sqs[j]=sum;
+      }
+    }
+
+    if (NULL!=bs1770->lufs)
+      bs1770_aggr_add_sqs(bs1770->lufs,batch->fs,batch->sqs,nframes);
+
+    if (NULL!=bs1770->lra)
+      bs1770_aggr_add_sqs(bs1770->lra,batch->fs,batch->sqs,nframes);
+  }
+}
+
+// counterpart of "bs1770_flush()" for all the tracks of the batch.
+void bs1770_batch_flush(bs1770_ctx_t *ctx)
+{
+  bs1770_batch_t *batch=ctx->batch;
+  size_t i;
+  int j;
+
+  if (batch->kw.primed) {
+    for (j=0;j<batch->kw.stride;++j) {
+      if (batch->kw.mode&BS1770_MODE_F32)
+        batch->kw.fbuf[j]=0.0f;
+      else
+        batch->kw.buf[j]=0.0;
+    }
+
+    bs1770_batch_add_frames(ctx,1);
+
+    for (i=0;i<ctx->size;++i) {
+      bs1770_t *bs1770=&ctx->nodes[i].bs1770;
+
+      if (NULL!=bs1770->lufs)
+        bs1770_aggr_reset(bs1770->lufs);
+
+      if (NULL!=bs1770->lra)
+        bs1770_aggr_reset(bs1770->lra);
+    }
+  }
+
+  bs1770_batch_reset(batch);
+}
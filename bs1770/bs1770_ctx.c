@@ -19,39 +19,61 @@
  */
 #include <stdlib.h>
 #include <string.h>
+#include <math.h>
 #include "bs1770.h"
 
+// header of a serialized track: magic, version and number of histograms.
+#define BS1770_CTX_MAGIC        "BS1770"
+#define BS1770_CTX_VERSION      1
+#define BS1770_CTX_HEADER       8
+// the state of a context has the same header with 0 histograms.
+#define BS1770_CTX_STATE_VERSION 2
+
 bs1770_ctx_t *bs1770_ctx_open(size_t size, const bs1770_ps_t *lufs,
     const bs1770_ps_t *lra)
 {
   bs1770_ctx_t *ctx;
 
-  if (NULL==(ctx=malloc(sizeof *ctx)))
+  if (NULL==(ctx=bs1770_malloc(sizeof *ctx)))
     return NULL;
   else if (NULL==bs1770_ctx_init(ctx,size,lufs,lra))
-    { free(ctx); return NULL; }
+    { bs1770_free(ctx); return NULL; }
   else
     return ctx;
 }
 
 void bs1770_ctx_close(bs1770_ctx_t *ctx)
 {
-  free(bs1770_ctx_cleanup(ctx));
+  bs1770_free(bs1770_ctx_cleanup(ctx));
 }
 
-bs1770_ctx_t *bs1770_ctx_init(bs1770_ctx_t *ctx, size_t size, 
-    const bs1770_ps_t *lufs, const bs1770_ps_t *lra)
+// lays the buffers of the context out in the "n" bytes at "base", starting
+// at its first cache line, or takes them from the heap with "base" NULL.
+static bs1770_ctx_t *bs1770_ctx_layout(bs1770_ctx_t *ctx, size_t size,
+    const bs1770_ps_t *lufs, const bs1770_ps_t *lra, void *base, size_t n)
 {
+  size_t pad=NULL!=base
+      ?(size_t)(-(uintptr_t)base&(BS1770_ARENA_LINE-1)):0;
+
   memset(ctx,0,sizeof *ctx);
+  ctx->arena.base=NULL!=base?(unsigned char *)base+pad:NULL;
+  ctx->arena.size=n-pad;
+  ctx->exact.lufs=NAN;
+  ctx->exact.lra=NAN;
+  ctx->ps.lufs=*lufs;
 
-  if (NULL==bs1770_hist_init(&ctx->lufs,lufs))
+  if (NULL!=lra)
+    ctx->ps.lra=*lra;
+
+  if (NULL==bs1770_hist_init(&ctx->lufs,lufs,&ctx->arena))
     goto error;
-  else if (NULL!=lra&&NULL==bs1770_hist_init(&ctx->lra,lra))
+  else if (NULL!=lra&&NULL==bs1770_hist_init(&ctx->lra,lra,&ctx->arena))
     goto error;
   else if (1<size) {
     ctx->size=0;
 
-    if (NULL==(ctx->nodes=malloc(size*sizeof *ctx->nodes)))
+    if (NULL==(ctx->nodes=bs1770_arena_alloc(&ctx->arena,
+        size*sizeof *ctx->nodes)))
       goto error;
     
     while (ctx->size<size) {
@@ -78,8 +100,56 @@ error:
   return NULL;
 }
 
+bs1770_ctx_t *bs1770_ctx_init(bs1770_ctx_t *ctx, size_t size, 
+    const bs1770_ps_t *lufs, const bs1770_ps_t *lra)
+{
+  return bs1770_ctx_layout(ctx,size,lufs,lra,NULL,0);
+}
+
+static void bs1770_ctx_free_shards(bs1770_ctx_t *ctx)
+{
+  size_t i;
+
+  for (i=0;i<ctx->size;++i)
+    bs1770_nd_set_album(ctx->nodes+i,&ctx->lufs,&ctx->lra);
+
+  if (NULL!=ctx->shards) {
+    for (i=0;i<ctx->nshards;++i) {
+      bs1770_shard_t *shard=ctx->shards[i];
+
+      if (NULL!=shard) {
+        bs1770_hist_cleanup(&shard->lra);
+        bs1770_hist_cleanup(&shard->lufs);
+        bs1770_arena_free(&ctx->arena,shard);
+      }
+    }
+
+    bs1770_arena_free(&ctx->arena,ctx->shards);
+  }
+
+  ctx->nshards=0;
+  ctx->shards=NULL;
+}
+
+static void bs1770_ctx_reset_shards(bs1770_ctx_t *ctx)
+{
+  size_t i;
+
+  for (i=0;i<ctx->nshards;++i) {
+    bs1770_hist_reset(&ctx->shards[i]->lufs);
+
+    if (ctx->lra.active)
+      bs1770_hist_reset(&ctx->shards[i]->lra);
+  }
+}
+
 bs1770_ctx_t *bs1770_ctx_cleanup(bs1770_ctx_t *ctx)
 {
+  if (NULL!=ctx->batch)
+    bs1770_batch_close(ctx->batch);
+
+  bs1770_ctx_free_shards(ctx);
+
   if (NULL!=ctx->nodes) {
     bs1770_nd_t *mp=ctx->nodes;
     bs1770_nd_t *rp=mp+ctx->size;
@@ -88,7 +158,7 @@ bs1770_ctx_t *bs1770_ctx_cleanup(bs1770_ctx_t *ctx)
       bs1770_nd_cleanup(--rp);
 
     if (1!=ctx->size)
-      free(ctx->nodes);
+      bs1770_arena_free(&ctx->arena,ctx->nodes);
   }
 
   bs1770_hist_cleanup(&ctx->lra);
@@ -97,6 +167,139 @@ bs1770_ctx_t *bs1770_ctx_cleanup(bs1770_ctx_t *ctx)
   return ctx;
 }
 
+void bs1770_ctx_reset(bs1770_ctx_t *ctx)
+{
+  size_t i;
+
+  for (i=0;i<ctx->size;++i)
+    bs1770_nd_reset(ctx->nodes+i);
+
+  bs1770_ctx_reset_shards(ctx);
+
+  if (NULL!=ctx->batch) {
+    ctx->batch->kw.mode=0;
+    bs1770_batch_reset(ctx->batch);
+  }
+
+  bs1770_hist_reset(&ctx->lufs);
+
+  if (ctx->lra.active)
+    bs1770_hist_reset(&ctx->lra);
+
+  ctx->exact.lufs=NAN;
+  ctx->exact.lra=NAN;
+}
+
+/// pool //////////////////////////////////////////////////////////////////////
+bs1770_pool_t *bs1770_pool_open(size_t size, const bs1770_ps_t *lufs,
+    const bs1770_ps_t *lra, size_t max)
+{
+  bs1770_pool_t *pool;
+
+  if (NULL==(pool=bs1770_malloc(sizeof *pool)))
+    return NULL;
+
+  memset(pool,0,sizeof *pool);
+  pool->size=size;
+  pool->lufs=*lufs;
+  pool->has_lra=NULL!=lra;
+
+  if (NULL!=lra)
+    pool->lra=*lra;
+
+  pool->max=max;
+
+  if (0<max&&NULL==(pool->idle=bs1770_malloc(max*sizeof pool->idle[0])))
+    { bs1770_free(pool); return NULL; }
+
+  return pool;
+}
+
+void bs1770_pool_close(bs1770_pool_t *pool)
+{
+  while (0<pool->used)
+    bs1770_ctx_close(pool->idle[--pool->used]);
+
+  bs1770_free(pool->idle);
+  bs1770_free(pool);
+}
+
+bs1770_ctx_t *bs1770_pool_get(bs1770_pool_t *pool)
+{
+  const bs1770_ps_t *lra=pool->has_lra?&pool->lra:NULL;
+  size_t offs=BS1770_ARENA_ALIGN(sizeof(bs1770_ctx_t));
+  bs1770_ctx_t *ctx;
+
+  if (0<pool->used)
+    return pool->idle[--pool->used];
+
+  if (0==pool->layout) {
+    // a first context taken from the heap tells the size of the arena,
+    // given a line more to start it on one.
+    if (NULL==(ctx=bs1770_ctx_open(pool->size,&pool->lufs,lra)))
+      return NULL;
+
+    pool->layout=offs+BS1770_ARENA_LINE+ctx->arena.used;
+    bs1770_ctx_close(ctx);
+  }
+
+  if (NULL==(ctx=bs1770_malloc(pool->layout)))
+    return NULL;
+  else if (NULL==bs1770_ctx_layout(ctx,pool->size,&pool->lufs,lra,
+      (unsigned char *)ctx+offs,pool->layout-offs))
+    { bs1770_free(ctx); return NULL; }
+  else
+    return ctx;
+}
+
+void bs1770_pool_put(bs1770_pool_t *pool, bs1770_ctx_t *ctx)
+{
+  if (pool->used<pool->max) {
+    bs1770_ctx_reset(ctx);
+    pool->idle[pool->used++]=ctx;
+  }
+  else
+    bs1770_ctx_close(ctx);
+}
+
+void bs1770_ctx_set_mode(bs1770_ctx_t *ctx, int mode)
+{
+  size_t i;
+
+  for (i=0;i<ctx->size;++i)
+    bs1770_nd_set_mode(ctx->nodes+i,mode);
+
+  if (NULL!=ctx->batch) {
+    ctx->batch->kw.mode=mode;
+    bs1770_batch_reset(ctx->batch);
+  }
+}
+
+void bs1770_ctx_set_series(bs1770_ctx_t *ctx, size_t i,
+    bs1770_series_t series, void *data)
+{
+  bs1770_aggr_set_series(&ctx->nodes[i].lufs.aggr,series,data);
+}
+
+void bs1770_ctx_set_weights(bs1770_ctx_t *ctx, size_t i, int channels,
+    const double *weights)
+{
+  bs1770_nd_t *node=ctx->nodes+i;
+  bs1770_batch_t *batch=ctx->batch;
+  int j;
+
+  bs1770_nd_set_weights(node,channels,weights);
+
+  if (NULL!=batch&&0<batch->channels) {
+    bs1770_kw_t *kw=&batch->kw;
+
+    for (j=0;j<batch->channels;++j) {
+      kw->dbl.g[i*batch->channels+j]=node->bs1770.g[j];
+      kw->flt.g[i*batch->channels+j]=node->bs1770.g[j];
+    }
+  }
+}
+
 #if 0
 void bs1770_ctx_add_sample(bs1770_ctx_t *ctx, size_t i, double fs,
     int channels, bs1770_sample_t sample)
@@ -155,25 +358,194 @@ void bs1770_ctx_add_sample32(bs1770_ctx_t *ctx, size_t i, double fs,
 
 double bs1770_ctx_track_lufs(bs1770_ctx_t *ctx, size_t i, double reference)
 {
+  if (NULL!=ctx->batch)
+    bs1770_batch_flush(ctx);
+
   return bs1770_nd_track_lufs(ctx->nodes+i,reference);
 }
 
+void bs1770_ctx_track_window(bs1770_ctx_t *ctx, size_t i, double from,
+    double to)
+{
+  bs1770_nd_t *node=ctx->nodes+i;
+
+  bs1770_aggr_set_window(&node->lufs.aggr,from,to);
+
+  if (node->lra.active)
+    bs1770_aggr_set_window(&node->lra.aggr,from,to);
+}
+
+double bs1770_ctx_track_max_momentary(bs1770_ctx_t *ctx, size_t i)
+{
+  return bs1770_aggr_max_momentary(&ctx->nodes[i].lufs.aggr);
+}
+
+double bs1770_ctx_track_max_shortterm(bs1770_ctx_t *ctx, size_t i)
+{
+  return bs1770_aggr_max_shortterm(&ctx->nodes[i].lufs.aggr);
+}
+
+void bs1770_ctx_track_snapshot(bs1770_ctx_t *ctx, size_t i,
+    bs1770_snapshot_t *snapshot)
+{
+  bs1770_nd_t *node=ctx->nodes+i;
+
+  bs1770_aggr_snapshot(&node->lufs.aggr,
+      node->lra.active?&node->lra.aggr:NULL,snapshot);
+}
+
+int bs1770_ctx_track_publish(bs1770_ctx_t *ctx, size_t i, double interval)
+{
+  bs1770_nd_t *node=ctx->nodes+i;
+  bs1770_aggr_t *aggr=&node->lufs.aggr;
+  double hops=floor(interval*aggr->partition/aggr->length+0.5);
+
+  if (!(0.0<interval)) {
+    bs1770_aggr_set_snap(aggr,NULL);
+    return 0;
+  }
+  else if (bs1770_hist_index(&node->lufs.track)<0
+      ||(node->lra.active&&bs1770_hist_index(&node->lra.track)<0)) {
+    bs1770_aggr_set_snap(aggr,NULL);
+    return -1;
+  }
+
+  bs1770_snap_set(node->snap,hops<1.0?1:(uint64_t)hops,
+      node->lra.active?&node->lra.aggr:NULL);
+  bs1770_aggr_set_snap(aggr,node->snap);
+
+  return 0;
+}
+
+int bs1770_ctx_track_read_snapshot(const bs1770_ctx_t *ctx, size_t i,
+    bs1770_snapshot_t *snapshot)
+{
+  return bs1770_snap_read(ctx->nodes[i].snap,snapshot);
+}
+
 double bs1770_ctx_track_lra(bs1770_ctx_t *ctx, size_t i, double lower,
     double upper)
 {
+  if (NULL!=ctx->batch)
+    bs1770_batch_flush(ctx);
+
   return bs1770_nd_track_lra(ctx->nodes+i,lower,upper);
 }
 
+// adds the tracks finished by the threads since to the album.
+static void bs1770_ctx_reduce(bs1770_ctx_t *ctx)
+{
+  size_t i;
+
+  for (i=0;i<ctx->nshards;++i) {
+    bs1770_shard_t *shard=ctx->shards[i];
+
+    bs1770_hist_add(&ctx->lufs,&shard->lufs);
+    bs1770_hist_reset(&shard->lufs);
+
+    if (ctx->lra.active) {
+      bs1770_hist_add(&ctx->lra,&shard->lra);
+      bs1770_hist_reset(&shard->lra);
+    }
+  }
+}
+
+int bs1770_ctx_shards(bs1770_ctx_t *ctx, size_t n)
+{
+  bs1770_ps_t ps;
+  size_t i;
+
+  if (n==ctx->nshards)
+    return 0;
+
+  bs1770_ctx_reduce(ctx);
+  bs1770_ctx_free_shards(ctx);
+
+  if (0==n)
+    return 0;
+  else if (NULL==(ctx->shards=bs1770_arena_alloc(&ctx->arena,
+      n*sizeof ctx->shards[0])))
+    goto error;
+
+  memset(ctx->shards,0,n*sizeof ctx->shards[0]);
+  ctx->nshards=n;
+
+  for (i=0;i<n;++i) {
+    bs1770_shard_t *shard;
+
+    if (NULL==(shard=bs1770_arena_alloc(&ctx->arena,sizeof *shard)))
+      goto error;
+
+    memset(shard,0,sizeof *shard);
+    shard->lufs.arena=&ctx->arena;
+    shard->lra.arena=&ctx->arena;
+    ctx->shards[i]=shard;
+
+    // the shards are only ever added to.
+    ps=ctx->ps.lufs;
+    ps.flags&=~BS1770_PS_INDEXED;
+
+    if (NULL==bs1770_hist_init(&shard->lufs,&ps,&ctx->arena))
+      goto error;
+
+    if (ctx->lra.active) {
+      ps=ctx->ps.lra;
+      ps.flags&=~BS1770_PS_INDEXED;
+
+      if (NULL==bs1770_hist_init(&shard->lra,&ps,&ctx->arena))
+        goto error;
+    }
+  }
+
+  for (i=0;i<ctx->size;++i)
+    bs1770_ctx_track_shard(ctx,i,0);
+
+  return 0;
+error:
+  bs1770_ctx_free_shards(ctx);
+
+  return -1;
+}
+
+void bs1770_ctx_track_shard(bs1770_ctx_t *ctx, size_t i, size_t k)
+{
+  bs1770_shard_t *shard=ctx->shards[k];
+
+  bs1770_nd_set_album(ctx->nodes+i,&shard->lufs,&shard->lra);
+}
+
 double bs1770_ctx_album_lufs(bs1770_ctx_t *ctx, double reference)
 {
   double lufs;
 
+  bs1770_ctx_reduce(ctx);
   lufs=bs1770_hist_get_lufs(&ctx->lufs,reference);
+  ctx->exact.lufs=bs1770_hist_get_lufs_exact(&ctx->lufs,reference);
   bs1770_hist_reset(&ctx->lufs);
 
   return lufs;
 }
 
+double bs1770_ctx_track_lufs_exact(const bs1770_ctx_t *ctx, size_t i)
+{
+  return ctx->nodes[i].lufs.exact;
+}
+
+double bs1770_ctx_track_lra_exact(const bs1770_ctx_t *ctx, size_t i)
+{
+  return ctx->nodes[i].lra.active?ctx->nodes[i].lra.exact:NAN;
+}
+
+double bs1770_ctx_album_lufs_exact(const bs1770_ctx_t *ctx)
+{
+  return ctx->exact.lufs;
+}
+
+double bs1770_ctx_album_lra_exact(const bs1770_ctx_t *ctx)
+{
+  return ctx->exact.lra;
+}
+
 double bs1770_ctx_album_lufs_default(bs1770_ctx_t *ctx)
 {
   return bs1770_ctx_album_lufs(ctx,R128_REFERENCE);
@@ -184,9 +556,255 @@ double bs1770_ctx_album_lra(bs1770_ctx_t *ctx, double lower, double upper)
   double lra=0.0;
 
   if (ctx->lra.active) {
+    bs1770_ctx_reduce(ctx);
     lra=bs1770_hist_get_lra(&ctx->lra,lower,upper);
+    ctx->exact.lra=bs1770_hist_get_lra_exact(&ctx->lra,lower,upper);
     bs1770_hist_reset(&ctx->lra);
   }
 
   return lra;
 }
+
+size_t bs1770_ctx_track_write(bs1770_ctx_t *ctx, size_t i, void *buf,
+    size_t size)
+{
+  bs1770_nd_t *node=ctx->nodes+i;
+  unsigned char *wp=buf;
+  size_t need=BS1770_CTX_HEADER;
+
+  if (NULL!=ctx->batch)
+    bs1770_batch_flush(ctx);
+
+  bs1770_flush(&node->bs1770);
+
+  need+=bs1770_hist_write(&node->lufs.track,NULL,0);
+
+  if (node->lra.active)
+    need+=bs1770_hist_write(&node->lra.track,NULL,0);
+
+  if (NULL!=buf&&need<=size) {
+    memcpy(wp,BS1770_CTX_MAGIC,6);
+    wp[6]=BS1770_CTX_VERSION;
+    wp[7]=node->lra.active?2:1;
+    wp+=BS1770_CTX_HEADER;
+    wp+=bs1770_hist_write(&node->lufs.track,wp,size-BS1770_CTX_HEADER);
+
+    if (node->lra.active) {
+      bs1770_hist_write(&node->lra.track,wp,
+          size-(size_t)(wp-(unsigned char *)buf));
+    }
+  }
+
+  return need;
+}
+
+size_t bs1770_ctx_album_read(bs1770_ctx_t *ctx, const void *buf, size_t size)
+{
+  const unsigned char *rp=buf;
+  bs1770_hist_t *lra=ctx->lra.active?&ctx->lra:NULL;
+  size_t offs=BS1770_CTX_HEADER;
+  size_t n, m=0;
+
+  if (size<BS1770_CTX_HEADER||0!=memcmp(rp,BS1770_CTX_MAGIC,6))
+    return 0;
+  else if (BS1770_CTX_VERSION!=rp[6]||rp[7]<1||2<rp[7])
+    return 0;
+  // both sections are checked before either is added, LRA being skipped by
+  // a context not measuring it.
+  else if (0==(n=bs1770_hist_check(&ctx->lufs,rp+offs,size-offs)))
+    return 0;
+  else if (2==rp[7]&&0==(m=bs1770_hist_check(lra,rp+offs+n,size-offs-n)))
+    return 0;
+  else if (0==bs1770_hist_read(&ctx->lufs,rp+offs,n))
+    return 0;
+  else if (0<m&&NULL!=lra&&0==bs1770_hist_read(lra,rp+offs+n,m))
+    return 0;
+
+  return offs+n+m;
+}
+
+/// state /////////////////////////////////////////////////////////////////////
+// the header, u32 number of tracks, u8 whether LRA is measured and u8
+// whether batched, the album histograms, for each track the state of its
+// filters, for LUFS and LRA each the state of its aggregator and the
+// track's histogram, and when batched the rate, channels and
+// mode of the batch followed by its kernel's state once the rate is set.
+static void bs1770_ctx_put_hist(bs1770_hist_writer_t *w,
+    const bs1770_hist_t *hist)
+{
+  size_t n=bs1770_hist_write(hist,NULL,0);
+
+  if (NULL!=w->p&&n<=(size_t)(w->mp-w->p)) {
+    bs1770_hist_write(hist,w->p,n);
+    w->p+=n;
+  }
+  else
+    w->p=w->mp;
+
+  w->size+=n;
+}
+
+static int bs1770_ctx_get_hist(bs1770_hist_reader_t *r, bs1770_hist_t *hist)
+{
+  size_t n;
+
+  bs1770_hist_reset(hist);
+
+  if (r->error||0==(n=bs1770_hist_read(hist,r->p,(size_t)(r->mp-r->p)))) {
+    r->error=1;
+    return -1;
+  }
+
+  r->p+=n;
+
+  return 0;
+}
+
+static void bs1770_ctx_put_stats(bs1770_hist_writer_t *w,
+    const bs1770_stats_t *stats)
+{
+  bs1770_aggr_write_state(&stats->aggr,w);
+  bs1770_ctx_put_hist(w,&stats->track);
+}
+
+static int bs1770_ctx_get_stats(bs1770_hist_reader_t *r,
+    bs1770_stats_t *stats)
+{
+  if (bs1770_aggr_read_state(&stats->aggr,r)<0)
+    return -1;
+  else
+    return bs1770_ctx_get_hist(r,&stats->track);
+}
+
+size_t bs1770_ctx_state_write(bs1770_ctx_t *ctx, void *buf, size_t size)
+{
+  bs1770_batch_t *batch=ctx->batch;
+  bs1770_hist_writer_t w;
+  size_t i;
+
+  w.p=buf;
+  w.mp=NULL!=buf?w.p+size:NULL;
+  w.size=0;
+  // the shards go with the album.
+  bs1770_ctx_reduce(ctx);
+
+  for (i=0;i<6;++i)
+    bs1770_hist_put(&w,(unsigned char)BS1770_CTX_MAGIC[i],1);
+
+  bs1770_hist_put(&w,BS1770_CTX_STATE_VERSION,1);
+  bs1770_hist_put(&w,0,1);
+  bs1770_hist_put(&w,ctx->size,4);
+  bs1770_hist_put(&w,ctx->lra.active,1);
+  bs1770_hist_put(&w,NULL!=batch,1);
+
+  bs1770_ctx_put_hist(&w,&ctx->lufs);
+
+  if (ctx->lra.active)
+    bs1770_ctx_put_hist(&w,&ctx->lra);
+
+  for (i=0;i<ctx->size;++i) {
+    bs1770_nd_t *node=ctx->nodes+i;
+
+    bs1770_write_state(&node->bs1770,&w);
+    bs1770_ctx_put_stats(&w,&node->lufs);
+
+    if (ctx->lra.active)
+      bs1770_ctx_put_stats(&w,&node->lra);
+  }
+
+  if (NULL!=batch) {
+    bs1770_hist_put_f64(&w,batch->fs);
+    bs1770_hist_put(&w,batch->channels,4);
+    bs1770_hist_put(&w,batch->kw.mode,4);
+
+    if (0.0<batch->fs)
+      bs1770_kw_write_state(&batch->kw,&w);
+  }
+
+  return w.size;
+}
+
+size_t bs1770_ctx_state_read(bs1770_ctx_t *ctx, const void *buf, size_t size)
+{
+  bs1770_hist_reader_t r;
+  double fs;
+  int batched, channels, mode;
+  size_t i;
+
+  r.p=buf;
+  r.mp=r.p+size;
+  r.error=0;
+
+  for (i=0;i<6;++i) {
+    if ((unsigned char)BS1770_CTX_MAGIC[i]!=bs1770_hist_get(&r,1))
+      return 0;
+  }
+
+  if (BS1770_CTX_STATE_VERSION!=bs1770_hist_get(&r,1))
+    return 0;
+  else if (0!=bs1770_hist_get(&r,1))
+    return 0;
+  else if ((uint64_t)ctx->size!=bs1770_hist_get(&r,4))
+    return 0;
+  else if ((uint64_t)ctx->lra.active!=bs1770_hist_get(&r,1))
+    return 0;
+
+  batched=(int)bs1770_hist_get(&r,1);
+
+  if (r.error)
+    return 0;
+
+  // from here on a failure leaves the context reset.
+  if (bs1770_ctx_get_hist(&r,&ctx->lufs)<0)
+    goto error;
+  else if (ctx->lra.active&&bs1770_ctx_get_hist(&r,&ctx->lra)<0)
+    goto error;
+
+  for (i=0;i<ctx->size;++i) {
+    bs1770_nd_t *node=ctx->nodes+i;
+
+    if (bs1770_read_state(&node->bs1770,&r)<0)
+      goto error;
+    else if (bs1770_ctx_get_stats(&r,&node->lufs)<0)
+      goto error;
+    else if (ctx->lra.active&&bs1770_ctx_get_stats(&r,&node->lra)<0)
+      goto error;
+  }
+
+  bs1770_ctx_reset_shards(ctx);
+
+  if (batched) {
+    fs=bs1770_hist_get_f64(&r);
+    channels=(int)bs1770_hist_get(&r,4);
+    mode=(int)bs1770_hist_get(&r,4);
+
+    if (r.error)
+      goto error;
+    else if (NULL==ctx->batch&&NULL==(ctx->batch=bs1770_batch_open(ctx)))
+      goto error;
+
+    ctx->batch->kw.mode=mode;
+    bs1770_batch_reset(ctx->batch);
+
+    if (0.0<fs) {
+      if (channels<1||BS1770_MAX_CHANNELS<ctx->size*channels)
+        goto error;
+
+      bs1770_batch_set_fs(ctx,fs,channels);
+
+      if (bs1770_kw_read_state(&ctx->batch->kw,&r)<0)
+        goto error;
+    }
+  }
+  else if (NULL!=ctx->batch)
+    bs1770_batch_reset(ctx->batch);
+
+  if (r.error)
+    goto error;
+
+  return (size_t)(r.p-(const unsigned char *)buf);
+error:
+  bs1770_ctx_reset(ctx);
+
+  return 0;
+}
@@ -27,7 +27,7 @@ extern "C" {
 #include <stdint.h>
 
 ///////////////////////////////////////////////////////////////////////////////
-#define BS1770_MAX_CHANNELS     5
+#define BS1770_MAX_CHANNELS     64
 
 #define BS1770_LOWER            (0.1)
 #define BS1770_UPPER            (0.95)
@@ -40,6 +40,34 @@ extern "C" {
 #define A85_UPPER               BS1770_UPPER
 #define A85_REFERENCE           (-24.0)
 
+#define BS1770_SHORT_TERM       (3000.0)  // short-term window in ms.
+
+// K-weighting in single precision (the weighted sums of squares are
+// still accumulated in double precision).  The samples are staged and
+// filtered as floats, which doubles the channels per vector step and
+// halves the bytes written to and read back from the staging buffer;
+// planar f32 input to a channel-by-channel kernel is filtered in place
+// without being staged at all.  On the EBU Tech 3341/3342 test signals
+// integrated loudness and loudness range stay within 0.05 LU of the
+// double precision results, differences observed on program material are
+// below 0.001 LU.
+#define BS1770_MODE_F32         (1<<0)
+// Run the K-weighting kernels with flush-to-zero/denormals-are-zero
+// set instead of testing every filter value against 1.0e-15 (x86 only,
+// the MXCSR is restored on return).  Results differ from the default
+// mode only by contributions far below the -70 LUFS silence gate.
+#define BS1770_MODE_FTZ         (1<<1)
+// Filter mono and stereo planar input along time, several samples per
+// vector step, rather than across channels.  Double precision only (no
+// effect together with BS1770_MODE_F32) and only with a SIMD kernel.
+// Agrees with the default mode within 0.001 LU.
+#define BS1770_MODE_LOOKAHEAD   (1<<2)
+
+// integer samples are taken relative to a full scale of 2^15 and 2^31
+// respectively, as FFmpeg converts them to float, rather than INT16_MAX and
+// INT32_MAX as before.  i16 results are thus lower by 20*log10(32768/32767),
+// about 0.00027 dB, than those of earlier versions, i32 ones by about
+// 4e-9 dB.
 typedef int16_t bs1770_i16_t;
 typedef int32_t bs1770_i32_t;
 typedef float bs1770_f32_t;
@@ -61,23 +89,112 @@ typedef bs1770_samples_f64_t bs1770_samples_t;
 ///////////////////////////////////////////////////////////////////////////////
 typedef struct bs1770_ctx bs1770_ctx_t;
 
+// receives the loudness time series of a track, called at every hop of
+// the loudness blocks once the first block is complete.  "t" is the end of
+// the block in seconds since the start of the track, "momentary" the
+// loudness of the block and "shortterm" that of the last BS1770_SHORT_TERM
+// ms (or of the track so far while shorter), both in LUFS and -HUGE_VAL
+// for digital silence.
+typedef void (*bs1770_series_t)(void *data, double t, double momentary,
+    double shortterm);
+
 typedef double (*bs1770_ctx_lufs_t)(bs1770_ctx_t *, double);
 typedef double (*bs1770_ctx_lra_t)(bs1770_ctx_t *, double, double);
 
+// Keep prefix sums next to the histogram, answering the loudness and LRA
+// queries in logarithmic rather than linear time for meters polled while
+// running.  Costs a logarithmic update per block and 120 KB per histogram.
+#define BS1770_PS_INDEXED       (1<<0)
+// Histogram bins of 0.1 dB rather than 0.01 dB: a tenth of the memory
+// (3 KB of counts per histogram) for fleets of live meters, at the cost of
+// that resolution in loudness and LRA.
+#define BS1770_PS_COARSE        (1<<1)
+// Keep the energy of every block along with the histogram, fed by the same
+// hop, such that one pass gives both the binned loudness and LRA and the
+// exact ones gated and ranked without quantization, see
+// "bs1770_ctx_track_lufs_exact()".  Memory grows with the audio at 8 bytes
+// per block, i.e. per hop: about 280 KB per hour for 400 ms blocks of 75%
+// overlap, 28 KB for the 3 s LRA blocks, allocated 32 KB at a time, and
+// as much again for sorting on an exact LRA.
+#define BS1770_PS_EXACT         (1<<2)
+
 typedef struct bs1770_ps {
   double ms;
   int partition;
   double gate;
+  int flags;                // BS1770_PS_*
 } bs1770_ps_t;
 
 ///////////////////////////////////////////////////////////////////////////////
+// The tracks of a context may be driven by threads of their own, one thread
+// per track at a time, from adding samples up to taking the track's
+// loudness, LRA or serialization.  Taking it adds the track to the album,
+// hence each of "n" threads needs an album shard of its own, given by
+// "bs1770_ctx_shards(ctx,n)", which the album queries add up.  Track "i"
+// adds to shard 0 unless "bs1770_ctx_track_shard(ctx,i,k)" names the shard
+// "k" of the thread taking its loudness.  Without shards (0, the default)
+// the tracks add to the album directly and must not run concurrently.  The album queries, "bs1770_ctx_shards()",
+// "bs1770_ctx_album_read()", the state of the context,
+// "bs1770_ctx_set_mode()" and the batched API must not run concurrently
+// with any track.  Published snapshots may be read by any thread at any
+// time.
 bs1770_ctx_t *bs1770_ctx_open(size_t size, const bs1770_ps_t *lufs,
     const bs1770_ps_t *lra);
 void bs1770_ctx_close(bs1770_ctx_t *ctx);
+// starts the tracks and the album over as if just opened, with the default
+// mode and weights and without series or windows, but keeps the memory
+// and the shards.
+void bs1770_ctx_reset(bs1770_ctx_t *ctx);
+// each shard holds a copy of the album histograms.  Setting their number
+// adds the old ones to the album and the tracks to shard 0, -1 if memory
+// runs out, leaving the context without shards.
+int bs1770_ctx_shards(bs1770_ctx_t *ctx, size_t n);
+void bs1770_ctx_track_shard(bs1770_ctx_t *ctx, size_t i, size_t k);
+
+// the memory of the library is taken by "alloc" and given back by
+// "release", both passed "data".  Without ("allocator" NULL) malloc() and
+// free() are used.  To be set before the first context is opened and kept
+// until the last is closed.
+typedef struct bs1770_allocator {
+  void *(*alloc)(void *data, size_t size);
+  void (*release)(void *data, void *p);
+  void *data;
+} bs1770_allocator_t;
+
+void bs1770_set_allocator(const bs1770_allocator_t *allocator);
+
+// A pool of contexts of "size" tracks and the same parameters.  Each is
+// laid out in a single block holding the histograms and aggregators of all
+// its tracks, sized by opening a first context from the heap.  Contexts
+// handed back by "bs1770_pool_put()" are reset and kept, up to "max" of
+// them, for the next "bs1770_pool_get()" rather than freed.  A context of
+// a pool may also just be closed.  A pool is not thread-safe.
+typedef struct bs1770_pool bs1770_pool_t;
+
+bs1770_pool_t *bs1770_pool_open(size_t size, const bs1770_ps_t *lufs,
+    const bs1770_ps_t *lra, size_t max);
+void bs1770_pool_close(bs1770_pool_t *pool);
+bs1770_ctx_t *bs1770_pool_get(bs1770_pool_t *pool);
+void bs1770_pool_put(bs1770_pool_t *pool, bs1770_ctx_t *ctx);
+
+// sets the BS1770_MODE_* flags of all tracks.  Called in the middle of a
+// track it restarts the track's filters with the next sample, as at its
+// first one, while the blocks and the histograms so far are kept.
+void bs1770_ctx_set_mode(bs1770_ctx_t *ctx, int mode);
+// sets the weights of the first "channels" channels of track "i", e.g.
+// 0.0 for LFE and 1.41 for surround channels.  Without, or for channels
+// beyond, the first five are taken as L, R, C, Ls and Rs and any further
+// channel is weighted 1.0.
+void bs1770_ctx_set_weights(bs1770_ctx_t *ctx, size_t i, int channels,
+    const double *weights);
 
 #define bs1770_ctx_add_sample(ctx,i,fs,channels,sample) \
   bs1770_ctx_add_sample_f64(ctx,i,fs,channels,sample)
 
+// samples of no or more than BS1770_MAX_CHANNELS channels are refused,
+// leaving the loudness and LRA of the track, and of an album it is added
+// to, NaN until reset.
+
 // interleaved
 void bs1770_ctx_add_samples_i_i16(bs1770_ctx_t *ctx, size_t i, double fs,
     int channels, bs1770_i16_t *samples, size_t nsamples);
@@ -98,6 +215,18 @@ void bs1770_ctx_add_samples_p_f32(bs1770_ctx_t *ctx, size_t i, double fs,
 void bs1770_ctx_add_samples_p_f64(bs1770_ctx_t *ctx, size_t i, double fs,
     int channels, bs1770_samples_f64_t samples, size_t nsamples);
 
+// planar, all the tracks of the context side by side: "samples" holds the
+// channels of track 0 followed by those of track 1 and so on, all tracks
+// having "channels" channels.
+void bs1770_ctx_add_samples_batch_p_i16(bs1770_ctx_t *ctx, double fs,
+    int channels, bs1770_samples_i16_t samples, size_t nsamples);
+void bs1770_ctx_add_samples_batch_p_i32(bs1770_ctx_t *ctx, double fs,
+    int channels, bs1770_samples_i32_t samples, size_t nsamples);
+void bs1770_ctx_add_samples_batch_p_f32(bs1770_ctx_t *ctx, double fs,
+    int channels, bs1770_samples_f32_t samples, size_t nsamples);
+void bs1770_ctx_add_samples_batch_p_f64(bs1770_ctx_t *ctx, double fs,
+    int channels, bs1770_samples_f64_t samples, size_t nsamples);
+
 // one by one
 void bs1770_ctx_add_sample_i16(bs1770_ctx_t *ctx, size_t i, double fs,
     int channels, bs1770_sample_i16_t sample);
@@ -108,13 +237,97 @@ void bs1770_ctx_add_sample_f32(bs1770_ctx_t *ctx, size_t i, double fs,
 void bs1770_ctx_add_sample_f64(bs1770_ctx_t *ctx, size_t i, double fs,
     int channels, bs1770_sample_f64_t sample);
 
+// installs "series" to receive the loudness time series of track "i", or
+// removes it if NULL.
+void bs1770_ctx_set_series(bs1770_ctx_t *ctx, size_t i,
+    bs1770_series_t series, void *data);
+
 double bs1770_ctx_track_lufs(bs1770_ctx_t *ctx, size_t i, double reference);
 double bs1770_ctx_track_lra(bs1770_ctx_t *ctx, size_t i, double lower,
     double upper);
+// with BS1770_PS_EXACT, the loudness and LRA last taken of track "i" and of
+// the album as computed from the blocks themselves rather than the bins,
+// NaN without or before.
+double bs1770_ctx_track_lufs_exact(const bs1770_ctx_t *ctx, size_t i);
+double bs1770_ctx_track_lra_exact(const bs1770_ctx_t *ctx, size_t i);
+double bs1770_ctx_album_lufs_exact(const bs1770_ctx_t *ctx);
+double bs1770_ctx_album_lra_exact(const bs1770_ctx_t *ctx);
+// counts only the blocks of track "i" ending within ("from","to"] seconds
+// of its first sample (0.0 and HUGE_VAL by default), e.g. to measure a
+// segment of a longer track fed from a little before to a little after it.
+// Segments measured this way and merged by "bs1770_ctx_album_read()" count
+// each block once.  Lasts until the track's loudness is taken.
+void bs1770_ctx_track_window(bs1770_ctx_t *ctx, size_t i, double from,
+    double to);
+
+// the maximum momentary and short-term loudness of track "i" in LUFS,
+// -HUGE_VAL if silent throughout.  The short-term maximum is taken over
+// complete windows unless the track is shorter than one.  Call before the
+// track's loudness is taken, which resets the track.
+double bs1770_ctx_track_max_momentary(bs1770_ctx_t *ctx, size_t i);
+double bs1770_ctx_track_max_shortterm(bs1770_ctx_t *ctx, size_t i);
+
+// A track as measured so far, from the blocks complete up to "t" seconds
+// of its first sample: their gated loudness and LRA (the default one, 0.0
+// if not measured), the loudness of the last block and short-term window
+// and the maxima, all in LUFS and -HUGE_VAL for none or digital silence.
+typedef struct bs1770_snapshot {
+  double t;
+  double lufs;
+  double lra;
+  double momentary;
+  double shortterm;
+  double max_momentary;
+  double max_shortterm;
+} bs1770_snapshot_t;
+
+// takes a snapshot of track "i" on the thread driving it.  Unlike taking the
+// loudness it leaves the track going on.  The gating makes it linear in the
+// histogram's bins (logarithmic with BS1770_PS_INDEXED).
+void bs1770_ctx_track_snapshot(bs1770_ctx_t *ctx, size_t i,
+    bs1770_snapshot_t *snapshot);
+// has the thread driving track "i" publish a snapshot every "interval"
+// seconds of its audio, rounded to the hops of the loudness blocks, or
+// no longer with 0.0.  "bs1770_ctx_track_read_snapshot()" copies the latest
+// from any thread without holding the other up and returns 0 if none was
+// published yet.  Ends with "bs1770_ctx_reset()", not with the track.
+// Publishing takes only what is cheap on the thread measuring, hence the
+// track's histograms are given the index of BS1770_PS_INDEXED if they lack
+// it, such that the gated loudness and LRA take logarithmic time (the
+// track's results then round as with the flag, differing far below 1e-9
+// LU).  Returns -1 if memory runs out for the index, publishing nothing.
+int bs1770_ctx_track_publish(bs1770_ctx_t *ctx, size_t i, double interval);
+int bs1770_ctx_track_read_snapshot(const bs1770_ctx_t *ctx, size_t i,
+    bs1770_snapshot_t *snapshot);
 double bs1770_ctx_album_lufs(bs1770_ctx_t *ctx, double reference);
 double bs1770_ctx_album_lufs_default(bs1770_ctx_t *ctx);
 double bs1770_ctx_album_lra(bs1770_ctx_t *ctx, double lower, double upper);
 
+// serializes the loudness and, if measured, the LRA histogram of track "i"
+// into "buf" if "size" bytes suffice and returns the size needed.  Call
+// before the track's loudness is taken, which resets the track.  The
+// format is versioned and independent of the host's byte order.
+size_t bs1770_ctx_track_write(bs1770_ctx_t *ctx, size_t i, void *buf,
+    size_t size);
+// adds a track serialized by "bs1770_ctx_track_write()", possibly in another
+// process or on another machine, to the album and returns the number of
+// bytes read, 0 on error, leaving the album as it was unless memory runs
+// out.
+size_t bs1770_ctx_album_read(bs1770_ctx_t *ctx, const void *buf, size_t size);
+
+// The whole state of a context: the filters, aggregators, track and album
+// histograms of all its tracks, such that a context reading it goes on
+// measuring exactly as the one written would have.  "bs1770_ctx_state_write"
+// returns the size needed, all of it written into "buf" only if "size"
+// suffices.  "bs1770_ctx_state_read" restores the state into a context of
+// the same number of tracks and parameters and returns the number of bytes
+// read, or 0 on error, leaving the context as if reset then.  Series
+// callbacks are not part of the state, those of the reading context stay.
+// The format is versioned and little endian, independent of the SIMD
+// kernel in use.
+size_t bs1770_ctx_state_write(bs1770_ctx_t *ctx, void *buf, size_t size);
+size_t bs1770_ctx_state_read(bs1770_ctx_t *ctx, const void *buf, size_t size);
+
 ///////////////////////////////////////////////////////////////////////////////
 const bs1770_ps_t *bs1770_lufs_ps_default(void);
 const bs1770_ps_t *bs1770_lra_ps_default(void);
@@ -0,0 +1 @@
+#include "bs1770_ctx_add_samples.c"
@@ -20,6 +20,12 @@
 #include "bs1770.h"
 #include "bs1770_types.h"
 
+#if defined (FLOAT)
+  #define CONVERT(x)          ((double)(x))
+#else
+  #define CONVERT(x)          ((double)(x)/MAX)
+#endif
+
 #if defined (PLANAR)
 void FN(bs1770_ctx_add_samples)(bs1770_ctx_t *ctx, size_t i, double fs,
     int channels, TP samples, size_t nsamples)
@@ -27,6 +33,58 @@ void FN(bs1770_ctx_add_samples)(bs1770_ctx_t *ctx, size_t i, double fs,
   FN(bs1770_add_samples)(&ctx->nodes[i].bs1770,fs,channels,samples,
       nsamples);
 }
+
+void FN(bs1770_ctx_add_samples_batch)(bs1770_ctx_t *ctx, double fs,
+    int channels, TP samples, size_t nsamples)
+{
+  bs1770_kw_t *kw;
+  double *wp;
+  float *fp;
+  size_t offs=0;
+  size_t size, n, j;
+  int k;
+
+  if (channels<1||BS1770_MAX_CHANNELS<ctx->size*channels
+      ||(NULL==ctx->batch&&NULL==(ctx->batch=bs1770_batch_open(ctx)))) {
+    // one track after the other.
+    for (j=0;j<ctx->size;++j) {
+      FN(bs1770_add_samples)(&ctx->nodes[j].bs1770,fs,channels,
+          samples+j*channels,nsamples);
+    }
+
+    return;
+  }
+
+  if (ctx->batch->fs!=fs||ctx->batch->channels!=channels)
+    bs1770_batch_set_fs(ctx,fs,channels);
+
+  kw=&ctx->batch->kw;
+  size=BS1770_KW_BUF_SIZE/kw->stride;
+
+  while (offs<nsamples) {
+    n=nsamples-offs<size?nsamples-offs:size;
+
+    if (kw->mode&BS1770_MODE_F32) {
+      fp=kw->fbuf;
+
+      for (j=0;j<n;++j,fp+=kw->stride) {
+        for (k=0;k<kw->channels;++k)
+          fp[k]=(float)CONVERT(samples[k][offs+j]);
+      }
+    }
+    else {
+      wp=kw->buf;
+
+      for (j=0;j<n;++j,wp+=kw->stride) {
+        for (k=0;k<kw->channels;++k)
+          wp[k]=CONVERT(samples[k][offs+j]);
+      }
+    }
+
+    bs1770_batch_add_frames(ctx,n);
+    offs+=n;
+  }
+}
 #elif defined (INTERLEAVED)
 void FN(bs1770_ctx_add_samples)(bs1770_ctx_t *ctx, size_t i, double fs,
     int channels, TP *samples, size_t nsamples)
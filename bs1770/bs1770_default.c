@@ -26,11 +26,13 @@ const bs1770_ps_t *bs1770_lufs_ps_default(void)
 #if defined (_MSC_VER)
     400.0,
     4,
-    -10.0
+    -10.0,
+    0
 #else
     .ms=400.0,
     .partition=4,
-    .gate=-10.0
+    .gate=-10.0,
+    .flags=0
 #endif
   };
 
@@ -43,11 +45,13 @@ const bs1770_ps_t *bs1770_lra_ps_default(void)
 #if defined (_MSC_VER)
     3000.0,
     3,
-    -20.0
+    -20.0,
+    0
 #else
     .ms=3000.0,
     .partition=3,
-    .gate=-20.0
+    .gate=-20.0,
+    .flags=0
 #endif
   };
 
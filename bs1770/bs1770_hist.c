@@ -21,73 +21,717 @@
  * Based on an idea found at
  * http://kokkinizita.linuxaudio.org/papers/loudness-meter-pres.pdf
  */
+#if !defined (BS1770_HIST_GRAIN)
 #include <math.h>
+#include <string.h>
 #include "bs1770.h"
 
-#define BS1770_HIST_MIN    (-70)
-#define BS1770_HIST_MAX    (+5)
-#define BS1770_HIST_GRAIN  (100)
+// Histogram geometry, fixed at compile time.  Both variants cover the same
+// range, the coarse one with a tenth of the bins for meters kept by the
+// thousand, see BS1770_PS_COARSE.
+#if !defined (BS1770_HIST_MIN)
+  #define BS1770_HIST_MIN         (-70)
+#endif
+#if !defined (BS1770_HIST_MAX)
+  #define BS1770_HIST_MAX         (+5)
+#endif
+#if !defined (BS1770_HIST_GRAIN_FINE)
+  #define BS1770_HIST_GRAIN_FINE  (100)   // bins per dB.
+#endif
+#if !defined (BS1770_HIST_GRAIN_COARSE)
+  #define BS1770_HIST_GRAIN_COARSE (10)
+#endif
+
+/// serialization /////////////////////////////////////////////////////////////
+// all integers little endian, doubles as their IEEE 754 bit pattern:
+//
+//   i16 lowest bin in dB, u16 bins per dB, u32 number of bins,
+//   f64 gate, u64 pass1.count, f64 pass1.wmsq,
+//   u32 number of non-empty bins, and for each of them the distance to the
+//   previous non-empty bin (to -1 for the first) and the count, both as
+//   LEB128 varints.
+//
+// with BS1770_PS_EXACT the top bit of the number of bins is set and the
+// bins are followed by a u64 number of blocks and their f64 mean squares.
+#define BS1770_HIST_BLOCKS      (UINT32_C(1)<<31)
+
+void bs1770_hist_put(bs1770_hist_writer_t *w, uint64_t x, int n)
+{
+  while (0<n--) {
+    if (w->p<w->mp)
+      *w->p++=(unsigned char)(x&0xff);
+
+    ++w->size;
+    x>>=8;
+  }
+}
+
+void bs1770_hist_put_f64(bs1770_hist_writer_t *w, double x)
+{
+  uint64_t u;
+
+  memcpy(&u,&x,sizeof u);
+  bs1770_hist_put(w,u,8);
+}
+
+static void bs1770_hist_put_var(bs1770_hist_writer_t *w, uint64_t x)
+{
+  while (0x80<=x) {
+    bs1770_hist_put(w,(x&0x7f)|0x80,1);
+    x>>=7;
+  }
+
+  bs1770_hist_put(w,x,1);
+}
+
+uint64_t bs1770_hist_get(bs1770_hist_reader_t *r, int n)
+{
+  uint64_t x=0;
+  int i;
+
+  for (i=0;i<n;++i) {
+    if (r->mp<=r->p) {
+      r->error=1;
+      return 0;
+    }
+
+    x|=(uint64_t)*r->p++<<(8*i);
+  }
+
+  return x;
+}
+
+double bs1770_hist_get_f64(bs1770_hist_reader_t *r)
+{
+  uint64_t u=bs1770_hist_get(r,8);
+  double x;
+
+  memcpy(&x,&u,sizeof x);
+
+  return x;
+}
+
+static uint64_t bs1770_hist_get_var(bs1770_hist_reader_t *r)
+{
+  uint64_t x=0, b;
+  int shift;
+
+  for (shift=0;shift<64;shift+=7) {
+    b=bs1770_hist_get(r,1);
+    x|=(b&0x7f)<<shift;
+
+    if (0==(b&0x80))
+      return x;
+  }
+
+  r->error=1;
+
+  return 0;
+}
+
+// runs "fn" once per "once", whichever thread comes first, the others
+// returning only when it is done.
+#if defined (_MSC_VER)
+#include <windows.h>
+typedef INIT_ONCE bs1770_hist_once_t;
+#define BS1770_HIST_ONCE_INIT   INIT_ONCE_STATIC_INIT
+
+static BOOL CALLBACK bs1770_hist_once_fn(PINIT_ONCE once, PVOID fn,
+    PVOID *ctx)
+{
+  ((void (*)(void))fn)();
+
+  return TRUE;
+}
+
+#define bs1770_hist_once(once,fn) \
+  InitOnceExecuteOnce(once,bs1770_hist_once_fn,(PVOID)(fn),NULL)
+#else
+#include <pthread.h>
+typedef pthread_once_t bs1770_hist_once_t;
+#define BS1770_HIST_ONCE_INIT   PTHREAD_ONCE_INIT
+#define bs1770_hist_once(once,fn) \
+  pthread_once(once,fn)
+#endif
+
+/// blocks ////////////////////////////////////////////////////////////////////
+// the blocks kept along with the bins by BS1770_PS_EXACT.  the variants
+// count and serialize them, they are gated and ranked here.
+static void bs1770_hist_blocks_reset(bs1770_hist_t *hist)
+{
+  hist->blocks.tail=hist->blocks.head;
+  hist->blocks.used=0;
+  hist->sorted.count=0;
+}
+
+// number of blocks in chunk "c", NULL ending the chunks in use.
+static size_t bs1770_hist_blocks_size(const bs1770_hist_t *hist,
+    const bs1770_chunk_t *c)
+{
+  if (NULL==c)
+    return 0;
+  else if (c==hist->blocks.tail)
+    return hist->blocks.used;
+  else
+    return BS1770_CHUNK_SIZE;
+}
+
+static const bs1770_chunk_t *bs1770_hist_blocks_next(
+    const bs1770_hist_t *hist, const bs1770_chunk_t *c)
+{
+  return c==hist->blocks.tail?NULL:c->next;
+}
+
+static int bs1770_hist_blocks_push(bs1770_hist_t *hist, double wmsq)
+{
+  bs1770_chunk_t *c=hist->blocks.tail;
+
+  if (NULL==c||BS1770_CHUNK_SIZE==hist->blocks.used) {
+    if (NULL!=c&&NULL!=c->next)
+      c=c->next;    // left over from before the last reset.
+    else {
+      bs1770_chunk_t *next=bs1770_arena_alloc(hist->arena,sizeof *next);
+
+      if (NULL==next)
+        return -1;
+
+      next->next=NULL;
+
+      if (NULL==c)
+        hist->blocks.head=next;
+      else
+        c->next=next;
+
+      c=next;
+    }
+
+    hist->blocks.tail=c;
+    hist->blocks.used=0;
+  }
+
+  c->wmsq[hist->blocks.used++]=wmsq;
+
+  return 0;
+}
+
+static int bs1770_hist_blocks_add(bs1770_hist_t *album,
+    const bs1770_hist_t *track)
+{
+  const bs1770_chunk_t *c;
+  size_t i, n;
+
+  for (c=track->blocks.head;0<(n=bs1770_hist_blocks_size(track,c));
+      c=bs1770_hist_blocks_next(track,c)) {
+    for (i=0;i<n;++i) {
+      if (bs1770_hist_blocks_push(album,c->wmsq[i])<0) {
+        album->error=1;   // out of memory, the album is incomplete.
+        return -1;
+      }
+    }
+  }
+
+  return 0;
+}
+
+static void bs1770_hist_blocks_put(bs1770_hist_writer_t *w,
+    const bs1770_hist_t *hist)
+{
+  const bs1770_chunk_t *c;
+  size_t i, n;
+
+  bs1770_hist_put(w,hist->pass1.count,8);
+
+  for (c=hist->blocks.head;0<(n=bs1770_hist_blocks_size(hist,c));
+      c=bs1770_hist_blocks_next(hist,c)) {
+    for (i=0;i<n;++i)
+      bs1770_hist_put_f64(w,c->wmsq[i]);
+  }
+}
+
+// reads the blocks of a histogram of "count" blocks into "track", or
+// skips them if NULL.
+static void bs1770_hist_blocks_get(bs1770_hist_reader_t *r,
+    bs1770_hist_t *track, uint64_t count)
+{
+  uint64_t n=bs1770_hist_get(r,8);
+
+  if (r->error||count!=n||(uint64_t)(r->mp-r->p)/8<n)
+    r->error=1;
+  else if (NULL==track)
+    r->p+=8*n;
+  else {
+    while (0<n--&&!r->error) {
+      if (bs1770_hist_blocks_push(track,bs1770_hist_get_f64(r))<0)
+        r->error=1;
+    }
+  }
+}
+
+double bs1770_hist_get_lufs_exact(bs1770_hist_t *hist, double reference)
+{
+  double gate=hist->pass1.wmsq*pow(10,0.1*hist->gate);
+  const bs1770_chunk_t *c;
+  double wmsq=0.0;
+  unsigned long long count=0;
+  size_t i, n;
+
+  if (hist->error||!hist->blocks.keep)
+    return NAN;
+
+  for (c=hist->blocks.head;0<(n=bs1770_hist_blocks_size(hist,c));
+      c=bs1770_hist_blocks_next(hist,c)) {
+    for (i=0;i<n;++i) {
+      if (gate<c->wmsq[i]) {
+        wmsq+=c->wmsq[i];
+        ++count;
+      }
+    }
+  }
+
+  return BS1770_LKFS(count,wmsq,reference);
+}
+
+static int bs1770_hist_blocks_cmp(const void *a, const void *b)
+{
+  double x=*(const double *)a;
+  double y=*(const double *)b;
+
+  return x<y?-1:y<x?1:0;
+}
+
+// sorts the gated blocks unless done so for the blocks there are.
+static int bs1770_hist_blocks_sort(bs1770_hist_t *hist)
+{
+  double gate=hist->pass1.wmsq*pow(10,0.1*hist->gate);
+  const bs1770_chunk_t *c;
+  double *wmsq;
+  size_t i, n, size;
+
+  if (hist->sorted.count==hist->pass1.count)
+    return 0;
+
+  if (hist->sorted.size<hist->pass1.count) {
+    size=2*hist->sorted.size;
+
+    if (size<hist->pass1.count)
+      size=(size_t)hist->pass1.count;
+
+    if (NULL==(wmsq=bs1770_arena_alloc(hist->arena,size*sizeof wmsq[0])))
+      return -1;
+
+    if (NULL!=hist->sorted.wmsq)
+      bs1770_arena_free(hist->arena,hist->sorted.wmsq);
+
+    hist->sorted.wmsq=wmsq;
+    hist->sorted.size=size;
+  }
+
+  wmsq=hist->sorted.wmsq;
+  hist->sorted.used=0;
+
+  for (c=hist->blocks.head;0<(n=bs1770_hist_blocks_size(hist,c));
+      c=bs1770_hist_blocks_next(hist,c)) {
+    for (i=0;i<n;++i) {
+      if (gate<c->wmsq[i])
+        wmsq[hist->sorted.used++]=c->wmsq[i];
+    }
+  }
+
+  qsort(wmsq,hist->sorted.used,sizeof wmsq[0],bs1770_hist_blocks_cmp);
+  hist->sorted.count=hist->pass1.count;
+
+  return 0;
+}
+
+double bs1770_hist_get_lra_exact(bs1770_hist_t *hist, double lower,
+   double upper)
+{
+  const double *wmsq;
+  unsigned long long count;
+  unsigned long long lower_count, upper_count;
+
+  if (hist->error||!hist->blocks.keep)
+    return NAN;
+
+  if (lower>upper) {
+    double tmp=lower;
+
+    lower=upper;
+    upper=tmp;
+  }
+
+  if (lower<0.0)
+    lower=0.0;
+
+  if (1.0<upper)
+    upper=1.0;
+
+  if (0ull==hist->pass1.count)
+    return 0.0;
+  else if (bs1770_hist_blocks_sort(hist)<0)
+    return NAN;   // out of memory.
+  else if (0ull==(count=hist->sorted.used))
+    return 0.0;
+
+  // the blocks at the same ranks as in the histograms.
+  wmsq=hist->sorted.wmsq;
+  lower_count=count*lower;
+  upper_count=count*upper;
+  lower_count=0ull<lower_count?lower_count-1:0ull;
+  upper_count=0ull<upper_count?upper_count-1:0ull;
+
+  return 10.0*log10(wmsq[upper_count]/wmsq[lower_count]);
+}
+
+#define HIST_CAT_(a,b)          a##b
+#define HIST_CAT(a,b)           HIST_CAT_(a,b)
+#define HIST(id)                HIST_CAT(id,HIST_SUFFIX)
+
+#define BS1770_HIST_GRAIN       BS1770_HIST_GRAIN_FINE
+#define HIST_SUFFIX             _fine
+#include "bs1770_hist.c"
+#undef HIST_SUFFIX
+#undef BS1770_HIST_GRAIN
+#define BS1770_HIST_GRAIN       BS1770_HIST_GRAIN_COARSE
+#define HIST_SUFFIX             _coarse
+#include "bs1770_hist.c"
+
+///////////////////////////////////////////////////////////////////////////////
+bs1770_hist_t *bs1770_hist_init(bs1770_hist_t *hist, const bs1770_ps_t *ps,
+    bs1770_arena_t *arena)
+{
+  hist->arena=arena;
+
+  if (ps->flags&BS1770_PS_COARSE)
+    return bs1770_hist_coarse.init(hist,ps);
+  else
+    return bs1770_hist_fine.init(hist,ps);
+}
+
+bs1770_hist_t *bs1770_hist_cleanup(bs1770_hist_t *hist)
+{
+  bs1770_chunk_t *c;
+
+  if (NULL!=hist->sorted.wmsq)
+    bs1770_arena_free(hist->arena,hist->sorted.wmsq);
+
+  while (NULL!=(c=hist->blocks.head)) {
+    hist->blocks.head=c->next;
+    bs1770_arena_free(hist->arena,c);
+  }
+
+  if (NULL!=hist->index.wmsq)
+    bs1770_arena_free(hist->arena,hist->index.wmsq);
+
+  if (NULL!=hist->index.count)
+    bs1770_arena_free(hist->arena,hist->index.count);
+
+  if (NULL!=hist->count64)
+    bs1770_arena_free(hist->arena,hist->count64);
+
+  if (NULL!=hist->count)
+    bs1770_arena_free(hist->arena,hist->count);
+
+  return hist;
+}
+
+void bs1770_hist_reset(bs1770_hist_t *hist)
+{
+  hist->ops->reset(hist);
+}
+
+void bs1770_hist_inc_bin(bs1770_hist_t *hist, double wmsq)
+{
+  hist->ops->inc_bin(hist,wmsq);
+}
+
+// histograms of different geometry do not add up, nor do tracks without
+// the blocks to an album keeping them.  that is an error leaving the album
+// in error too.  empty ones are skipped, they would leave an empty album's
+// mean at 0/0.  a track short of blocks leaves the album so too.
+int bs1770_hist_add(bs1770_hist_t *album, bs1770_hist_t *track)
+{
+  if (album->ops!=track->ops||track->error
+      ||(album->blocks.keep&&!track->blocks.keep))
+    album->error=1;
+  else if (0ull<track->pass1.count)
+    return album->ops->add(album,track);
+
+  return album->error?-1:0;
+}
+
+double bs1770_hist_get_lufs(bs1770_hist_t *hist, double reference)
+{
+  return hist->error?NAN:hist->ops->get_lufs(hist,reference);
+}
+
+double bs1770_hist_get_lra(bs1770_hist_t *hist, double lower,
+   double upper)
+{
+  return hist->error?NAN:hist->ops->get_lra(hist,lower,upper);
+}
+
+size_t bs1770_hist_write(const bs1770_hist_t *hist, void *buf, size_t size)
+{
+  return hist->ops->write(hist,buf,size);
+}
+
+static size_t bs1770_hist_parse(bs1770_hist_t *album, const void *buf,
+    size_t size, int add)
+{
+  size_t n;
+
+  if (NULL!=album)
+    return album->ops->read(album,buf,size,add);
+  else if (0<(n=bs1770_hist_fine.read(NULL,buf,size,0)))
+    return n;
+  else
+    return bs1770_hist_coarse.read(NULL,buf,size,0);
+}
+
+size_t bs1770_hist_read(bs1770_hist_t *album, const void *buf, size_t size)
+{
+  return bs1770_hist_parse(album,buf,size,1);
+}
+
+size_t bs1770_hist_check(bs1770_hist_t *album, const void *buf, size_t size)
+{
+  return bs1770_hist_parse(album,buf,size,0);
+}
+
+int bs1770_hist_index(bs1770_hist_t *hist)
+{
+  return hist->ops->index(hist);
+}
+#else // !defined (BS1770_HIST_GRAIN) {
+/*
+ * One histogram variant, instantiated above with BS1770_HIST_GRAIN bins
+ * per dB and its names suffixed by HIST_SUFFIX.
+ */
 #define BS1770_HIST_NBINS \
     (BS1770_HIST_GRAIN*(BS1770_HIST_MAX-BS1770_HIST_MIN)+1)
 
-static int bs1770_hist_bin_compare(const void *key, const void *bin)
+// lower edge of each bin as a mean square, bin "i" holding
+// [x[i],x[i+1]) and the last one everything above.  shared by all
+// histograms of the variant and filled in once by the first initialization,
+// possibly racing others on threads of their own.
+static double HIST(bs1770_hist_x)[BS1770_HIST_NBINS];
+static bs1770_hist_once_t HIST(bs1770_hist_x_once)=BS1770_HIST_ONCE_INIT;
+
+#define BS1770_HIST_DB(i) \
+    ((1.0/BS1770_HIST_GRAIN)*(i)+BS1770_HIST_MIN)
+
+static void HIST(bs1770_hist_x_fill)(void)
 {
-  if (*(const double *)key<((const bs1770_hist_bin_t *)bin)->x)
+  size_t i;
+
+  for (i=0;i<BS1770_HIST_NBINS;++i)
+    HIST(bs1770_hist_x)[i]=pow(10.0,0.1*(0.691+BS1770_HIST_DB(i)));
+}
+
+static bs1770_count_t HIST(bs1770_hist_count)(const bs1770_hist_t *hist,
+    size_t i)
+{
+  return NULL!=hist->count?hist->count[i]:hist->count64[i];
+}
+
+// switches the histogram over to 64 bit counts.
+static int HIST(bs1770_hist_promote)(bs1770_hist_t *hist)
+{
+  size_t i;
+
+  if (NULL==(hist->count64=bs1770_arena_alloc(hist->arena,
+      BS1770_HIST_NBINS*sizeof hist->count64[0])))
     return -1;
-  else if (0==((const bs1770_hist_bin_t *)bin)->y)
+
+  for (i=0;i<BS1770_HIST_NBINS;++i)
+    hist->count64[i]=hist->count[i];
+
+  bs1770_arena_free(hist->arena,hist->count);
+  hist->count=NULL;
+
+  return 0;
+}
+
+// number of bins with their lower edge not above "wmsq", i.e. one beyond
+// the bin "wmsq" falls into.
+static size_t HIST(bs1770_hist_upper)(double wmsq)
+{
+  const double *x=HIST(bs1770_hist_x);
+  double pos;
+  size_t i;
+
+  if (!(x[0]<=wmsq))
     return 0;
-  else if (((const bs1770_hist_bin_t *)bin)->y<=*(const double *)key)
-    return 1;
-  else
+
+  // estimate the bin from the level and correct the estimate against the
+  // bin edges, which may be off by one in either direction due to rounding.
+  pos=(10.0*log10(wmsq)-0.691-BS1770_HIST_MIN)*BS1770_HIST_GRAIN;
+  i=pos<BS1770_HIST_NBINS-1?(size_t)pos:BS1770_HIST_NBINS-1;
+
+  while (i+1<BS1770_HIST_NBINS&&x[i+1]<=wmsq)
+    ++i;
+
+  while (wmsq<x[i])
+    --i;
+
+  return i+1;
+}
+
+/// index /////////////////////////////////////////////////////////////////////
+// both trees are 1-based.  "index.count" sums the bins from the lowest one
+// upwards, "index.wmsq" from the highest one downwards, such that the
+// energy above the gate is a prefix sum of its own rather than the
+// difference of two larger ones.
+static void HIST(bs1770_hist_index_inc)(bs1770_hist_t *hist, size_t i)
+{
+  size_t k;
+
+  for (k=i+1;k<=BS1770_HIST_NBINS;k+=k&-k)
+    ++hist->index.count[k];
+
+  for (k=BS1770_HIST_NBINS-i;k<=BS1770_HIST_NBINS;k+=k&-k)
+    hist->index.wmsq[k]+=HIST(bs1770_hist_x)[i];
+}
+
+static void HIST(bs1770_hist_index_build)(bs1770_hist_t *hist)
+{
+  bs1770_count_t *count=hist->index.count;
+  double *wmsq=hist->index.wmsq;
+  size_t i, k;
+
+  for (i=1;i<=BS1770_HIST_NBINS;++i) {
+    k=BS1770_HIST_NBINS-i;
+    count[i]=HIST(bs1770_hist_count)(hist,i-1);
+    wmsq[i]=(double)HIST(bs1770_hist_count)(hist,k)*HIST(bs1770_hist_x)[k];
+  }
+
+  for (i=1;i<=BS1770_HIST_NBINS;++i) {
+    if ((k=i+(i&-i))<=BS1770_HIST_NBINS) {
+      count[k]+=count[i];
+      wmsq[k]+=wmsq[i];
+    }
+  }
+}
+
+// gives the histogram the index of BS1770_PS_INDEXED unless it has it.
+static int HIST(bs1770_hist_index)(bs1770_hist_t *hist)
+{
+  if (NULL!=hist->index.count)
     return 0;
+  else if (NULL==(hist->index.count=bs1770_arena_alloc(hist->arena,
+      (BS1770_HIST_NBINS+1)*sizeof hist->index.count[0])))
+    return -1;
+  else if (NULL==(hist->index.wmsq=bs1770_arena_alloc(hist->arena,
+      (BS1770_HIST_NBINS+1)*sizeof hist->index.wmsq[0]))) {
+    bs1770_arena_free(hist->arena,hist->index.count);
+    hist->index.count=NULL;
+    return -1;
+  }
+
+  HIST(bs1770_hist_index_build)(hist);
+
+  return 0;
 }
 
-void bs1770_hist_reset(bs1770_hist_t *hist)
+// number of blocks in the lowest "n" bins.
+static bs1770_count_t HIST(bs1770_hist_index_count)(
+    const bs1770_hist_t *hist, size_t n)
 {
-  double step=1.0/BS1770_HIST_GRAIN;
-  bs1770_hist_bin_t *wp=hist->bin;
-  bs1770_hist_bin_t *mp=wp+BS1770_HIST_NBINS;
+  bs1770_count_t count=0;
 
-  hist->pass1.wmsq=0.0;
-  hist->pass1.count=0;
+  for (;0<n;n-=n&-n)
+    count+=hist->index.count[n];
+
+  return count;
+}
+
+// energy of the blocks in the highest "n" bins.
+static double HIST(bs1770_hist_index_wmsq)(const bs1770_hist_t *hist,
+    size_t n)
+{
+  double wmsq=0.0;
 
-  while (wp<mp) {
-    size_t i=wp-hist->bin;
-    double db=step*i+BS1770_HIST_MIN;
-    double wsmq=pow(10.0,0.1*(0.691+db));
+  for (;0<n;n-=n&-n)
+    wmsq+=hist->index.wmsq[n];
 
-    wp->db=db;
-    wp->x=wsmq;
-    wp->y=0.0;
-    wp->count=0;
+  return wmsq;
+}
 
-    if (0<i)
-      wp[-1].y=wsmq;
+// the lowest bin up to which (including) at least "count" blocks are
+// counted, BS1770_HIST_NBINS if there is none.
+static size_t HIST(bs1770_hist_index_find)(const bs1770_hist_t *hist,
+    bs1770_count_t count)
+{
+  size_t pos=0, step=1;
 
-    ++wp;
+  while (step<=BS1770_HIST_NBINS/2)
+    step<<=1;
+
+  for (;0<step;step>>=1) {
+    if (pos+step<=BS1770_HIST_NBINS&&hist->index.count[pos+step]<count) {
+      pos+=step;
+      count-=hist->index.count[pos];
+    }
   }
+
+  return pos;
 }
 
-bs1770_hist_t *bs1770_hist_cleanup(bs1770_hist_t *hist)
+///////////////////////////////////////////////////////////////////////////////
+static void HIST(bs1770_hist_reset)(bs1770_hist_t *hist)
 {
-  if (NULL!=hist->bin)
-    free(hist->bin);
+  hist->error=0;
+  hist->pass1.wmsq=0.0;
+  hist->pass1.count=0;
+  bs1770_hist_blocks_reset(hist);
 
-  return hist;
+  if (NULL!=hist->count)
+    memset(hist->count,0,BS1770_HIST_NBINS*sizeof hist->count[0]);
+  else
+    memset(hist->count64,0,BS1770_HIST_NBINS*sizeof hist->count64[0]);
+
+  if (NULL!=hist->index.count) {
+    memset(hist->index.count,0,
+        (BS1770_HIST_NBINS+1)*sizeof hist->index.count[0]);
+    memset(hist->index.wmsq,0,
+        (BS1770_HIST_NBINS+1)*sizeof hist->index.wmsq[0]);
+  }
 }
 
-bs1770_hist_t *bs1770_hist_init(bs1770_hist_t *hist, const bs1770_ps_t *ps)
+static bs1770_hist_t *HIST(bs1770_hist_init)(bs1770_hist_t *hist,
+    const bs1770_ps_t *ps)
 {
+  hist->ops=&HIST(bs1770_hist);
   hist->active=0;
-  hist->bin=NULL;
+  hist->count=NULL;
+  hist->count64=NULL;
+  hist->index.count=NULL;
+  hist->index.wmsq=NULL;
+  hist->blocks.keep=0!=(ps->flags&BS1770_PS_EXACT);
+  hist->blocks.head=NULL;
+  hist->blocks.tail=NULL;
+  hist->sorted.wmsq=NULL;
+  hist->sorted.size=0;
+  hist->sorted.used=0;
 
   hist->gate=ps->gate;
 
-  if (NULL==(hist->bin
-      =malloc(BS1770_HIST_NBINS*sizeof(bs1770_hist_bin_t))))
+  if (NULL==(hist->count=bs1770_arena_alloc(hist->arena,
+      BS1770_HIST_NBINS*sizeof hist->count[0])))
     goto error;
 
-  bs1770_hist_reset(hist);
+  if (ps->flags&BS1770_PS_INDEXED) {
+    if (NULL==(hist->index.count=bs1770_arena_alloc(hist->arena,
+        (BS1770_HIST_NBINS+1)*sizeof hist->index.count[0])))
+      goto error;
+    else if (NULL==(hist->index.wmsq=bs1770_arena_alloc(hist->arena,
+        (BS1770_HIST_NBINS+1)*sizeof hist->index.wmsq[0])))
+      goto error;
+  }
+
+  bs1770_hist_once(&HIST(bs1770_hist_x_once),HIST(bs1770_hist_x_fill));
+  HIST(bs1770_hist_reset)(hist);
   hist->active=1;
 
   return hist;
@@ -97,68 +741,126 @@ error:
   return NULL;
 }
 
-void bs1770_hist_inc_bin(bs1770_hist_t *hist, double wmsq)
+static void HIST(bs1770_hist_inc_bin)(bs1770_hist_t *hist, double wmsq)
 {
-  bs1770_hist_bin_t *bin=bsearch(&wmsq,hist->bin,BS1770_HIST_NBINS,
-      sizeof hist->bin[0],bs1770_hist_bin_compare);
+  size_t i=HIST(bs1770_hist_upper)(wmsq);
 
-  if (NULL!=bin) {
-    // cumulative moving average.
-    hist->pass1.wmsq+=(wmsq-hist->pass1.wmsq)
-        /(double)(++hist->pass1.count);
-    ++bin->count;
+  // nothing below the first bin is counted.
+  if (0==i)
+    return;
+  else
+    --i;
+
+  if (NULL!=hist->count&&UINT32_MAX==hist->count[i]
+      &&HIST(bs1770_hist_promote)(hist)<0) {
+    hist->error=1;    // out of memory, the block is not counted.
+    return;
+  }
+  else if (hist->blocks.keep&&bs1770_hist_blocks_push(hist,wmsq)<0) {
+    hist->error=1;    // out of memory, the block is not kept.
+    return;
   }
+
+  // cumulative moving average.
+  hist->pass1.wmsq+=(wmsq-hist->pass1.wmsq)
+      /(double)(++hist->pass1.count);
+
+  if (NULL!=hist->index.count)
+    HIST(bs1770_hist_index_inc)(hist,i);
+
+  if (NULL!=hist->count)
+    ++hist->count[i];
+  else
+    ++hist->count64[i];
 }
 
-void bs1770_hist_add(bs1770_hist_t *album, bs1770_hist_t *track)
+static int HIST(bs1770_hist_add)(bs1770_hist_t *album,
+    bs1770_hist_t *track)
 {
   bs1770_count_t next_count=album->pass1.count+track->pass1.count;
-  bs1770_hist_bin_t *wp=album->bin;
-  const bs1770_hist_bin_t *rp=track->bin;
-  const bs1770_hist_bin_t *mp=rp+BS1770_HIST_NBINS;
+  bs1770_count_t count;
+  size_t i;
 
   // cumulative moving average.
   album->pass1.wmsq=(double)album->pass1.count/next_count*album->pass1.wmsq
       +(double)track->pass1.count/next_count*track->pass1.wmsq;
   album->pass1.count=next_count;
 
-  while (rp<mp)
-	(wp++)->count+=(rp++)->count;
+  for (i=0;i<BS1770_HIST_NBINS;++i) {
+    count=HIST(bs1770_hist_count)(album,i)+HIST(bs1770_hist_count)(track,i);
+
+    if (NULL!=album->count) {
+      if (UINT32_MAX>=count) {
+        album->count[i]=(uint32_t)count;
+        continue;
+      }
+      else if (HIST(bs1770_hist_promote)(album)<0) {
+        album->error=1;   // out of memory, the album is incomplete.
+        return -1;
+      }
+    }
+
+    album->count64[i]=count;
+  }
+
+  if (NULL!=album->index.count)
+    HIST(bs1770_hist_index_build)(album);
+
+  return album->blocks.keep?bs1770_hist_blocks_add(album,track):0;
 }
 
-double bs1770_hist_get_lufs(bs1770_hist_t *hist, double reference)
+static double HIST(bs1770_hist_get_lufs)(bs1770_hist_t *hist,
+    double reference)
 {
   double gate=hist->pass1.wmsq*pow(10,0.1*hist->gate);
-  const bs1770_hist_bin_t *rp=hist->bin;
-  const bs1770_hist_bin_t *mp=rp+BS1770_HIST_NBINS;
+  const double *x=HIST(bs1770_hist_x);
   double wmsq=0.0;
   unsigned long long count=0;
+  bs1770_count_t n;
+  size_t i;
 
-  while (rp<mp) {
-    if (0ull<rp->count&&gate<rp->x) {
-      wmsq+=(double)rp->count*rp->x;
-      count+=rp->count;
-    }
+  if (NULL!=hist->index.count) {
+    i=HIST(bs1770_hist_upper)(gate);
+    count=HIST(bs1770_hist_index_count)(hist,BS1770_HIST_NBINS)
+        -HIST(bs1770_hist_index_count)(hist,i);
+    wmsq=HIST(bs1770_hist_index_wmsq)(hist,BS1770_HIST_NBINS-i);
+
+    return BS1770_LKFS(count,wmsq,reference);
+  }
 
-    ++rp;
+  for (i=0;i<BS1770_HIST_NBINS;++i) {
+    n=HIST(bs1770_hist_count)(hist,i);
+
+    if (0ull<n&&gate<x[i]) {
+      wmsq+=(double)n*x[i];
+      count+=n;
+    }
   }
 
   return BS1770_LKFS(count,wmsq,reference);
 }
 
-double bs1770_hist_get_lra(bs1770_hist_t *hist, double lower,
+static double HIST(bs1770_hist_get_lra)(bs1770_hist_t *hist, double lower,
    double upper)
 {
   double gate=hist->pass1.wmsq*pow(10,0.1*hist->gate);
-  struct bs1770_hist_bin *rp=hist->bin;
-  struct bs1770_hist_bin *mp=rp+BS1770_HIST_NBINS;
+  const double *x=HIST(bs1770_hist_x);
   unsigned long long count=0ull;
+  bs1770_count_t n, base=0;
+  size_t i, gated=0;
 
-  while (rp<mp) {
-    if (0ull<rp->count&&gate<rp->x)
-      count+=rp->count;
+  if (NULL!=hist->index.count) {
+    gated=HIST(bs1770_hist_upper)(gate);
+    base=HIST(bs1770_hist_index_count)(hist,gated);
+    count=HIST(bs1770_hist_index_count)(hist,BS1770_HIST_NBINS)-base;
+  }
+  else {
+    for (i=0;i<BS1770_HIST_NBINS;++i) {
+      n=HIST(bs1770_hist_count)(hist,i);
 
-    ++rp;
+      if (0ull<n&&gate<x[i])
+        count+=n;
+    }
   }
 
   if (lower>upper) {
@@ -181,25 +883,38 @@ double bs1770_hist_get_lra(bs1770_hist_t *hist, double lower,
     double min=0.0;
     double max=0.0;
 
-    rp=hist->bin;
+    if (NULL!=hist->index.count) {
+      // like the scan below, a percentile reached within the lowest
+      // gated bin is not taken.
+      i=HIST(bs1770_hist_index_find)(hist,base+lower_count);
+
+      if (gated<i&&i<BS1770_HIST_NBINS)
+        min=BS1770_HIST_DB(i);
+
+      i=HIST(bs1770_hist_index_find)(hist,base+upper_count);
+
+      if (gated<i&&i<BS1770_HIST_NBINS)
+        max=BS1770_HIST_DB(i);
+
+      return max-min;
+    }
+
     count=0ull;
 
-    while (rp<mp) {
-      if (gate<rp->x) {
-        count+=rp->count;
+    for (i=0;i<BS1770_HIST_NBINS;++i) {
+      if (gate<x[i]) {
+        count+=HIST(bs1770_hist_count)(hist,i);
 
         if (prev_count<lower_count&&lower_count<=count)
-          min=rp->db;
+          min=BS1770_HIST_DB(i);
 
         if (prev_count<upper_count&&upper_count<=count) {
-          max=rp->db;
+          max=BS1770_HIST_DB(i);
           break;
         }
 
         prev_count=count;
       }
-
-      ++rp;
     }
 
     return max-min;
@@ -207,3 +922,163 @@ double bs1770_hist_get_lra(bs1770_hist_t *hist, double lower,
   else
     return 0.0;
 }
+
+static size_t HIST(bs1770_hist_emit)(const bs1770_hist_t *hist, void *buf,
+    size_t size)
+{
+  bs1770_hist_writer_t w;
+  bs1770_count_t n;
+  uint32_t nonempty=0;
+  size_t i, prev=(size_t)-1;
+
+  w.p=buf;
+  w.mp=NULL!=buf?w.p+size:NULL;
+  w.size=0;
+
+  for (i=0;i<BS1770_HIST_NBINS;++i) {
+    if (0ull<HIST(bs1770_hist_count)(hist,i))
+      ++nonempty;
+  }
+
+  bs1770_hist_put(&w,(uint16_t)(int16_t)BS1770_HIST_MIN,2);
+  bs1770_hist_put(&w,BS1770_HIST_GRAIN,2);
+  bs1770_hist_put(&w,BS1770_HIST_NBINS
+      |(hist->blocks.keep?BS1770_HIST_BLOCKS:0u),4);
+  bs1770_hist_put_f64(&w,hist->gate);
+  bs1770_hist_put(&w,hist->pass1.count,8);
+  bs1770_hist_put_f64(&w,hist->pass1.wmsq);
+  bs1770_hist_put(&w,nonempty,4);
+
+  for (i=0;i<BS1770_HIST_NBINS;++i) {
+    if (0ull<(n=HIST(bs1770_hist_count)(hist,i))) {
+      bs1770_hist_put_var(&w,i-prev);
+      bs1770_hist_put_var(&w,n);
+      prev=i;
+    }
+  }
+
+  if (hist->blocks.keep)
+    bs1770_hist_blocks_put(&w,hist);
+
+  return w.size;
+}
+
+static size_t HIST(bs1770_hist_write)(const bs1770_hist_t *hist,
+    void *buf, size_t size)
+{
+  size_t need=HIST(bs1770_hist_emit)(hist,NULL,0);
+
+  if (NULL!=buf&&need<=size)
+    HIST(bs1770_hist_emit)(hist,buf,size);
+
+  return need;
+}
+
+static size_t HIST(bs1770_hist_read)(bs1770_hist_t *album,
+    const void *buf, size_t size, int add)
+{
+  bs1770_hist_reader_t r;
+  bs1770_hist_t track;
+  bs1770_ps_t ps;
+  uint32_t nbins, nonempty;
+  uint64_t d, n, sum=0;
+  size_t i;
+
+  r.p=buf;
+  r.mp=r.p+size;
+  r.error=0;
+
+  memset(&ps,0,sizeof ps);
+
+  // histograms of different layout or gate do not add up.
+  if ((uint16_t)(int16_t)BS1770_HIST_MIN!=bs1770_hist_get(&r,2))
+    return 0;
+  else if (BS1770_HIST_GRAIN!=bs1770_hist_get(&r,2))
+    return 0;
+  else if (nbins=(uint32_t)bs1770_hist_get(&r,4),
+      BS1770_HIST_NBINS!=(nbins&~BS1770_HIST_BLOCKS))
+    return 0;
+  else if (ps.gate=bs1770_hist_get_f64(&r),r.error)
+    return 0;
+  else if (NULL!=album&&album->gate!=ps.gate)
+    return 0;
+  else if (NULL!=album&&album->blocks.keep&&!(nbins&BS1770_HIST_BLOCKS))
+    return 0;   // the album would miss these blocks.
+
+  // the blocks are skipped by an album not keeping them.
+  if (add&&NULL!=album&&album->blocks.keep)
+    ps.flags|=BS1770_PS_EXACT;
+
+  track.arena=NULL;
+  if (NULL==HIST(bs1770_hist_init)(&track,&ps))
+    return 0;
+
+  track.pass1.count=bs1770_hist_get(&r,8);
+  track.pass1.wmsq=bs1770_hist_get_f64(&r);
+  nonempty=(uint32_t)bs1770_hist_get(&r,4);
+
+  for (i=(size_t)-1;0<nonempty&&!r.error;--nonempty) {
+    d=bs1770_hist_get_var(&r);
+    n=bs1770_hist_get_var(&r);
+
+    if (0==d||BS1770_HIST_NBINS<d||BS1770_HIST_NBINS<=(i+=(size_t)d))
+      r.error=1;
+    else if (NULL!=track.count&&UINT32_MAX<n
+        &&HIST(bs1770_hist_promote)(&track)<0)
+      r.error=1;
+    else if (NULL!=track.count)
+      track.count[i]=(uint32_t)n;
+    else
+      track.count64[i]=n;
+
+    if ((sum+=n)<n)
+      r.error=1;
+  }
+
+  // the bins have to add up to the blocks counted, and their mean to be
+  // one of a mean square.
+  if (sum!=track.pass1.count)
+    r.error=1;
+  else if (!(0.0<=track.pass1.wmsq&&track.pass1.wmsq<HUGE_VAL))
+    r.error=1;
+  else if (nbins&BS1770_HIST_BLOCKS) {
+    bs1770_hist_blocks_get(&r,track.blocks.keep?&track:NULL,
+        track.pass1.count);
+  }
+
+  if (!r.error&&add&&NULL!=album&&0ull<track.pass1.count
+      &&HIST(bs1770_hist_add)(album,&track)<0)
+    r.error=1;
+
+  bs1770_hist_cleanup(&track);
+
+  return r.error?0:(size_t)(r.p-(const unsigned char *)buf);
+}
+
+const bs1770_hist_ops_t HIST(bs1770_hist)={
+#if defined (_MSC_VER)
+  HIST(bs1770_hist_init),
+  HIST(bs1770_hist_reset),
+  HIST(bs1770_hist_inc_bin),
+  HIST(bs1770_hist_add),
+  HIST(bs1770_hist_get_lufs),
+  HIST(bs1770_hist_get_lra),
+  HIST(bs1770_hist_write),
+  HIST(bs1770_hist_read),
+  HIST(bs1770_hist_index)
+#else
+  .init=HIST(bs1770_hist_init),
+  .reset=HIST(bs1770_hist_reset),
+  .inc_bin=HIST(bs1770_hist_inc_bin),
+  .add=HIST(bs1770_hist_add),
+  .get_lufs=HIST(bs1770_hist_get_lufs),
+  .get_lra=HIST(bs1770_hist_get_lra),
+  .write=HIST(bs1770_hist_write),
+  .read=HIST(bs1770_hist_read),
+  .index=HIST(bs1770_hist_index)
+#endif
+};
+
+#undef BS1770_HIST_DB
+#undef BS1770_HIST_NBINS
+#endif // } !defined (BS1770_HIST_GRAIN)
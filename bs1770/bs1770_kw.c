@@ -0,0 +1,377 @@
+/*
+ * bs1770_kw.c
+ * Copyright (C) 2011, 2012 Peter Belkner <pbelkner@snafu.de>
+ * 
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ * 
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ * 
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston,
+ * MA  02110-1301  USA
+ */
+#include <math.h>
+#include <string.h>
+#include "bs1770.h"
+
+#if defined (BS1770_KW_X86) && defined (__SSE2__)
+  #include <immintrin.h>
+  #define BS1770_KW_MXCSR
+  #define MXCSR_DAZ             (1u<<6)
+  #define MXCSR_FTZ             (1u<<15)
+#endif
+
+#define IS_DEN(x) \
+    (fabs(den_tmp=(x))<1.0e-15)
+#define DEN(x) \
+    (IS_DEN(x)?0.0:den_tmp)
+
+#define IS_DENF(x) \
+    (fabsf(denf_tmp=(x))<1.0e-15f)
+#define DENF(x) \
+    (IS_DENF(x)?0.0f:denf_tmp)
+
+static void bs1770_kw_scalar_f64(bs1770_kw_t *kw, const biquad_t *pre,
+    const biquad_t *rlb, double *buf, size_t nframes)
+{
+  double *mp=buf+nframes*kw->stride;
+  double den_tmp;
+  int i;
+
+  for (;buf<mp;buf+=kw->stride) {
+    for (i=0;i<kw->channels;++i) {
+      double x=DEN(buf[i]);
+      double y=DEN(pre->b0*x+pre->b1*kw->dbl.x1[i]+pre->b2*kw->dbl.x2[i]
+          -pre->a1*kw->dbl.y1[i]-pre->a2*kw->dbl.y2[i]);
+      double z=DEN(rlb->b0*y+rlb->b1*kw->dbl.y1[i]+rlb->b2*kw->dbl.y2[i]
+          -rlb->a1*kw->dbl.z1[i]-rlb->a2*kw->dbl.z2[i]);
+
+      kw->dbl.x2[i]=kw->dbl.x1[i];
+      kw->dbl.x1[i]=x;
+      kw->dbl.y2[i]=kw->dbl.y1[i];
+      kw->dbl.y1[i]=y;
+      kw->dbl.z2[i]=kw->dbl.z1[i];
+      kw->dbl.z1[i]=z;
+      buf[i]=kw->dbl.g[i]*z*z;
+    }
+  }
+}
+
+static void bs1770_kw_scalar_f32(bs1770_kw_t *kw, const biquad_t *pre,
+    const biquad_t *rlb, float *buf, size_t nframes)
+{
+  float pb0=pre->b0, pb1=pre->b1, pb2=pre->b2, pa1=pre->a1, pa2=pre->a2;
+  float rb0=rlb->b0, rb1=rlb->b1, rb2=rlb->b2, ra1=rlb->a1, ra2=rlb->a2;
+  float *mp=buf+nframes*kw->stride;
+  float denf_tmp;
+  int i;
+
+  for (;buf<mp;buf+=kw->stride) {
+    for (i=0;i<kw->channels;++i) {
+      float x=DENF(buf[i]);
+      float y=DENF(pb0*x+pb1*kw->flt.x1[i]+pb2*kw->flt.x2[i]
+          -pa1*kw->flt.y1[i]-pa2*kw->flt.y2[i]);
+      float z=DENF(rb0*y+rb1*kw->flt.y1[i]+rb2*kw->flt.y2[i]
+          -ra1*kw->flt.z1[i]-ra2*kw->flt.z2[i]);
+
+      kw->flt.x2[i]=kw->flt.x1[i];
+      kw->flt.x1[i]=x;
+      kw->flt.y2[i]=kw->flt.y1[i];
+      kw->flt.y1[i]=y;
+      kw->flt.z2[i]=kw->flt.z1[i];
+      kw->flt.z1[i]=z;
+      buf[i]=kw->flt.g[i]*z*z;
+    }
+  }
+}
+
+// channel-major counterparts: run "nframes" contiguous samples of a single
+// channel through both filters with the state held in locals and add the
+// weighted squares to "wssqs".
+static void bs1770_kw_block_f64(bs1770_kw_t *kw, const biquad_t *pre,
+    const biquad_t *rlb, int ch, const double *x, double *wssqs,
+    size_t nframes)
+{
+  double pb0=pre->b0, pb1=pre->b1, pb2=pre->b2, pa1=pre->a1, pa2=pre->a2;
+  double rb0=rlb->b0, rb1=rlb->b1, rb2=rlb->b2, ra1=rlb->a1, ra2=rlb->a2;
+  double g=kw->dbl.g[ch];
+  double x1=kw->dbl.x1[ch], x2=kw->dbl.x2[ch];
+  double y1=kw->dbl.y1[ch], y2=kw->dbl.y2[ch];
+  double z1=kw->dbl.z1[ch], z2=kw->dbl.z2[ch];
+  const double *mp=x+nframes;
+  double den_tmp;
+
+  while (x<mp) {
+    double x0=DEN(*x++);
+    double y0=DEN(pb0*x0+pb1*x1+pb2*x2-pa1*y1-pa2*y2);
+    double z0=DEN(rb0*y0+rb1*y1+rb2*y2-ra1*z1-ra2*z2);
+
+    x2=x1;
+    x1=x0;
+    y2=y1;
+    y1=y0;
+    z2=z1;
+    z1=z0;
+    *wssqs+++=g*z0*z0;
+  }
+
+  kw->dbl.x1[ch]=x1;
+  kw->dbl.x2[ch]=x2;
+  kw->dbl.y1[ch]=y1;
+  kw->dbl.y2[ch]=y2;
+  kw->dbl.z1[ch]=z1;
+  kw->dbl.z2[ch]=z2;
+}
+
+static void bs1770_kw_block_f32(bs1770_kw_t *kw, const biquad_t *pre,
+    const biquad_t *rlb, int ch, const float *x, double *wssqs,
+    size_t nframes)
+{
+  float pb0=pre->b0, pb1=pre->b1, pb2=pre->b2, pa1=pre->a1, pa2=pre->a2;
+  float rb0=rlb->b0, rb1=rlb->b1, rb2=rlb->b2, ra1=rlb->a1, ra2=rlb->a2;
+  float g=kw->flt.g[ch];
+  float x1=kw->flt.x1[ch], x2=kw->flt.x2[ch];
+  float y1=kw->flt.y1[ch], y2=kw->flt.y2[ch];
+  float z1=kw->flt.z1[ch], z2=kw->flt.z2[ch];
+  const float *mp=x+nframes;
+  float denf_tmp;
+
+  while (x<mp) {
+    float x0=DENF(*x++);
+    float y0=DENF(pb0*x0+pb1*x1+pb2*x2-pa1*y1-pa2*y2);
+    float z0=DENF(rb0*y0+rb1*y1+rb2*y2-ra1*z1-ra2*z2);
+
+    x2=x1;
+    x1=x0;
+    y2=y1;
+    y1=y0;
+    z2=z1;
+    z1=z0;
+    *wssqs+++=(double)(g*z0*z0);
+  }
+
+  kw->flt.x1[ch]=x1;
+  kw->flt.x2[ch]=x2;
+  kw->flt.y1[ch]=y1;
+  kw->flt.y2[ch]=y2;
+  kw->flt.z1[ch]=z1;
+  kw->flt.z2[ch]=z2;
+}
+
+const bs1770_kw_ops_t bs1770_kw_scalar={
+#if defined (_MSC_VER)
+  "scalar",
+  1,
+  1,
+  bs1770_kw_scalar_f64,
+  bs1770_kw_scalar_f32,
+  bs1770_kw_scalar_f64,
+  bs1770_kw_scalar_f32,
+  NULL
+#else
+  .name="scalar",
+  .lanes_f64=1,
+  .lanes_f32=1,
+  .filter_f64=bs1770_kw_scalar_f64,
+  .filter_f32=bs1770_kw_scalar_f32,
+  // the scalar kernels keep their explicit flush.
+  .filter_f64_ftz=bs1770_kw_scalar_f64,
+  .filter_f32_ftz=bs1770_kw_scalar_f32,
+  .lookahead_f64=NULL
+#endif
+};
+
+const bs1770_kw_ops_t *bs1770_kw_cpu(void)
+{
+#if defined (BS1770_KW_X86)
+  __builtin_cpu_init();
+
+  if (__builtin_cpu_supports("avx512f"))
+    return &bs1770_kw_avx512;
+  else if (__builtin_cpu_supports("avx2"))
+    return &bs1770_kw_avx2;
+  else if (__builtin_cpu_supports("sse2"))
+    return &bs1770_kw_sse2;
+#endif
+  return &bs1770_kw_scalar;
+}
+
+void bs1770_kw_reset(bs1770_kw_t *kw, int channels, const double *g)
+{
+  int lanes=kw->mode&BS1770_MODE_F32?kw->ops->lanes_f32:kw->ops->lanes_f64;
+  int i;
+
+  kw->channels=channels;
+  kw->lanes=lanes;
+  kw->stride=(channels+lanes-1)/lanes*lanes;
+  kw->primed=0;
+
+  memset(&kw->dbl,0,sizeof kw->dbl);
+  memset(&kw->flt,0,sizeof kw->flt);
+  memset(kw->buf,0,sizeof kw->buf);
+
+  for (i=0;i<channels;++i) {
+    kw->dbl.g[i]=g[i];
+    kw->flt.g[i]=g[i];
+  }
+}
+
+static void bs1770_kw_put_f32(bs1770_hist_writer_t *w, float x)
+{
+  uint32_t u;
+
+  memcpy(&u,&x,sizeof u);
+  bs1770_hist_put(w,u,4);
+}
+
+static float bs1770_kw_get_f32(bs1770_hist_reader_t *r)
+{
+  uint32_t u=(uint32_t)bs1770_hist_get(r,4);
+  float x;
+
+  memcpy(&x,&u,sizeof x);
+
+  return x;
+}
+
+// u8 primed, u32 channels and for each channel the double precision
+// x1, x2, y1, y2, z1 and z2 followed by the single precision ones.
+void bs1770_kw_write_state(const bs1770_kw_t *kw, bs1770_hist_writer_t *w)
+{
+  int i;
+
+  bs1770_hist_put(w,kw->primed,1);
+  bs1770_hist_put(w,kw->channels,4);
+
+  for (i=0;i<kw->channels;++i) {
+    bs1770_hist_put_f64(w,kw->dbl.x1[i]);
+    bs1770_hist_put_f64(w,kw->dbl.x2[i]);
+    bs1770_hist_put_f64(w,kw->dbl.y1[i]);
+    bs1770_hist_put_f64(w,kw->dbl.y2[i]);
+    bs1770_hist_put_f64(w,kw->dbl.z1[i]);
+    bs1770_hist_put_f64(w,kw->dbl.z2[i]);
+    bs1770_kw_put_f32(w,kw->flt.x1[i]);
+    bs1770_kw_put_f32(w,kw->flt.x2[i]);
+    bs1770_kw_put_f32(w,kw->flt.y1[i]);
+    bs1770_kw_put_f32(w,kw->flt.y2[i]);
+    bs1770_kw_put_f32(w,kw->flt.z1[i]);
+    bs1770_kw_put_f32(w,kw->flt.z2[i]);
+  }
+}
+
+// into a kernel already reset for as many channels.
+int bs1770_kw_read_state(bs1770_kw_t *kw, bs1770_hist_reader_t *r)
+{
+  int primed=(int)bs1770_hist_get(r,1);
+  int i;
+
+  if ((uint64_t)kw->channels!=bs1770_hist_get(r,4)||r->error)
+    return -1;
+
+  for (i=0;i<kw->channels;++i) {
+    kw->dbl.x1[i]=bs1770_hist_get_f64(r);
+    kw->dbl.x2[i]=bs1770_hist_get_f64(r);
+    kw->dbl.y1[i]=bs1770_hist_get_f64(r);
+    kw->dbl.y2[i]=bs1770_hist_get_f64(r);
+    kw->dbl.z1[i]=bs1770_hist_get_f64(r);
+    kw->dbl.z2[i]=bs1770_hist_get_f64(r);
+    kw->flt.x1[i]=bs1770_kw_get_f32(r);
+    kw->flt.x2[i]=bs1770_kw_get_f32(r);
+    kw->flt.y1[i]=bs1770_kw_get_f32(r);
+    kw->flt.y2[i]=bs1770_kw_get_f32(r);
+    kw->flt.z1[i]=bs1770_kw_get_f32(r);
+    kw->flt.z2[i]=bs1770_kw_get_f32(r);
+  }
+
+  kw->primed=primed;
+
+  return r->error?-1:0;
+}
+
+void bs1770_kw_prime(bs1770_kw_t *kw, const double *frame)
+{
+  double den_tmp;
+  float denf_tmp;
+  int i;
+
+  for (i=0;i<kw->channels;++i) {
+    kw->dbl.x1[i]=DEN(frame[i]);
+    kw->flt.x1[i]=DENF((float)frame[i]);
+  }
+
+  kw->primed=1;
+}
+
+void bs1770_kw_prime_f32(bs1770_kw_t *kw, const float *frame)
+{
+  double den_tmp;
+  float denf_tmp;
+  int i;
+
+  for (i=0;i<kw->channels;++i) {
+    kw->dbl.x1[i]=DEN((double)frame[i]);
+    kw->flt.x1[i]=DENF(frame[i]);
+  }
+
+  kw->primed=1;
+}
+
+void bs1770_kw_filter(bs1770_kw_t *kw, const biquad_t *pre,
+    const biquad_t *rlb, double *buf, size_t nframes)
+{
+#if defined (BS1770_KW_MXCSR)
+  if (kw->mode&BS1770_MODE_FTZ) {
+    unsigned int csr=_mm_getcsr();
+
+    _mm_setcsr(csr|MXCSR_DAZ|MXCSR_FTZ);
+    kw->ops->filter_f64_ftz(kw,pre,rlb,buf,nframes);
+    _mm_setcsr(csr);
+
+    return;
+  }
+#endif
+
+  kw->ops->filter_f64(kw,pre,rlb,buf,nframes);
+}
+
+void bs1770_kw_filter_f32(bs1770_kw_t *kw, const biquad_t *pre,
+    const biquad_t *rlb, float *buf, size_t nframes)
+{
+#if defined (BS1770_KW_MXCSR)
+  if (kw->mode&BS1770_MODE_FTZ) {
+    unsigned int csr=_mm_getcsr();
+
+    _mm_setcsr(csr|MXCSR_DAZ|MXCSR_FTZ);
+    kw->ops->filter_f32_ftz(kw,pre,rlb,buf,nframes);
+    _mm_setcsr(csr);
+
+    return;
+  }
+#endif
+
+  kw->ops->filter_f32(kw,pre,rlb,buf,nframes);
+}
+
+void bs1770_kw_filter_block_f32(bs1770_kw_t *kw, const biquad_t *pre,
+    const biquad_t *rlb, int ch, const float *x, double *wssqs,
+    size_t nframes)
+{
+  bs1770_kw_block_f32(kw,pre,rlb,ch,x,wssqs,nframes);
+}
+
+void bs1770_kw_filter_block(bs1770_kw_t *kw, const biquad_t *pre,
+    const biquad_t *rlb, int ch, const double *x, double *wssqs,
+    size_t nframes)
+{
+  if ((kw->mode&BS1770_MODE_LOOKAHEAD)&&NULL!=kw->ops->lookahead_f64)
+    kw->ops->lookahead_f64(kw,pre,rlb,ch,x,wssqs,nframes);
+  else
+    bs1770_kw_block_f64(kw,pre,rlb,ch,x,wssqs,nframes);
+}
@@ -0,0 +1,272 @@
+/*
+ * bs1770_kw_simd.c
+ * Copyright (C) 2011, 2012 Peter Belkner <pbelkner@snafu.de>
+ * 
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ * 
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ * 
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston,
+ * MA  02110-1301  USA
+ */
+/*
+ * Channel parallel K-weighting: every vector lane carries one channel
+ * such that the filter state of a group of channels stays in registers
+ * while running over all frames.  The operations are carried out in the
+ * same order as in the scalar kernels, hence the results are bit
+ * identical (provided no FMA contraction takes place, cf. Makefile).
+ *
+ * This file instantiates itself once per precision, with and without
+ * the explicit denormal flush.
+ *
+ * For a single channel the lanes are put to use along time instead
+ * (BS1770_MODE_LOOKAHEAD, double precision only): each biquad is run
+ * in block state-space form, i.e. with the impulse response h[] and
+ * the zero input responses c1[], c2[] of its recursive part a block of
+ * LANES outputs is
+ *
+ *   y[k]=sum(j<=k) h[k-j]*f[j]+c1[k]*y[-1]+c2[k]*y[-2],  k<LANES,
+ *
+ * where f[] is the output of its non-recursive part.  The recursion thus
+ * advances LANES samples per step.  The different order of operations
+ * makes the results deviate from the scalar reference by rounding, well
+ * below 0.001 LU on EBU Tech 3341/3342 material.
+ */
+#if !defined (BITS)
+#include <math.h>
+#include "bs1770.h"
+
+#if defined (BS1770_KW_X86)
+#include <immintrin.h>
+
+#define BITS 64
+#define SUFFIX _f64
+#include "bs1770_kw_simd.c"
+#undef SUFFIX
+#define SUFFIX _f64_ftz
+#define FTZ
+#include "bs1770_kw_simd.c"
+#undef FTZ
+#undef SUFFIX
+#undef BITS
+#define BITS 32
+#define SUFFIX _f32
+#include "bs1770_kw_simd.c"
+#undef SUFFIX
+#define SUFFIX _f32_ftz
+#define FTZ
+#include "bs1770_kw_simd.c"
+#undef FTZ
+
+const bs1770_kw_ops_t OPS={
+#if defined (_MSC_VER)
+  NAME,
+  LANES_F64,
+  LANES_F32,
+  KW_CAT(bs1770_kw_,ISA,_f64),
+  KW_CAT(bs1770_kw_,ISA,_f32),
+  KW_CAT(bs1770_kw_,ISA,_f64_ftz),
+  KW_CAT(bs1770_kw_,ISA,_f32_ftz),
+  KW_CAT(bs1770_kw_,ISA,_lookahead_f64)
+#else
+  .name=NAME,
+  .lanes_f64=LANES_F64,
+  .lanes_f32=LANES_F32,
+  .filter_f64=KW_CAT(bs1770_kw_,ISA,_f64),
+  .filter_f32=KW_CAT(bs1770_kw_,ISA,_f32),
+  .filter_f64_ftz=KW_CAT(bs1770_kw_,ISA,_f64_ftz),
+  .filter_f32_ftz=KW_CAT(bs1770_kw_,ISA,_f32_ftz),
+  .lookahead_f64=KW_CAT(bs1770_kw_,ISA,_lookahead_f64)
+#endif
+};
+#endif // BS1770_KW_X86
+#else // BITS
+#include "bs1770_kw_simd.h"
+
+static void FILTER(bs1770_kw_t *kw, const biquad_t *pre,
+    const biquad_t *rlb, T *buf, size_t nframes)
+{
+  const V pb0=SET1(pre->b0), pb1=SET1(pre->b1), pb2=SET1(pre->b2);
+  const V pa1=SET1(pre->a1), pa2=SET1(pre->a2);
+  const V rb0=SET1(rlb->b0), rb1=SET1(rlb->b1), rb2=SET1(rlb->b2);
+  const V ra1=SET1(rlb->a1), ra2=SET1(rlb->a2);
+  int stride=kw->stride;
+  int i;
+
+  for (i=0;i<kw->channels;i+=LANES) {
+    const V g=LOAD(kw->S.g+i);
+    V x1=LOAD(kw->S.x1+i), x2=LOAD(kw->S.x2+i);
+    V y1=LOAD(kw->S.y1+i), y2=LOAD(kw->S.y2+i);
+    V z1=LOAD(kw->S.z1+i), z2=LOAD(kw->S.z2+i);
+    T *wp=buf+i;
+    T *mp=wp+nframes*stride;
+
+    for (;wp<mp;wp+=stride) {
+      V x=DEN(LOAD(wp));
+      V y=DEN(SUB(SUB(ADD(ADD(MUL(pb0,x),MUL(pb1,x1)),MUL(pb2,x2)),
+          MUL(pa1,y1)),MUL(pa2,y2)));
+      V z=DEN(SUB(SUB(ADD(ADD(MUL(rb0,y),MUL(rb1,y1)),MUL(rb2,y2)),
+          MUL(ra1,z1)),MUL(ra2,z2)));
+
+      x2=x1;
+      x1=x;
+      y2=y1;
+      y1=y;
+      z2=z1;
+      z1=z;
+      STORE(wp,MUL(MUL(g,z),z));
+    }
+
+    STORE(kw->S.x1+i,x1);
+    STORE(kw->S.x2+i,x2);
+    STORE(kw->S.y1+i,y1);
+    STORE(kw->S.y2+i,y2);
+    STORE(kw->S.z1+i,z1);
+    STORE(kw->S.z2+i,z2);
+  }
+}
+
+#if 64==BITS && !defined (FTZ)
+#define LA_CHUNK              256
+#define LA_T                  KW_CAT(bs1770_kw_,ISA,_la_t)
+#define LA_INIT               KW_CAT(bs1770_kw_,ISA,_la_init)
+#define LA_RUN                KW_CAT(bs1770_kw_,ISA,_la_run)
+#define LOOKAHEAD             KW_CAT(bs1770_kw_,ISA,_lookahead_f64)
+#define DEN1(x) \
+  (fabs(den_tmp=(x))<1.0e-15?0.0:den_tmp)
+
+typedef struct {
+  double b0, b1, b2;
+  double h[LANES][LANES];   // h[j][k]: contribution of f[j] to y[k].
+  double c1[LANES];         // contribution of y[-1].
+  double c2[LANES];         // contribution of y[-2].
+} LA_T;
+
+static void LA_INIT(LA_T *la, const biquad_t *bq)
+{
+  double h[LANES];
+  int j, k;
+
+  la->b0=bq->b0;
+  la->b1=bq->b1;
+  la->b2=bq->b2;
+
+  for (k=0;k<LANES;++k) {
+    h[k]=0==k?1.0:-bq->a1*h[k-1]-(1<k?bq->a2*h[k-2]:0.0);
+    la->c1[k]=-bq->a1*(0<k?la->c1[k-1]:1.0)
+        -bq->a2*(1<k?la->c1[k-2]:0==k?0.0:1.0);
+    la->c2[k]=-bq->a1*(0<k?la->c2[k-1]:0.0)
+        -bq->a2*(1<k?la->c2[k-2]:0==k?1.0:0.0);
+  }
+
+  for (j=0;j<LANES;++j) {
+    for (k=0;k<LANES;++k)
+      la->h[j][k]=j<=k?h[k-j]:0.0;
+  }
+}
+
+// runs the "n" samples at "x+2" through the biquad into "y+2", where
+// "x[0]", "x[1]" and "y[0]", "y[1]" hold the respective history.
+static void LA_RUN(const LA_T *la, const double *x, double *y, size_t n)
+{
+  const V b0=SET1(la->b0), b1=SET1(la->b1), b2=SET1(la->b2);
+  const V c1=LOAD(la->c1), c2=LOAD(la->c2);
+  V h[LANES];
+  double f[LANES];
+  double den_tmp;
+  size_t k;
+  int j;
+
+  for (j=0;j<LANES;++j)
+    h[j]=LOAD(la->h[j]);
+
+  for (k=0;k+LANES<=n;k+=LANES) {
+    V acc;
+
+    STORE(f,ADD(ADD(MUL(b0,LOAD(x+k+2)),MUL(b1,LOAD(x+k+1))),
+        MUL(b2,LOAD(x+k))));
+    acc=MUL(SET1(f[0]),h[0]);
+
+    for (j=1;j<LANES;++j)
+      acc=ADD(acc,MUL(SET1(f[j]),h[j]));
+
+    STORE(y+k+2,DEN(ADD(acc,ADD(MUL(SET1(y[k+1]),c1),
+        MUL(SET1(y[k]),c2)))));
+  }
+
+  for (;k<n;++k) {
+    // c1[0] and c2[0] are just -a1 and -a2.
+    y[k+2]=DEN1(la->b0*x[k+2]+la->b1*x[k+1]+la->b2*x[k]
+        +la->c1[0]*y[k+1]+la->c2[0]*y[k]);
+  }
+}
+
+static void LOOKAHEAD(bs1770_kw_t *kw, const biquad_t *pre,
+    const biquad_t *rlb, int ch, const double *x, double *wssqs,
+    size_t nframes)
+{
+  const V g=SET1(kw->dbl.g[ch]);
+  double t[LA_CHUNK+2], u[LA_CHUNK+2], w[LA_CHUNK+2];
+  LA_T lp, lr;
+  double den_tmp;
+  size_t n, k;
+
+  LA_INIT(&lp,pre);
+  LA_INIT(&lr,rlb);
+
+  t[0]=kw->dbl.x2[ch];
+  t[1]=kw->dbl.x1[ch];
+  u[0]=kw->dbl.y2[ch];
+  u[1]=kw->dbl.y1[ch];
+  w[0]=kw->dbl.z2[ch];
+  w[1]=kw->dbl.z1[ch];
+
+  while (0<nframes) {
+    n=nframes<LA_CHUNK?nframes:LA_CHUNK;
+
+    for (k=0;k+LANES<=n;k+=LANES)
+      STORE(t+k+2,DEN(LOAD(x+k)));
+
+    for (;k<n;++k)
+      t[k+2]=DEN1(x[k]);
+
+    LA_RUN(&lp,t,u,n);
+    LA_RUN(&lr,u,w,n);
+
+    for (k=0;k+LANES<=n;k+=LANES) {
+      V z=LOAD(w+k+2);
+
+      STORE(wssqs+k,ADD(LOAD(wssqs+k),MUL(MUL(g,z),z)));
+    }
+
+    for (;k<n;++k)
+      wssqs[k]+=kw->dbl.g[ch]*w[k+2]*w[k+2];
+
+    t[0]=t[n];
+    t[1]=t[n+1];
+    u[0]=u[n];
+    u[1]=u[n+1];
+    w[0]=w[n];
+    w[1]=w[n+1];
+    x+=n;
+    wssqs+=n;
+    nframes-=n;
+  }
+
+  kw->dbl.x2[ch]=t[0];
+  kw->dbl.x1[ch]=t[1];
+  kw->dbl.y2[ch]=u[0];
+  kw->dbl.y1[ch]=u[1];
+  kw->dbl.z2[ch]=w[0];
+  kw->dbl.z1[ch]=w[1];
+}
+#endif
+#endif // BITS
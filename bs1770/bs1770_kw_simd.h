@@ -0,0 +1,154 @@
+/*
+ * bs1770_kw_simd.h
+ * Copyright (C) 2011, 2012 Peter Belkner <pbelkner@snafu.de>
+ * 
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ * 
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ * 
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston,
+ * MA  02110-1301  USA
+ */
+/*
+ * Maps the generic vector operations used by bs1770_kw_simd.c onto the
+ * instruction set selected by SSE2, AVX2 or AVX512 and the precision
+ * selected by BITS, that of the frames as well as of the filters.
+ * With FTZ defined the explicit denormal flush DEN() is dropped, the
+ * caller then runs the kernel with flush-to-zero/denormals-are-zero set.
+ * Included once per variant, hence no include guard.
+ */
+#define KW_CAT_(a,b,c)        a##b##c
+#define KW_CAT(a,b,c)         KW_CAT_(a,b,c)
+#define OPS                   KW_CAT(bs1770_kw_,ISA,)
+#define FILTER                KW_CAT(bs1770_kw_,ISA,SUFFIX)
+#undef LANES
+#undef T
+#undef V
+#undef S
+#undef SET1
+#undef LOAD
+#undef STORE
+#undef ADD
+#undef SUB
+#undef MUL
+#undef DEN
+#undef DEN_
+
+#if defined (SSE2)
+  #define NAME                "sse2"
+  #define ISA                 sse2
+  #define LANES_F64           2
+  #define LANES_F32           4
+
+  #if 64==BITS
+    #define LANES             LANES_F64
+    #define T                 double
+    #define V                 __m128d
+    #define S                 dbl
+    #define SET1(x)           _mm_set1_pd(x)
+    #define LOAD(p)           _mm_loadu_pd(p)
+    #define STORE(p,x)        _mm_storeu_pd(p,x)
+    #define ADD(x,y)          _mm_add_pd(x,y)
+    #define SUB(x,y)          _mm_sub_pd(x,y)
+    #define MUL(x,y)          _mm_mul_pd(x,y)
+    #define DEN_(x)           _mm_andnot_pd(_mm_cmplt_pd( \
+        _mm_andnot_pd(_mm_set1_pd(-0.0),x),_mm_set1_pd(1.0e-15)),x)
+  #else
+    #define LANES             LANES_F32
+    #define T                 float
+    #define V                 __m128
+    #define S                 flt
+    #define SET1(x)           _mm_set1_ps((float)(x))
+    #define LOAD(p)           _mm_loadu_ps(p)
+    #define STORE(p,x)        _mm_storeu_ps(p,x)
+    #define ADD(x,y)          _mm_add_ps(x,y)
+    #define SUB(x,y)          _mm_sub_ps(x,y)
+    #define MUL(x,y)          _mm_mul_ps(x,y)
+    #define DEN_(x)           _mm_andnot_ps(_mm_cmplt_ps( \
+        _mm_andnot_ps(_mm_set1_ps(-0.0f),x),_mm_set1_ps(1.0e-15f)),x)
+  #endif
+#elif defined (AVX2)
+  #define NAME                "avx2"
+  #define ISA                 avx2
+  #define LANES_F64           4
+  #define LANES_F32           8
+
+  #if 64==BITS
+    #define LANES             LANES_F64
+    #define T                 double
+    #define V                 __m256d
+    #define S                 dbl
+    #define SET1(x)           _mm256_set1_pd(x)
+    #define LOAD(p)           _mm256_loadu_pd(p)
+    #define STORE(p,x)        _mm256_storeu_pd(p,x)
+    #define ADD(x,y)          _mm256_add_pd(x,y)
+    #define SUB(x,y)          _mm256_sub_pd(x,y)
+    #define MUL(x,y)          _mm256_mul_pd(x,y)
+    #define DEN_(x)           _mm256_andnot_pd(_mm256_cmp_pd( \
+        _mm256_andnot_pd(_mm256_set1_pd(-0.0),x),_mm256_set1_pd(1.0e-15), \
+        _CMP_LT_OQ),x)
+  #else
+    #define LANES             LANES_F32
+    #define T                 float
+    #define V                 __m256
+    #define S                 flt
+    #define SET1(x)           _mm256_set1_ps((float)(x))
+    #define LOAD(p)           _mm256_loadu_ps(p)
+    #define STORE(p,x)        _mm256_storeu_ps(p,x)
+    #define ADD(x,y)          _mm256_add_ps(x,y)
+    #define SUB(x,y)          _mm256_sub_ps(x,y)
+    #define MUL(x,y)          _mm256_mul_ps(x,y)
+    #define DEN_(x)           _mm256_andnot_ps(_mm256_cmp_ps( \
+        _mm256_andnot_ps(_mm256_set1_ps(-0.0f),x),_mm256_set1_ps(1.0e-15f), \
+        _CMP_LT_OQ),x)
+  #endif
+#elif defined (AVX512)
+  #define NAME                "avx512"
+  #define ISA                 avx512
+  #define LANES_F64           8
+  #define LANES_F32           16
+
+  #if 64==BITS
+    #define LANES             LANES_F64
+    #define T                 double
+    #define V                 __m512d
+    #define S                 dbl
+    #define SET1(x)           _mm512_set1_pd(x)
+    #define LOAD(p)           _mm512_loadu_pd(p)
+    #define STORE(p,x)        _mm512_storeu_pd(p,x)
+    #define ADD(x,y)          _mm512_add_pd(x,y)
+    #define SUB(x,y)          _mm512_sub_pd(x,y)
+    #define MUL(x,y)          _mm512_mul_pd(x,y)
+    #define DEN_(x)           _mm512_maskz_mov_pd(_mm512_cmp_pd_mask( \
+        _mm512_abs_pd(x),_mm512_set1_pd(1.0e-15),_CMP_NLT_UQ),x)
+  #else
+    #define LANES             LANES_F32
+    #define T                 float
+    #define V                 __m512
+    #define S                 flt
+    #define SET1(x)           _mm512_set1_ps((float)(x))
+    #define LOAD(p)           _mm512_loadu_ps(p)
+    #define STORE(p,x)        _mm512_storeu_ps(p,x)
+    #define ADD(x,y)          _mm512_add_ps(x,y)
+    #define SUB(x,y)          _mm512_sub_ps(x,y)
+    #define MUL(x,y)          _mm512_mul_ps(x,y)
+    #define DEN_(x)           _mm512_maskz_mov_ps(_mm512_cmp_ps_mask( \
+        _mm512_abs_ps(x),_mm512_set1_ps(1.0e-15f),_CMP_NLT_UQ),x)
+  #endif
+#else
+  #error "Undefined instruction set."
+#endif
+
+#if defined (FTZ)
+  #define DEN(x)              (x)
+#else
+  #define DEN(x)              DEN_(x)
+#endif
@@ -0,0 +1 @@
+#include "bs1770_kw_simd.c"
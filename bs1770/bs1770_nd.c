@@ -30,6 +30,8 @@ bs1770_nd_t *bs1770_nd_init(bs1770_nd_t *node, bs1770_ctx_t *ctx,
 	goto error;
   else if (NULL!=lra&&NULL==bs1770_stats_init(&node->lra,&ctx->lra,lra))
 	goto error;
+  else if (NULL==(node->snap=bs1770_snap_new(&ctx->arena)))
+	goto error;
   else if (NULL==bs1770_init(&node->bs1770,&node->lufs.aggr,
       NULL!=lra?&node->lra.aggr:NULL))
 	goto error;
@@ -44,12 +46,51 @@ error:
 bs1770_nd_t *bs1770_nd_cleanup(bs1770_nd_t *node)
 {
   bs1770_cleanup(&node->bs1770);
+
+  if (NULL!=node->snap)
+    bs1770_snap_free(node->snap,node->lufs.album->arena);
+
   bs1770_stats_cleanup(&node->lra);
   bs1770_stats_cleanup(&node->lufs);
 
   return node;
 }
 
+// back to the state right after init, keeping the buffers.
+void bs1770_nd_reset(bs1770_nd_t *node)
+{
+  bs1770_stats_reset(&node->lufs);
+
+  if (node->lra.active)
+    bs1770_stats_reset(&node->lra);
+
+  bs1770_init(&node->bs1770,&node->lufs.aggr,
+      node->lra.active?&node->lra.aggr:NULL);
+  bs1770_snap_reset(node->snap);
+}
+
+void bs1770_nd_set_album(bs1770_nd_t *node, bs1770_hist_t *lufs,
+    bs1770_hist_t *lra)
+{
+  node->lufs.album=lufs;
+  node->lufs.aggr.album=lufs;
+
+  if (node->lra.active) {
+    node->lra.album=lra;
+    node->lra.aggr.album=lra;
+  }
+}
+
+void bs1770_nd_set_mode(bs1770_nd_t *node, int mode)
+{
+  bs1770_set_mode(&node->bs1770,mode);
+}
+
+void bs1770_nd_set_weights(bs1770_nd_t *node, int channels, const double *g)
+{
+  bs1770_set_weights(&node->bs1770,channels,g);
+}
+
 #if 0
 void bs1770_nd_add_sample(bs1770_nd_t *node, double fs, int channels,
     bs1770_sample_t sample)
@@ -60,10 +101,10 @@ void bs1770_nd_add_sample(bs1770_nd_t *node, double fs, int channels,
 
 double bs1770_nd_track_lufs(bs1770_nd_t *node, double reference)
 {
-  return bs1770_track_lufs(&node->bs1770,reference);
+  return bs1770_track_lufs(&node->bs1770,reference,&node->lufs.exact);
 }
 
 double bs1770_nd_track_lra(bs1770_nd_t *node, double lower, double upper)
 {
-  return bs1770_track_lra(&node->bs1770,lower,upper);
+  return bs1770_track_lra(&node->bs1770,lower,upper,&node->lra.exact);
 }
@@ -0,0 +1 @@
+#include "bs1770_nd_add_samples.c"
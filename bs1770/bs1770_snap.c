@@ -0,0 +1,156 @@
+/*
+ * bs1770_snap.c
+ * Copyright (C) 2011, 2012 Peter Belkner <pbelkner@snafu.de>
+ * 
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ * 
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ * 
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston,
+ * MA  02110-1301  USA
+ */
+#include <string.h>
+#include "bs1770.h"
+
+#define BS1770_SNAP_FIELDS      7     // doubles of a bs1770_snapshot_t.
+
+#if defined (_MSC_VER)
+// MSVC C has no <stdatomic.h>, the accessors of <winnt.h> do the same.
+#include <windows.h>
+typedef LONG bs1770_snap_seq_t;
+typedef LONG64 bs1770_snap_word_t;
+#define SEQ_INIT(p,x)           (*(p)=(LONG)(x))
+#define SEQ_LOAD(p)             ((unsigned)ReadNoFence(p))
+#define SEQ_LOAD_ACQUIRE(p)     ((unsigned)ReadAcquire(p))
+#define SEQ_STORE(p,x)          WriteNoFence(p,(LONG)(x))
+#define SEQ_STORE_RELEASE(p,x)  WriteRelease(p,(LONG)(x))
+#define WORD_INIT(p,x)          (*(p)=(LONG64)(x))
+#define WORD_LOAD(p)            ((uint64_t)ReadNoFence64(p))
+#define WORD_STORE(p,x)         WriteNoFence64(p,(LONG64)(x))
+#define FENCE_RELEASE()         MemoryBarrier()
+#define FENCE_ACQUIRE()         MemoryBarrier()
+#else
+#include <stdatomic.h>
+typedef atomic_uint bs1770_snap_seq_t;
+typedef atomic_uint_least64_t bs1770_snap_word_t;
+#define SEQ_INIT(p,x)           atomic_init(p,x)
+#define SEQ_LOAD(p) \
+  atomic_load_explicit(p,memory_order_relaxed)
+#define SEQ_LOAD_ACQUIRE(p) \
+  atomic_load_explicit(p,memory_order_acquire)
+#define SEQ_STORE(p,x) \
+  atomic_store_explicit(p,x,memory_order_relaxed)
+#define SEQ_STORE_RELEASE(p,x) \
+  atomic_store_explicit(p,x,memory_order_release)
+#define WORD_INIT(p,x)          atomic_init(p,x)
+#define WORD_LOAD(p) \
+  atomic_load_explicit(p,memory_order_relaxed)
+#define WORD_STORE(p,x) \
+  atomic_store_explicit(p,x,memory_order_relaxed)
+#define FENCE_RELEASE()         atomic_thread_fence(memory_order_release)
+#define FENCE_ACQUIRE()         atomic_thread_fence(memory_order_acquire)
+#endif
+
+// the snapshots are published under a sequence lock: "seq" is odd while
+// one is being written and counts up by two with each, a reader retries
+// until it saw the same even "seq" before and after copying.  The writer
+// never waits for a reader.
+struct bs1770_snap {
+  bs1770_snap_seq_t seq;    // 0 if none published yet.
+  uint64_t every;           // hops of the loudness blocks between two.
+  const bs1770_aggr_t *lra; // NULL unless the LRA is measured.
+  bs1770_snap_word_t data[BS1770_SNAP_FIELDS];
+};
+
+bs1770_snap_t *bs1770_snap_new(bs1770_arena_t *arena)
+{
+  bs1770_snap_t *snap=bs1770_arena_alloc(arena,sizeof *snap);
+
+  if (NULL!=snap)
+    bs1770_snap_reset(snap);
+
+  return snap;
+}
+
+void bs1770_snap_free(bs1770_snap_t *snap, bs1770_arena_t *arena)
+{
+  bs1770_arena_free(arena,snap);
+}
+
+void bs1770_snap_reset(bs1770_snap_t *snap)
+{
+  int i;
+
+  SEQ_INIT(&snap->seq,0u);
+  snap->every=0;
+  snap->lra=NULL;
+
+  for (i=0;i<BS1770_SNAP_FIELDS;++i)
+    WORD_INIT(snap->data+i,0u);
+}
+
+void bs1770_snap_set(bs1770_snap_t *snap, uint64_t every,
+    const bs1770_aggr_t *lra)
+{
+  snap->every=every;
+  snap->lra=lra;
+}
+
+// the fields are stored as the bits of the doubles in the order of
+// bs1770_snapshot_t, relaxed, between the two increments of "seq".  Only
+// what is cheap is taken here on the thread measuring, see
+// "bs1770_aggr_peek()".
+void bs1770_snap_publish(bs1770_snap_t *snap, const bs1770_aggr_t *lufs)
+{
+  bs1770_snapshot_t snapshot;
+  uint64_t bits[BS1770_SNAP_FIELDS];
+  unsigned seq;
+  int i;
+
+  if (0==snap->every||0!=lufs->hops.count%snap->every)
+    return;
+
+  seq=SEQ_LOAD(&snap->seq);
+  bs1770_aggr_peek(lufs,snap->lra,&snapshot);
+  memcpy(bits,&snapshot,sizeof bits);
+
+  SEQ_STORE(&snap->seq,seq+1u);
+  FENCE_RELEASE();
+
+  for (i=0;i<BS1770_SNAP_FIELDS;++i)
+    WORD_STORE(snap->data+i,bits[i]);
+
+  SEQ_STORE_RELEASE(&snap->seq,seq+2u);
+}
+
+int bs1770_snap_read(const bs1770_snap_t *snap, bs1770_snapshot_t *snapshot)
+{
+  uint64_t bits[BS1770_SNAP_FIELDS];
+  unsigned seq, next;
+  int i;
+
+  do {
+    seq=SEQ_LOAD_ACQUIRE(&snap->seq);
+
+    for (i=0;i<BS1770_SNAP_FIELDS;++i)
+      bits[i]=WORD_LOAD(snap->data+i);
+
+    FENCE_ACQUIRE();
+    next=SEQ_LOAD(&snap->seq);
+  } while (seq!=next||(seq&1u));
+
+  if (0u==seq)
+    return 0;
+
+  memcpy(snapshot,bits,sizeof bits);
+
+  return 1;
+}
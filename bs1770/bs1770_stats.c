@@ -17,6 +17,7 @@
  * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston,
  * MA  02110-1301  USA
  */
+#include <math.h>
 #include <string.h>
 #include "bs1770.h"
 
@@ -25,8 +26,9 @@ bs1770_stats_t *bs1770_stats_init(bs1770_stats_t *stats, bs1770_hist_t *album,
 {
   memset(stats,0,sizeof *stats);
   stats->album=album;
+  stats->exact=NAN;
 
-  if (NULL==bs1770_hist_init(&stats->track,ps))
+  if (NULL==bs1770_hist_init(&stats->track,ps,album->arena))
 	goto error;
   else if (NULL==bs1770_aggr_init(&stats->aggr,ps,&stats->track,album))
 	goto error;
@@ -47,3 +49,13 @@ bs1770_stats_t *bs1770_stats_cleanup(bs1770_stats_t *stats)
 
   return stats;
 }
+
+void bs1770_stats_reset(bs1770_stats_t *stats)
+{
+  bs1770_hist_reset(&stats->track);
+  bs1770_aggr_reset(&stats->aggr);
+  bs1770_aggr_reset_track(&stats->aggr);
+  bs1770_aggr_set_series(&stats->aggr,NULL,NULL);
+  bs1770_aggr_set_snap(&stats->aggr,NULL);
+  stats->exact=NAN;
+}
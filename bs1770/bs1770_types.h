@@ -33,22 +33,24 @@
 
 #if defined (i16)
   #undef i16
-  #define MAX                 (INT16_MAX-1)
+  #define MAX                 (-(double)INT16_MIN)
   #define TP                  MKTP(i16)
   #define FN(id)              MKFN(id,i16)
 #elif defined (i32)
   #undef i32
-  #define MAX                 (INT32_MAX-1)
+  #define MAX                 (-(double)INT32_MIN)
   #define TP                  MKTP(i32)
   #define FN(id)              MKFN(id,i32)
 #elif defined (f32)
   #undef f32
   #define                     FLOAT
+  #define                     BS1770_F32
   #define TP                  MKTP(f32)
   #define FN(id)              MKFN(id,f32)
 #elif defined (f64)
   #undef f64
   #define                     FLOAT
+  #define                     BS1770_F64
   #define TP                  MKTP(f64)
   #define FN(id)              MKFN(id,f64)
 #else
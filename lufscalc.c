@@ -20,9 +20,12 @@
  * simple lufs and peak calculation program using libavcodec/libavformat
  */
 
+#define _GNU_SOURCE
 #include <unistd.h>
 #include <stddef.h>
 #include <math.h>
+#include <pthread.h>
+#include <sched.h>
 #include "libavcodec/avcodec.h"
 #include "libavutil/imgutils.h"
 #include "libavutil/mathematics.h"
@@ -31,6 +34,8 @@
 #include "libavutil/opt.h"
 #include "libavutil/log.h"
 #include "libavutil/time.h"
+#include "libavutil/intreadwrite.h"
+#include "libavutil/intfloat.h"
 #include "libavformat/avformat.h"
 #include "libswresample/swresample.h"
 
@@ -41,7 +46,11 @@
 #define MAX_STREAMS 32
 #define SAMPLE_RATE 48000
 #define BUFSIZE (192000 * 4)
-#define CH_MAX 32
+#define CH_MAX 64
+#define SEGMENT_MIN (60 * AV_TIME_BASE)
+#define PREROLL (4 * AV_TIME_BASE)
+#define POSTROLL (1 * AV_TIME_BASE)
+#define SEGMENT_HOP (AV_TIME_BASE / 10)
 
 #ifdef __GNUC__
 #define likely(x)       __builtin_expect((x),1)
@@ -68,7 +77,8 @@ typedef struct OutputContext {
     int src_sample_rate;
     int src_channels;
     int last_channels;
-    double *buffers[CH_MAX];
+    int tgt_sample_rate;
+    uint8_t *buffers[CH_MAX];
     int buffer_pos;
 } OutputContext;
     
@@ -76,7 +86,7 @@ typedef struct TruePeakContext {
     int initialized;
     SwrContext *swr_ctx[CH_MAX];
     int swr_ctx_initialized[CH_MAX];
-    double *buffers[1];
+    uint8_t *buffers[1];
     double peak;
     double current_peak;
     double tplimit;
@@ -84,12 +94,25 @@ typedef struct TruePeakContext {
 
 typedef struct CalcContext {
     bs1770_ctx_t *bs1770_ctx;
+    size_t bs1770_index;
     int nb_channels;
+    int stream;
+    int sample_rate;
+    double weights[CH_MAX];
+    int nb_weights;
     TruePeakContext peak;
     double lufs;
     double lra;
+    double lufs_exact;
+    double lra_exact;
+    double max_momentary;
+    double max_shortterm;
     struct CalcContext *next;
     int64_t nb_samples;
+    int track;
+    struct LufscalcConfig *conf;
+    uint8_t *hist;
+    size_t hist_size;
 } CalcContext;
 
 typedef struct LufscalcConfig {
@@ -107,6 +130,27 @@ typedef struct LufscalcConfig {
     int status;
     int downmix;
     int lra;
+    int plr;
+    int exact;
+    int f32;
+    int ftz;
+    int lookahead;
+    int nativerate;
+    char *histfile;
+    int merge;
+    FILE *histfp;
+    char *seriesfile;
+    int seriesbin;
+    FILE *seriesfp;
+    bs1770_pool_t *pool;
+    size_t pool_tracks;
+    int file_index;
+    int segments;
+    char *checkpoint;
+    int checkpoint_sec;
+    int jobs;
+    int pin;
+    FILE *out;
 } LufscalcConfig;
 
 static const AVOption lufscalc_config_options[] = {
@@ -122,6 +166,21 @@ static const AVOption lufscalc_config_options[] = {
   { "downmix",      "downmix input audio streams to this number of channels",          offsetof(LufscalcConfig, downmix),        AV_OPT_TYPE_INT,    { 0 },   0, 6 },
   { "d",            "same as -downmix",                                                offsetof(LufscalcConfig, downmix),        AV_OPT_TYPE_INT,    { 0 },   0, 6 },
   { "lra",          "calculate loudenss range",                                        offsetof(LufscalcConfig, lra),            AV_OPT_TYPE_INT,    { 0 },   0, 1 },
+  { "plr",          "also report max momentary and short-term loudness and PLR",       offsetof(LufscalcConfig, plr),            AV_OPT_TYPE_INT,    { 0 },   0, 1 },
+  { "exact",        "also report loudness and lra of the blocks themselves, unbinned", offsetof(LufscalcConfig, exact),          AV_OPT_TYPE_INT,    { 0 },   0, 1 },
+  { "f32",          "measure using single precision samples",                          offsetof(LufscalcConfig, f32),            AV_OPT_TYPE_INT,    { 0 },   0, 1 },
+  { "ftz",          "filter with denormals flushed to zero by the cpu",                offsetof(LufscalcConfig, ftz),            AV_OPT_TYPE_INT,    { 0 },   0, 1 },
+  { "lookahead",    "filter mono and stereo audio several samples at a time",          offsetof(LufscalcConfig, lookahead),      AV_OPT_TYPE_INT,    { 0 },   0, 1 },
+  { "nativerate",   "measure at the sample rate of each stream instead of 48 kHz",     offsetof(LufscalcConfig, nativerate),     AV_OPT_TYPE_INT,    { 0 },   0, 1 },
+  { "histfile",     "write the loudness histograms of every track to this file",       offsetof(LufscalcConfig, histfile),       AV_OPT_TYPE_STRING },
+  { "merge",        "merge histogram files into album loudness instead of decoding",   offsetof(LufscalcConfig, merge),          AV_OPT_TYPE_INT,    { 0 },   0, 1 },
+  { "series",       "write momentary and short-term loudness per 100 ms to this file", offsetof(LufscalcConfig, seriesfile),     AV_OPT_TYPE_STRING },
+  { "seriesbin",    "write the loudness series as binary records instead of csv",      offsetof(LufscalcConfig, seriesbin),      AV_OPT_TYPE_INT,    { 0 },   0, 1 },
+  { "segments",     "decode in this many segments, within a sample of a single pass",  offsetof(LufscalcConfig, segments),       AV_OPT_TYPE_INT,    { 1 },   1, 64 },
+  { "checkpoint",   "keep state in this file to resume an interrupted measurement",    offsetof(LufscalcConfig, checkpoint),     AV_OPT_TYPE_STRING },
+  { "checkpointsec", "write the checkpoint every this many seconds of audio",          offsetof(LufscalcConfig, checkpoint_sec), AV_OPT_TYPE_INT,    { 60 },  1, INT_MAX },
+  { "jobs",         "measure this many files at a time, the longest first",            offsetof(LufscalcConfig, jobs),           AV_OPT_TYPE_INT,    { 1 },   1, 1024 },
+  { "pin",          "pin each of the jobs to a cpu of its own",                        offsetof(LufscalcConfig, pin),            AV_OPT_TYPE_INT,    { 0 },   0, 1 },
   { "resilient",    "continue file processing on decoding errors",                     offsetof(LufscalcConfig, resilient),      AV_OPT_TYPE_INT,    { 0 },   0, 1 },
   { "r",            "same as -resilient",                                              offsetof(LufscalcConfig, resilient),      AV_OPT_TYPE_INT,    { 0 },   0, 1 },
   { "crlf",         "write crlf to the end of logfile lines",                          offsetof(LufscalcConfig, crlf),           AV_OPT_TYPE_INT,    { 0 },   0, 1 },
@@ -147,31 +206,61 @@ static void panic(const char *msg, ...)
     exit(1);
 }
 
-static void calc_lufs(double* dblbuf[CH_MAX], int nb_samples, const int tgt_sample_rate, CalcContext *calc) {
-    int j, k = 0;
-    double *dblbuf2[CH_MAX];
-    for (; calc; calc = calc->next) {
-        for (j=0; j<calc->nb_channels; j++)
-            dblbuf2[j] = dblbuf[k+j];
-        if (calc->nb_channels == 6) {
-            dblbuf2[3] = dblbuf2[4];
-            dblbuf2[4] = dblbuf2[5];
-        }
-        bs1770_ctx_add_samples_p_f64(calc->bs1770_ctx, 0, tgt_sample_rate, calc->nb_channels, dblbuf2, nb_samples);
+static void calc_lufs(uint8_t* buf[CH_MAX], enum AVSampleFormat sample_fmt, int nb_samples, const int tgt_sample_rate, CalcContext *calc, CalcContext *end) {
+    int k = 0;
+    if (calc->next && calc->next->bs1770_ctx == calc->bs1770_ctx) {
+        /* all tracks share one context and are filtered side by side */
+        if (sample_fmt == AV_SAMPLE_FMT_FLTP)
+            bs1770_ctx_add_samples_batch_p_f32(calc->bs1770_ctx, tgt_sample_rate, calc->nb_channels, (float **)buf, nb_samples);
+        else
+            bs1770_ctx_add_samples_batch_p_f64(calc->bs1770_ctx, tgt_sample_rate, calc->nb_channels, (double **)buf, nb_samples);
+        for (; calc != end; calc = calc->next)
+            calc->nb_samples += nb_samples;
+        return;
+    }
+    for (; calc != end; calc = calc->next) {
+        if (sample_fmt == AV_SAMPLE_FMT_FLTP)
+            bs1770_ctx_add_samples_p_f32(calc->bs1770_ctx, 0, tgt_sample_rate, calc->nb_channels, (float **)(buf + k), nb_samples);
+        else
+            bs1770_ctx_add_samples_p_f64(calc->bs1770_ctx, 0, tgt_sample_rate, calc->nb_channels, (double **)(buf + k), nb_samples);
         calc->nb_samples += nb_samples;
         k += calc->nb_channels;
     }
 }
 
-static double peak_max(double *buf, int nb_samples, double peak) {
-    double *bufmax = buf + nb_samples;
-    for (; buf < bufmax; buf++)
-        if (unlikely((peak < fabs(*buf))))
-            peak = fabs(*buf);
+/* BS.1770 channel weight: LFE is excluded, surround channels (60 to 120
+ * degrees azimuth) count 1.41.  Back channels are surrounds unless the
+ * layout also carries side channels, as e.g. 5.1(back) versus 7.1. */
+static double channel_weight(uint64_t channel_layout, int index) {
+    uint64_t channel = av_channel_layout_extract_channel(channel_layout, index);
+    if (channel & (AV_CH_LOW_FREQUENCY | AV_CH_LOW_FREQUENCY_2))
+        return 0.0;
+    if (channel & (AV_CH_SIDE_LEFT | AV_CH_SIDE_RIGHT | AV_CH_WIDE_LEFT | AV_CH_WIDE_RIGHT |
+                   AV_CH_SURROUND_DIRECT_LEFT | AV_CH_SURROUND_DIRECT_RIGHT))
+        return 1.41;
+    if ((channel & (AV_CH_BACK_LEFT | AV_CH_BACK_RIGHT)) && !(channel_layout & (AV_CH_SIDE_LEFT | AV_CH_SIDE_RIGHT)))
+        return 1.41;
+    return 1.0;
+}
+
+static double peak_max(uint8_t *buf, enum AVSampleFormat sample_fmt, int nb_samples, double peak) {
+    if (sample_fmt == AV_SAMPLE_FMT_FLTP) {
+        float *fltbuf = (float *)buf;
+        float *fltbufmax = fltbuf + nb_samples;
+        for (; fltbuf < fltbufmax; fltbuf++)
+            if (unlikely((peak < fabsf(*fltbuf))))
+                peak = fabsf(*fltbuf);
+    } else {
+        double *dblbuf = (double *)buf;
+        double *dblbufmax = dblbuf + nb_samples;
+        for (; dblbuf < dblbufmax; dblbuf++)
+            if (unlikely((peak < fabs(*dblbuf))))
+                peak = fabs(*dblbuf);
+    }
     return peak;
 }
 
-static void calc_peak_context(double* dblbuf[CH_MAX], int nb_channels, int nb_samples, const int tgt_sample_rate, TruePeakContext *truepeak) {
+static void calc_peak_context(uint8_t* buf[CH_MAX], enum AVSampleFormat sample_fmt, int nb_channels, int nb_samples, const int tgt_sample_rate, TruePeakContext *truepeak) {
     int i;
     int nb_resampled_samples;
     double channel_peak;
@@ -179,8 +268,8 @@ static void calc_peak_context(double* dblbuf[CH_MAX], int nb_channels, int nb_sa
     if (!truepeak->initialized) {
         for (i=0;i<nb_channels;i++) {
             truepeak->swr_ctx[i] = swr_alloc_set_opts(NULL,
-                                         av_get_default_channel_layout(1), AV_SAMPLE_FMT_DBLP, 192000,
-                                         av_get_default_channel_layout(1), AV_SAMPLE_FMT_DBLP, tgt_sample_rate,
+                                         av_get_default_channel_layout(1), sample_fmt, FFMAX(192000, tgt_sample_rate),
+                                         av_get_default_channel_layout(1), sample_fmt, tgt_sample_rate,
                                          0, NULL);
             if (!truepeak->swr_ctx[i])
                 panic("failed to init resampler");
@@ -191,7 +280,7 @@ static void calc_peak_context(double* dblbuf[CH_MAX], int nb_channels, int nb_sa
     }
 
     for (i=0; i<nb_channels; i++) {
-        channel_peak = peak_max(dblbuf[i], nb_samples, 0.0);
+        channel_peak = peak_max(buf[i], sample_fmt, nb_samples, 0.0);
 
         if (channel_peak > truepeak->tplimit) {
             if (!truepeak->swr_ctx_initialized[i])
@@ -199,14 +288,14 @@ static void calc_peak_context(double* dblbuf[CH_MAX], int nb_channels, int nb_sa
                     panic("failed to init resampler");
             truepeak->swr_ctx_initialized[i] = 1;
 
-            nb_resampled_samples = swr_convert(truepeak->swr_ctx[i], (uint8_t**)truepeak->buffers, BUFSIZE / av_get_bytes_per_sample(AV_SAMPLE_FMT_DBLP),
-                                               (const uint8_t**)(dblbuf+i), nb_samples);
+            nb_resampled_samples = swr_convert(truepeak->swr_ctx[i], truepeak->buffers, BUFSIZE / av_get_bytes_per_sample(sample_fmt),
+                                               (const uint8_t**)(buf+i), nb_samples);
             if (nb_resampled_samples < 0)
                 panic("audio_resample() failed");
-            if (nb_resampled_samples == BUFSIZE / av_get_bytes_per_sample(AV_SAMPLE_FMT_DBLP))
+            if (nb_resampled_samples == BUFSIZE / av_get_bytes_per_sample(sample_fmt))
                 panic("audio buffer is probably too small");
     
-            channel_peak = peak_max(truepeak->buffers[0], nb_resampled_samples, channel_peak);
+            channel_peak = peak_max(truepeak->buffers[0], sample_fmt, nb_resampled_samples, channel_peak);
         } else {
             truepeak->swr_ctx_initialized[i] = 0;
         }
@@ -220,23 +309,22 @@ static void calc_peak_context(double* dblbuf[CH_MAX], int nb_channels, int nb_sa
         truepeak->tplimit = truepeak->peak / 2.0;
 }
 
-static void calc_peak(double* dblbuf[CH_MAX], int nb_samples, const int tgt_sample_rate, CalcContext *calc) {
+static void calc_peak(uint8_t* buf[CH_MAX], enum AVSampleFormat sample_fmt, int nb_samples, const int tgt_sample_rate, CalcContext *calc, CalcContext *end) {
     int k = 0;
-    for (; calc; calc = calc->next) {
-        calc_peak_context(dblbuf + k, calc->nb_channels, nb_samples, tgt_sample_rate, &calc->peak);
+    for (; calc != end; calc = calc->next) {
+        calc_peak_context(buf + k, sample_fmt, calc->nb_channels, nb_samples, tgt_sample_rate, &calc->peak);
         k += calc->nb_channels;
     }
 }
 
-static void output_samples(AVFrame *frame, OutputContext *out, int downmix) {
-    const int tgt_sample_rate = SAMPLE_RATE;
-    const enum AVSampleFormat tgt_sample_fmt = AV_SAMPLE_FMT_DBLP;
+static void output_samples(AVFrame *frame, OutputContext *out, int downmix, enum AVSampleFormat tgt_sample_fmt) {
+    const int tgt_sample_rate = out->tgt_sample_rate;
     int64_t tgt_channel_layout;
     int tgt_channels;
     int64_t c_channel_layout;
     int nb_samples;
     int i;
-    double *buffers2[CH_MAX];
+    uint8_t *buffers2[CH_MAX];
     
     c_channel_layout = (frame->channel_layout && frame->channels == av_get_channel_layout_nb_channels(frame->channel_layout)) ? frame->channel_layout : av_get_default_channel_layout(frame->channels);
 
@@ -278,8 +366,8 @@ static void output_samples(AVFrame *frame, OutputContext *out, int downmix) {
     }
     
     for (i=0; i<tgt_channels; i++)
-        buffers2[i] = out->buffers[i] + out->buffer_pos;
-    nb_samples = swr_convert(out->swr_ctx, (uint8_t**)buffers2, BUFSIZE / av_get_bytes_per_sample(tgt_sample_fmt) - out->buffer_pos,
+        buffers2[i] = out->buffers[i] + out->buffer_pos * av_get_bytes_per_sample(tgt_sample_fmt);
+    nb_samples = swr_convert(out->swr_ctx, buffers2, BUFSIZE / av_get_bytes_per_sample(tgt_sample_fmt) - out->buffer_pos,
                                     (const uint8_t**)frame->extended_data, frame->nb_samples);
     
     if (nb_samples < 0)
@@ -293,14 +381,31 @@ static void output_samples(AVFrame *frame, OutputContext *out, int downmix) {
 
 }
 
-static int calc_available_audio_samples(CalcContext *calc, OutputContext out[], int nb_audio_streams, int64_t nb_decoded_samples, double peak_log_limit, FILE *logfile, int crlf) {
+static void log_peaks(CalcContext *calc, CalcContext *end, int index, int64_t nb_decoded_samples, int sample_rate, double peak_log_limit, FILE *logfile, int crlf) {
+    int i;
+    for (i=index; calc != end; calc = calc->next, i++)
+        if (peak_log_limit <= calc->peak.current_peak)
+            fprintf(logfile, "%d %02d:%02d:%02d:%02d %.1f%s\n", i,
+                                                      (int)(nb_decoded_samples / sample_rate / 60 / 60),
+                                                      (int)(nb_decoded_samples / sample_rate / 60 % 60),
+                                                      (int)(nb_decoded_samples / sample_rate % 60),
+                                                      (int)(nb_decoded_samples * 25 / sample_rate % 25),
+                                                      20 * log10(calc->peak.current_peak),
+                                                      crlf ? "\r" : "");
+}
+
+/* Feed the tracks [calc, end), numbered from index, with the samples the
+ * given streams have in common.  The streams share one sample rate.  Unless
+ * peak is set the samples only count for the loudness, see Segment. */
+static void calc_available_audio_samples(CalcContext *calc, CalcContext *end, int index, OutputContext out[], int nb_audio_streams, enum AVSampleFormat sample_fmt, int peak, double peak_log_limit, FILE *logfile, int crlf) {
+    const int64_t nb_decoded_samples = calc->nb_samples;
     int i, j, k;
     int min_nb_samples = out[0].buffer_pos;
     for (i=1; i<nb_audio_streams; i++)
         min_nb_samples = FFMIN(min_nb_samples, out[i].buffer_pos);
 
     if (min_nb_samples) {
-        double *bufs[CH_MAX];
+        uint8_t *bufs[CH_MAX];
         k = 0;
         for (i=0; i<nb_audio_streams; i++) {
             for (j=0;j<out[i].last_channels;j++)
@@ -308,77 +413,534 @@ static int calc_available_audio_samples(CalcContext *calc, OutputContext out[],
             out[i].buffer_pos -= min_nb_samples;
         }
 
-        calc_lufs(bufs, min_nb_samples, SAMPLE_RATE, calc);
-        calc_peak(bufs, min_nb_samples, SAMPLE_RATE, calc);
-
-        for (i=0; calc; calc = calc->next, i++)
-            if (peak_log_limit <= calc->peak.current_peak)
-                fprintf(logfile, "%d %02d:%02d:%02d:%02d %.1f%s\n", i,
-                                                          (int)(nb_decoded_samples / SAMPLE_RATE / 60 / 60),
-                                                          (int)(nb_decoded_samples / SAMPLE_RATE / 60 % 60),
-                                                          (int)(nb_decoded_samples / SAMPLE_RATE % 60),
-                                                          (int)(nb_decoded_samples * 25 / SAMPLE_RATE % 25),
-                                                          20 * log10(calc->peak.current_peak),
-                                                          crlf ? "\r" : "");
+        calc_lufs(bufs, sample_fmt, min_nb_samples, out[0].tgt_sample_rate, calc, end);
+        if (peak) {
+            calc_peak(bufs, sample_fmt, min_nb_samples, out[0].tgt_sample_rate, calc, end);
+            log_peaks(calc, end, index, nb_decoded_samples, out[0].tgt_sample_rate, peak_log_limit, logfile, crlf);
+        }
         for (i=0; i<nb_audio_streams; i++)
             if (out[i].buffer_pos)
                 for (j=0;j<out[i].last_channels;j++)
-                    memmove(out[i].buffers[j], out[i].buffers[j] + min_nb_samples, out[i].buffer_pos * av_get_bytes_per_sample(AV_SAMPLE_FMT_DBLP));
+                    memmove(out[i].buffers[j], out[i].buffers[j] + min_nb_samples * av_get_bytes_per_sample(sample_fmt), out[i].buffer_pos * av_get_bytes_per_sample(sample_fmt));
+    }
+}
+
+/* Without a common sample rate every stream feeds its own tracks. */
+static void calc_available_stream_samples(CalcContext *calc, OutputContext out[], int nb_audio_streams, enum AVSampleFormat sample_fmt, int peak, double peak_log_limit, FILE *logfile, int crlf) {
+    CalcContext *end;
+    int i, index = 0, nb_tracks;
+    for (i=0; i<nb_audio_streams; i++) {
+        for (end = calc, nb_tracks = 0; end && end->stream == i; end = end->next)
+            nb_tracks++;
+        if (calc != end)
+            calc_available_audio_samples(calc, end, index, &out[i], 1, sample_fmt, peak, peak_log_limit, logfile, crlf);
+        else
+            out[i].buffer_pos = 0;
+        calc = end;
+        index += nb_tracks;
+    }
+}
+
+static int channel_stream(const int stream_channels[], int nb_audio_streams, int channel) {
+    int i;
+    for (i=0; i<nb_audio_streams-1 && channel >= stream_channels[i]; i++)
+        channel -= stream_channels[i];
+    return i;
+}
+
+/*
+ * Native ingestion: a single stream measured as a single track at the
+ * target rate goes straight from the decoded frame into the kernel of
+ * its sample format, without resampling into the output buffers.
+ */
+static int native_frame(const AVFrame *frame, const OutputContext *out, const CalcContext *calc, int nb_audio_streams, int downmix) {
+    if (nb_audio_streams != 1 || calc->next || downmix || out->buffer_pos)
+        return 0;
+    if (frame->sample_rate != out->tgt_sample_rate || frame->channels != calc->nb_channels)
+        return 0;
+    switch (frame->format) {
+    case AV_SAMPLE_FMT_S16:
+    case AV_SAMPLE_FMT_S16P:
+    case AV_SAMPLE_FMT_S32:
+    case AV_SAMPLE_FMT_S32P:
+    case AV_SAMPLE_FMT_FLT:
+    case AV_SAMPLE_FMT_FLTP:
+    case AV_SAMPLE_FMT_DBL:
+    case AV_SAMPLE_FMT_DBLP:
+        return 1;
+    default:
+        return 0;
+    }
+}
+
+static double native_peak_max(const AVFrame *frame, int channel) {
+    int planar = av_sample_fmt_is_planar(frame->format);
+    int stride = planar ? 1 : frame->channels;
+    int k = planar ? 0 : channel;
+    int n = frame->nb_samples * stride;
+    const uint8_t *data = frame->extended_data[planar ? channel : 0];
+    double peak = 0.0;
+    switch (av_get_packed_sample_fmt(frame->format)) {
+    case AV_SAMPLE_FMT_S16: {
+        int max = 0;
+        for (; k < n; k += stride)
+            max = FFMAX(max, abs(((const int16_t *)data)[k]));
+        peak = max / 32768.0;
+        break;
+    }
+    case AV_SAMPLE_FMT_S32: {
+        int64_t max = 0;
+        for (; k < n; k += stride)
+            max = FFMAX(max, llabs((int64_t)((const int32_t *)data)[k]));
+        peak = max / 2147483648.0;
+        break;
+    }
+    case AV_SAMPLE_FMT_FLT:
+        for (; k < n; k += stride)
+            if (unlikely((peak < fabsf(((const float *)data)[k]))))
+                peak = fabsf(((const float *)data)[k]);
+        break;
+    default:
+        for (; k < n; k += stride)
+            if (unlikely((peak < fabs(((const double *)data)[k]))))
+                peak = fabs(((const double *)data)[k]);
+        break;
+    }
+    return peak;
+}
+
+static void calc_lufs_native(AVFrame *frame, CalcContext *calc) {
+    bs1770_ctx_t *ctx = calc->bs1770_ctx;
+    size_t i = calc->bs1770_index;
+    int ch = frame->channels;
+    int n = frame->nb_samples;
+    uint8_t **data = frame->extended_data;
+    switch (frame->format) {
+    case AV_SAMPLE_FMT_S16:
+        bs1770_ctx_add_samples_i_i16(ctx, i, frame->sample_rate, ch, (bs1770_i16_t *)data[0], n);
+        break;
+    case AV_SAMPLE_FMT_S16P:
+        bs1770_ctx_add_samples_p_i16(ctx, i, frame->sample_rate, ch, (bs1770_i16_t **)data, n);
+        break;
+    case AV_SAMPLE_FMT_S32:
+        bs1770_ctx_add_samples_i_i32(ctx, i, frame->sample_rate, ch, (bs1770_i32_t *)data[0], n);
+        break;
+    case AV_SAMPLE_FMT_S32P:
+        bs1770_ctx_add_samples_p_i32(ctx, i, frame->sample_rate, ch, (bs1770_i32_t **)data, n);
+        break;
+    case AV_SAMPLE_FMT_FLT:
+        bs1770_ctx_add_samples_i_f32(ctx, i, frame->sample_rate, ch, (bs1770_f32_t *)data[0], n);
+        break;
+    case AV_SAMPLE_FMT_FLTP:
+        bs1770_ctx_add_samples_p_f32(ctx, i, frame->sample_rate, ch, (bs1770_f32_t **)data, n);
+        break;
+    case AV_SAMPLE_FMT_DBL:
+        bs1770_ctx_add_samples_i_f64(ctx, i, frame->sample_rate, ch, (bs1770_f64_t *)data[0], n);
+        break;
+    default:
+        bs1770_ctx_add_samples_p_f64(ctx, i, frame->sample_rate, ch, (bs1770_f64_t **)data, n);
+        break;
+    }
+    calc->nb_samples += n;
+}
+
+static void calc_peak_native(AVFrame *frame, OutputContext *out, enum AVSampleFormat sample_fmt, CalcContext *calc) {
+    TruePeakContext *truepeak = &calc->peak;
+    double peak = 0.0;
+    int i;
+    for (i = 0; i < frame->channels; i++)
+        peak = FFMAX(peak, native_peak_max(frame, i));
+
+    if (peak > truepeak->tplimit) {
+        /* true peak processing needs the converted samples after all */
+        output_samples(frame, out, 0, sample_fmt);
+        calc_peak(out->buffers, sample_fmt, out->buffer_pos, out->tgt_sample_rate, calc, calc->next);
+        out->buffer_pos = 0;
+        return;
     }
 
-    return min_nb_samples;
+    for (i = 0; i < frame->channels; i++)
+        truepeak->swr_ctx_initialized[i] = 0;
+    truepeak->current_peak = peak;
+    truepeak->peak = FFMAX(peak, truepeak->peak);
+    if (truepeak->peak / 2.0 > truepeak->tplimit)
+        truepeak->tplimit = truepeak->peak / 2.0;
 }
 
-static void print_calc_results(int nb_channel, int track, const char *filename, double lufs, double lra, double peak, int64_t nb_samples, int silent, int json, int last) {
+/*
+ * print_exact_results: the unbinned loudness and LRA of -exact, to the
+ * hundredth of a LU as they are the reference answer.
+ */
+static void print_exact_results(FILE *out, double lufs_exact, double lra_exact, int json) {
     if (json) {
-        if (lra >= 0) {
-            fprintf(stdout, "{\"loudness\": \"%.1f\", \"peak\":\"%.1f\", \"lra\":\"%.1f\", \"duration\":\"%"PRId64"\"}%s\n", lufs, peak, lra, nb_samples, (last?"":","));
-        } else {
-            fprintf(stdout, "{\"loudness\": \"%.1f\", \"peak\":\"%.1f\", \"duration\":\"%"PRId64"\"}%s\n", lufs, peak, nb_samples, (last?"":","));
-        }
+        fprintf(out, ", \"loudness_exact\":\"%.2f\"", lufs_exact);
+        if (lra_exact >= 0)
+            fprintf(out, ", \"lra_exact\":\"%.2f\"", lra_exact);
     } else {
-        if (lra >= 0) {
-            if (silent)
-                fprintf(stdout, "%.1f %.1f %.1f\n", lufs, peak, lra);
-            else
-                fprintf(stdout, "%d channel (track %d) LUFS, Peak and LRA for %s: %.1f %.1f %.1f\n", nb_channel, track, filename, lufs, peak, lra);
-        } else {
-            if (silent)
-                fprintf(stdout, "%.1f %.1f\n", lufs, peak);
-            else
-                fprintf(stdout, "%d channel (track %d) LUFS and Peak for %s: %.1f %.1f\n", nb_channel, track, filename, lufs, peak);
-        }
+        fprintf(out, " %.2f", lufs_exact);
+        if (lra_exact >= 0)
+            fprintf(out, " %.2f", lra_exact);
+    }
+}
+
+/* max_momentary is NAN unless the maxima and PLR are reported, lufs_exact unless -exact */
+static void print_calc_results(FILE *out, int nb_channel, int track, const char *filename, double lufs, double lra, double lufs_exact, double lra_exact, double peak, double max_momentary, double max_shortterm, int64_t nb_samples, int silent, int json, int last) {
+    int max = !isnan(max_momentary);
+    int exact = !isnan(lufs_exact);
+    if (json) {
+        fprintf(out, "{\"loudness\": \"%.1f\", \"peak\":\"%.1f\"", lufs, peak);
+        if (lra >= 0)
+            fprintf(out, ", \"lra\":\"%.1f\"", lra);
+        if (max)
+            fprintf(out, ", \"momentary_max\":\"%.1f\", \"shortterm_max\":\"%.1f\", \"plr\":\"%.1f\"", max_momentary, max_shortterm, peak - lufs);
+        if (exact)
+            print_exact_results(out, lufs_exact, lra >= 0 ? lra_exact : -1, json);
+        fprintf(out, ", \"duration\":\"%"PRId64"\"}%s\n", nb_samples, (last?"":","));
+    } else {
+        if (!silent)
+            fprintf(out, "%d channel (track %d) %s%s for %s: ", nb_channel, track,
+                    max ? (lra >= 0 ? "LUFS, Peak, LRA, max momentary, max short-term and PLR" : "LUFS, Peak, max momentary, max short-term and PLR")
+                        : (lra >= 0 ? "LUFS, Peak and LRA" : "LUFS and Peak"),
+                    !exact ? "" : lra >= 0 ? ", exact LUFS and LRA" : ", exact LUFS",
+                    filename);
+        fprintf(out, "%.1f %.1f", lufs, peak);
+        if (lra >= 0)
+            fprintf(out, " %.1f", lra);
+        if (max)
+            fprintf(out, " %.1f %.1f %.1f", max_momentary, max_shortterm, peak - lufs);
+        if (exact)
+            print_exact_results(out, lufs_exact, lra >= 0 ? lra_exact : -1, json);
+        fprintf(out, "\n");
     }
 }
 
 static void print_results(const char *filename, LufscalcConfig *conf, CalcContext *calc) {
     int i;
     if (conf->json)
-        printf("%s", "[\n");
+        fprintf(conf->out, "%s", "[\n");
     for (i=0; calc; calc = calc->next, i++) {
-        print_calc_results(calc->nb_channels, i, filename,
-                           calc->lufs, calc->lra,
+        print_calc_results(conf->out, calc->nb_channels, i, filename,
+                           calc->lufs, calc->lra, calc->lufs_exact, calc->lra_exact,
                            20*log10(FFMAX(0.00001, calc->peak.peak)),
-                           calc->nb_samples,
+                           calc->max_momentary, calc->max_shortterm,
+                           av_rescale(calc->nb_samples, SAMPLE_RATE, calc->sample_rate),
                            conf->silent, conf->json, !calc->next);
     }
     if (conf->json)
-        printf("%s", "]\n");
+        fprintf(conf->out, "%s", "]\n");
+}
+
+static void *bs1770_av_alloc(void *data, size_t size) {
+    return av_malloc(size);
+}
+
+static void bs1770_av_release(void *data, void *p) {
+    av_free(p);
+}
+
+static const bs1770_allocator_t bs1770_av_allocator = {
+    .alloc   = bs1770_av_alloc,
+    .release = bs1770_av_release,
+};
+
+static void init_bs1770_ps(LufscalcConfig *conf, bs1770_ps_t *lufs, bs1770_ps_t *lra) {
+    *lufs = *bs1770_lufs_ps_default();
+    *lra = *bs1770_lra_ps_default();
+
+    if (conf->exact) {
+        lufs->flags |= BS1770_PS_EXACT;
+        lra->flags |= BS1770_PS_EXACT;
+    }
+}
+
+static bs1770_ctx_t *open_bs1770_ctx(LufscalcConfig *conf, size_t nb_tracks) {
+    bs1770_ps_t lufs, lra;
+
+    init_bs1770_ps(conf, &lufs, &lra);
+    return bs1770_ctx_open(nb_tracks, &lufs, conf->lra ? &lra : NULL);
+}
+
+/*
+ * Contexts taken from a pool kept across the input files while they have
+ * the same number of tracks, given back with bs1770_pool_put().  Not for
+ * the segment threads, which open their own.
+ */
+static bs1770_ctx_t *get_bs1770_ctx(LufscalcConfig *conf, size_t nb_tracks) {
+    bs1770_ps_t lufs, lra;
+
+    if (conf->pool && conf->pool_tracks != nb_tracks) {
+        bs1770_pool_close(conf->pool);
+        conf->pool = NULL;
+    }
+    if (!conf->pool) {
+        init_bs1770_ps(conf, &lufs, &lra);
+        if (!(conf->pool = bs1770_pool_open(nb_tracks, &lufs, conf->lra ? &lra : NULL, CH_MAX)))
+            return NULL;
+        conf->pool_tracks = nb_tracks;
+    }
+    return bs1770_pool_get(conf->pool);
+}
+
+/*
+ * Histogram files: the serialized histograms of one track after another,
+ * as written by -histfile and added up by -merge.
+ */
+static void open_histograms(LufscalcConfig *conf) {
+    if (!conf->histfp && !(conf->histfp = fopen(conf->histfile, "wb")))
+        panic("failed to create histogram file");
+}
+
+static void write_histograms(LufscalcConfig *conf, CalcContext *calc) {
+    size_t size;
+    uint8_t *buf;
+
+    open_histograms(conf);
+
+    for (; calc; calc = calc->next) {
+        size = bs1770_ctx_track_write(calc->bs1770_ctx, calc->bs1770_index, NULL, 0);
+        if (!(buf = av_malloc(size)))
+            panic("malloc error");
+        bs1770_ctx_track_write(calc->bs1770_ctx, calc->bs1770_index, buf, size);
+        if (fwrite(buf, 1, size, conf->histfp) != size)
+            panic("failed to write histogram file");
+        av_free(buf);
+    }
+}
+
+static uint8_t *read_file(const char *filename, size_t *size) {
+    FILE *f = fopen(filename, "rb");
+    uint8_t *buf = NULL;
+    size_t n;
+
+    *size = 0;
+    if (!f)
+        return NULL;
+    do {
+        if (!(buf = av_realloc(buf, *size + BUFSIZE)))
+            panic("malloc error");
+        *size += n = fread(buf + *size, 1, BUFSIZE, f);
+    } while (n == BUFSIZE);
+    if (ferror(f))
+        panic("failed to read %s", filename);
+    fclose(f);
+    return buf;
+}
+
+static int merge_file(const char *filename, bs1770_ctx_t *ctx) {
+    uint8_t *buf;
+    size_t size, n, pos;
+    int nb_tracks = 0;
+
+    if (!(buf = read_file(filename, &size)))
+        panic("failed to open histogram file %s", filename);
+
+    for (pos = 0; pos < size; pos += n, nb_tracks++)
+        if (!(n = bs1770_ctx_album_read(ctx, buf + pos, size - pos)))
+            panic("invalid histogram file %s", filename);
+
+    av_free(buf);
+    return nb_tracks;
+}
+
+static void print_merge_results(LufscalcConfig *conf, bs1770_ctx_t *ctx, int nb_tracks) {
+    double lufs = bs1770_ctx_album_lufs_r128(ctx);
+    double lra = conf->lra ? bs1770_ctx_album_lra_default(ctx) : -1;
+    double lufs_exact = bs1770_ctx_album_lufs_exact(ctx);
+    double lra_exact = conf->lra ? bs1770_ctx_album_lra_exact(ctx) : -1;
+    int exact = !isnan(lufs_exact);
+
+    if (conf->json) {
+        fprintf(conf->out, "{\"loudness\": \"%.1f\"", lufs);
+        if (lra >= 0)
+            fprintf(conf->out, ", \"lra\":\"%.1f\"", lra);
+        if (exact)
+            print_exact_results(conf->out, lufs_exact, lra_exact, conf->json);
+        fprintf(conf->out, ", \"tracks\":\"%d\"}\n", nb_tracks);
+    } else {
+        if (!conf->silent)
+            fprintf(conf->out, "Album %s%s of %d tracks: ", lra >= 0 ? "LUFS and LRA" : "LUFS",
+                    !exact ? "" : lra >= 0 ? ", exact LUFS and LRA" : ", exact LUFS", nb_tracks);
+        fprintf(conf->out, "%.1f", lufs);
+        if (lra >= 0)
+            fprintf(conf->out, " %.1f", lra);
+        if (exact)
+            print_exact_results(conf->out, lufs_exact, lra_exact, conf->json);
+        fprintf(conf->out, "\n");
+    }
 }
 
+/*
+ * Loudness series: one line "file,track,time,momentary,shortterm" per hop
+ * of the momentary loudness, or with -seriesbin a 16 byte little endian
+ * record of uint16 file, uint16 track, uint32 time in ms and the momentary
+ * and short-term loudness as floats.  Files and tracks count from 0 and
+ * digital silence is -inf.
+ */
+static void write_series(void *data, double t, double momentary, double shortterm) {
+    CalcContext *calc = data;
+    LufscalcConfig *conf = calc->conf;
+    uint8_t rec[16];
+
+    if (conf->seriesbin) {
+        AV_WL16(rec, conf->file_index);
+        AV_WL16(rec + 2, calc->track);
+        AV_WL32(rec + 4, llrint(t * 1000));
+        AV_WL32(rec + 8, av_float2int(momentary));
+        AV_WL32(rec + 12, av_float2int(shortterm));
+        if (fwrite(rec, 1, sizeof(rec), conf->seriesfp) != sizeof(rec))
+            panic("failed to write series file");
+    } else {
+        fprintf(conf->seriesfp, "%d,%d,%.1f,%.2f,%.2f\n", conf->file_index, calc->track, t, momentary, shortterm);
+    }
+}
+
+static void open_series(LufscalcConfig *conf) {
+    if (conf->seriesfp)
+        return;
+    if (!(conf->seriesfp = fopen(conf->seriesfile, conf->seriesbin ? "wb" : "w")))
+        panic("failed to create series file");
+    if (!conf->seriesbin)
+        fprintf(conf->seriesfp, "file,track,time,momentary,shortterm\n");
+}
+
+/*
+ * Checkpoints: the state of the measurement of one file, written every
+ * checkpointsec seconds of audio and removed once the file is done.  After
+ * "LUFSCALC", a uint32 version and the uint32 number of tracks come the
+ * int64 time in AV_TIME_BASE and byte position to resume at, the uint32
+ * length and bytes of the file name, the float64 peak and int64 sample
+ * count of each track and for each bs1770 context its uint32 size and
+ * state, all little endian.  It is replaced atomically through FILE.tmp.
+ */
+#define CHECKPOINT_VERSION 1
+
+static void write_checkpoint(LufscalcConfig *conf, const char *filename, CalcContext *rootcalc, int nb_calcs, int64_t time, int64_t pos) {
+    CalcContext *calc;
+    size_t len = strlen(filename), size = 36 + len + nb_calcs * 16, n;
+    uint8_t *buf, *p;
+    char *tmpname;
+    FILE *f;
+
+    for (calc = rootcalc; calc; calc = calc->next)
+        if (!calc->bs1770_index)
+            size += 4 + bs1770_ctx_state_write(calc->bs1770_ctx, NULL, 0);
+    if (!(p = buf = av_malloc(size)))
+        panic("malloc error");
+    memcpy(p, "LUFSCALC", 8);
+    AV_WL32(p + 8, CHECKPOINT_VERSION);
+    AV_WL32(p + 12, nb_calcs);
+    AV_WL64(p + 16, time);
+    AV_WL64(p + 24, pos);
+    AV_WL32(p + 32, len);
+    memcpy(p + 36, filename, len);
+    p += 36 + len;
+    for (calc = rootcalc; calc; calc = calc->next, p += 16) {
+        AV_WL64(p, av_double2int(calc->peak.peak));
+        AV_WL64(p + 8, calc->nb_samples);
+    }
+    for (calc = rootcalc; calc; calc = calc->next) {
+        if (calc->bs1770_index)
+            continue;
+        n = bs1770_ctx_state_write(calc->bs1770_ctx, p + 4, size - (p + 4 - buf));
+        AV_WL32(p, n);
+        p += 4 + n;
+    }
+
+    if (!(tmpname = av_asprintf("%s.tmp", conf->checkpoint)))
+        panic("malloc error");
+    if (!(f = fopen(tmpname, "wb")))
+        panic("failed to create checkpoint file");
+    if (fwrite(buf, 1, size, f) != size || fclose(f))
+        panic("failed to write checkpoint file");
+    if (rename(tmpname, conf->checkpoint))
+        panic("failed to replace checkpoint file");
+    av_free(tmpname);
+    av_free(buf);
+}
+
+/* returns 1 and the place to resume at if the checkpoint is one of filename */
+static int read_checkpoint(LufscalcConfig *conf, const char *filename, CalcContext *rootcalc, int nb_calcs, int64_t *time, int64_t *pos) {
+    CalcContext *calc;
+    size_t size, len, n;
+    uint8_t *buf, *p, *end;
+    int ret = 0;
+
+    if (!(buf = read_file(conf->checkpoint, &size)))
+        return 0;
+    end = buf + size;
+    if (size < 36 || memcmp(buf, "LUFSCALC", 8) || AV_RL32(buf + 8) != CHECKPOINT_VERSION) {
+        av_log(conf, AV_LOG_WARNING, "Ignoring invalid checkpoint file %s.\n", conf->checkpoint);
+        goto done;
+    }
+    len = AV_RL32(buf + 32);
+    if (len != strlen(filename) || size < 36 + len || memcmp(buf + 36, filename, len))
+        goto done;
+    if (AV_RL32(buf + 12) != nb_calcs || size - 36 - len < nb_calcs * 16) {
+        av_log(conf, AV_LOG_WARNING, "Ignoring checkpoint of %s with other tracks.\n", filename);
+        goto done;
+    }
+    *time = AV_RL64(buf + 16);
+    *pos = AV_RL64(buf + 24);
+    p = buf + 36 + len;
+    for (calc = rootcalc; calc; calc = calc->next, p += 16) {
+        calc->peak.peak = av_int2double(AV_RL64(p));
+        calc->nb_samples = AV_RL64(p + 8);
+    }
+    for (calc = rootcalc; calc; calc = calc->next) {
+        if (calc->bs1770_index)
+            continue;
+        if (end - p < 4 || (n = AV_RL32(p)) > end - p - 4 || bs1770_ctx_state_read(calc->bs1770_ctx, p + 4, n) != n)
+            panic("invalid checkpoint file %s", conf->checkpoint);
+        p += 4 + n;
+    }
+    ret = 1;
+done:
+    av_free(buf);
+    return ret;
+}
+
+/*
+ * Segments: a long file is cut into pieces decoded by threads of their own.
+ * Each seeks PREROLL ahead of its start so the decoder and the filters
+ * have settled, only counts blocks ending within (start,end] and the peak
+ * of the frames overlapping it, and keeps decoding POSTROLL past its end to
+ * drain the buffers.  The cuts fall on the SEGMENT_HOP grid from the origin
+ * of the file, and each segment drops the samples of its first frame ahead
+ * of the grid, so its blocks are those of decoding the file in one pass to
+ * within the rounding of the frame timestamps, a sample.  Times are in
+ * AV_TIME_BASE, the first segment has no from and the last no stop.
+ */
+typedef struct Segment {
+    const char *filename;
+    LufscalcConfig *conf;
+    int64_t origin;
+    int64_t from;
+    int64_t start;
+    int64_t end;
+    int64_t stop;
+    pthread_t thread;
+    int ret;
+    CalcContext *rootcalc;
+    CalcContext *calc;
+} Segment;
+
 /*
  * Audio decoding.
  */
-static int lufscalc_file(const char *filename, LufscalcConfig *conf)
+static int lufscalc_file(const char *filename, LufscalcConfig *conf, Segment *seg)
 {
     AVCodec *codec[MAX_STREAMS];
     AVCodecContext *c[MAX_STREAMS];
     AVFormatContext *ic = NULL;
     OutputContext out[MAX_STREAMS];
-    int err, i, j, ret = 0;
+    int err, i, j, k, ret = 0;
     AVPacket *pkt;
     AVFrame *decoded_frame;
     int eof = 0;
+    int done = 0, windowed = 0, peak = 1;
+    int checkpoint, nb_calcs;
+    int64_t ts, resume = INT64_MIN, resume_pos = -1;
+    int64_t checkpoint_time = AV_NOPTS_VALUE, checkpoint_pos = -1, next_checkpoint;
     char codecname[256];
     int nb_audio_streams = 0;
     int audio_streams[MAX_STREAMS];
@@ -392,17 +954,24 @@ static int lufscalc_file(const char *filename, LufscalcConfig *conf)
     int64_t starttime, starttime_diff;
     int64_t starttime_nb_decoded_samples = 0;
     int codec_index = 0;
-    int remaining_codec_channels = 0;
+    uint64_t channel_layout;
+    int nb_tracks;
+    double weights[CH_MAX];
+    int nb_weights = 0;
+    int stream_channels[MAX_STREAMS];
+    int stream_layout[MAX_STREAMS];
+    int per_stream_rate = 0;
     FILE *logfile = NULL;
+    enum AVSampleFormat sample_fmt = conf->f32 ? AV_SAMPLE_FMT_FLTP : AV_SAMPLE_FMT_DBLP;
 
     if (conf->logfile)
         logfile = fopen(conf->logfile, "wx");
     else
-        logfile = stdout;
+        logfile = conf->out;
     if (!logfile)
         panic("failed to open or create logfile");
 
-    if (peak_log_limit < 100)
+    if (peak_log_limit < 100 && !seg)
         av_log(conf, AV_LOG_INFO, "Logging peaks above %.1f dBFS peak.\n",  20 * log10(peak_log_limit));
 
     memset(&out, 0, MAX_STREAMS * sizeof(OutputContext));
@@ -411,11 +980,13 @@ static int lufscalc_file(const char *filename, LufscalcConfig *conf)
     if (!(pkt = av_packet_alloc()))
         panic("out of memory allocating the packet");
 
-    if (fabs(conf->tplimit) != 0)
-        av_log(conf, AV_LOG_INFO, "Calculating true peak above %.1f dBFS (%.2f) sample peak.\n", -fabs(conf->tplimit), pow(10, -fabs(conf->tplimit) / 20.0));
-    else
-        av_log(conf, AV_LOG_INFO, "Calculating sample peak.\n");
-    av_log(conf, AV_LOG_INFO, "Starting audio decoding of %s ...\n", filename);
+    if (!seg) {
+        if (fabs(conf->tplimit) != 0)
+            av_log(conf, AV_LOG_INFO, "Calculating true peak above %.1f dBFS (%.2f) sample peak.\n", -fabs(conf->tplimit), pow(10, -fabs(conf->tplimit) / 20.0));
+        else
+            av_log(conf, AV_LOG_INFO, "Calculating sample peak.\n");
+        av_log(conf, AV_LOG_INFO, "Starting audio decoding of %s ...\n", filename);
+    }
     
     err = avformat_open_input(&ic, filename, NULL, NULL);
     if (err < 0)
@@ -428,7 +999,7 @@ static int lufscalc_file(const char *filename, LufscalcConfig *conf)
     if (conf->track_spec) {
         channel_limit = 0;
         for (track_spec_temp = conf->track_spec; *track_spec_temp; track_spec_temp++) {
-            if (*track_spec_temp <= '0' || *track_spec_temp >= '7')
+            if (*track_spec_temp <= '0' || *track_spec_temp > '9')
                 panic("invalid track specification");
             channel_limit += *track_spec_temp - '0';
         }
@@ -440,7 +1011,7 @@ static int lufscalc_file(const char *filename, LufscalcConfig *conf)
                 panic("cannot handle that many audio streams");
             if (ic->streams[i]->codecpar->channels <= 0)
                 panic("channel count is 0");
-            if (sum_channels + ic->streams[i]->codecpar->channels >= CH_MAX)
+            if (sum_channels + ic->streams[i]->codecpar->channels > CH_MAX)
                 panic("cannot handle that many audio channels");
             if ((audio_streams[nb_audio_streams] = av_find_best_stream(ic, AVMEDIA_TYPE_AUDIO, i, -1, codec + nb_audio_streams, 0)) < 0)
                 panic("cannot find valid audio stream");
@@ -455,6 +1026,9 @@ static int lufscalc_file(const char *filename, LufscalcConfig *conf)
     if (nb_audio_streams <= 0)
         panic("audio stream not found");
 
+    if (seg && seg->from != INT64_MIN && avformat_seek_file(ic, -1, INT64_MIN, seg->from, seg->from, 0) < 0)
+        panic("failed to seek to segment");
+
     for (i = 0; i < nb_audio_streams; i++) {
         int stream_index = audio_streams[i];
         c[i] = avcodec_alloc_context3(NULL);
@@ -467,10 +1041,27 @@ static int lufscalc_file(const char *filename, LufscalcConfig *conf)
         av_log(conf, AV_LOG_INFO, "Stream %d: %s\n", stream_index, codecname);
         if (avcodec_open2(c[i], codec[i], NULL) < 0)
             panic("could not open codec");
+
+        if (conf->downmix) {
+            channel_layout = av_get_default_channel_layout(conf->downmix);
+            stream_layout[i] = 1;
+        } else {
+            channel_layout = c[i]->channel_layout;
+            stream_layout[i] = channel_layout && c[i]->channels == av_get_channel_layout_nb_channels(channel_layout);
+            if (!stream_layout[i])
+                channel_layout = av_get_default_channel_layout(c[i]->channels);
+        }
+        for (j = 0; j < av_get_channel_layout_nb_channels(channel_layout) && nb_weights < CH_MAX; j++)
+            weights[nb_weights++] = channel_weight(channel_layout, j);
+        stream_channels[i] = av_get_channel_layout_nb_channels(channel_layout);
+
+        out[i].tgt_sample_rate = (conf->nativerate && c[i]->sample_rate > 0) ? c[i]->sample_rate : SAMPLE_RATE;
+        if (out[i].tgt_sample_rate != out[0].tgt_sample_rate)
+            per_stream_rate = 1;
     }
 
     sum_channels = FFMIN(sum_channels, channel_limit);
-    remaining_codec_channels = 0;
+    nb_weights = 0;
     while (sum_channels) {
         int channels = 0;
         CalcContext *newcalc;
@@ -482,16 +1073,10 @@ static int lufscalc_file(const char *filename, LufscalcConfig *conf)
         } else {
             if (c[codec_index]->channels == 0)
                 panic("track has 0 channels");
-            if (conf->downmix) {
+            if (conf->downmix)
                 channels = conf->downmix;
-            } else {
-                if (remaining_codec_channels == 0)
-                    remaining_codec_channels = c[codec_index]->channels;
-                channels = FFMIN(6, remaining_codec_channels);
-                remaining_codec_channels -= channels;
-                if (!remaining_codec_channels)
-                    codec_index++;
-            }
+            else
+                channels = c[codec_index++]->channels;
         }
         if (sum_channels < channels)
             panic("channel count is not enough for track specification");
@@ -500,6 +1085,19 @@ static int lufscalc_file(const char *filename, LufscalcConfig *conf)
         if (!newcalc)
             panic("cannot alloc calc context");
         newcalc->nb_channels = channels;
+        newcalc->stream = channel_stream(stream_channels, nb_audio_streams, nb_weights);
+        newcalc->sample_rate = out[newcalc->stream].tgt_sample_rate;
+        if (per_stream_rate && channel_stream(stream_channels, nb_audio_streams, nb_weights + channels - 1) != newcalc->stream)
+            panic("track spans audio streams of different sample rates");
+        /* the weights of a layout only hold for a track of the whole stream,
+         * others keep those of the library like an unknown layout */
+        for (j = 0, k = 0; j < newcalc->stream; j++)
+            k += stream_channels[j];
+        if (stream_layout[newcalc->stream] && k == nb_weights && channels == stream_channels[newcalc->stream]) {
+            memcpy(newcalc->weights, weights + nb_weights, channels * sizeof(weights[0]));
+            newcalc->nb_weights = channels;
+        }
+        nb_weights += channels;
         if (!rootcalc)
             calc = rootcalc = newcalc;
         else
@@ -509,13 +1107,53 @@ static int lufscalc_file(const char *filename, LufscalcConfig *conf)
     if (track_spec && *track_spec)
         panic("channel count is not enough for track specification");
 
+    /* tracks of equal width get one shared context to be batched */
+    nb_tracks = 0;
     for (calc = rootcalc; calc; calc = calc->next) {
-        calc->bs1770_ctx = bs1770_ctx_open(1, bs1770_lufs_ps_default(), conf->lra ? bs1770_lra_ps_default() : NULL);
+        if (calc->nb_channels != rootcalc->nb_channels)
+            break;
+        nb_tracks++;
+    }
+    if (calc || nb_tracks * rootcalc->nb_channels > CH_MAX || per_stream_rate)
+        nb_tracks = 1;
+
+    for (i = 0, calc = rootcalc; calc; calc = calc->next, i++) {
+        if (nb_tracks > 1 && i > 0) {
+            calc->bs1770_ctx = rootcalc->bs1770_ctx;
+            calc->bs1770_index = i;
+        } else {
+            calc->bs1770_ctx = seg ? open_bs1770_ctx(conf, nb_tracks) : get_bs1770_ctx(conf, nb_tracks);
+            calc->bs1770_index = 0;
+            if (!calc->bs1770_ctx)
+                panic("failed to initialize bs1770 context");
+            bs1770_ctx_set_mode(calc->bs1770_ctx,
+                                (conf->f32 ? BS1770_MODE_F32 : 0) |
+                                (conf->ftz ? BS1770_MODE_FTZ : 0) |
+                                (conf->lookahead ? BS1770_MODE_LOOKAHEAD : 0));
+        }
         calc->peak.tplimit = pow(10, -fabs(conf->tplimit) / 20.0);
         calc->peak.peak = 0.0;
-        if (!calc->bs1770_ctx)
-            panic("failed to initialize bs1770 context");
+        calc->track = i;
+        calc->conf = conf;
+        if (conf->seriesfile) {
+            open_series(conf);
+            bs1770_ctx_set_series(calc->bs1770_ctx, calc->bs1770_index, write_series, calc);
+        }
+        bs1770_ctx_set_weights(calc->bs1770_ctx, calc->bs1770_index, calc->nb_weights, calc->weights);
     }
+    nb_calcs = i;
+
+    /* one resume time is only well defined for a single audio stream */
+    checkpoint = conf->checkpoint && !seg && nb_audio_streams == 1;
+    if (conf->checkpoint && !checkpoint)
+        av_log(conf, AV_LOG_WARNING, "Checkpoints need a single audio stream.\n");
+    if (checkpoint && read_checkpoint(conf, filename, rootcalc, nb_calcs, &resume, &resume_pos)) {
+        av_log(conf, AV_LOG_INFO, "Resuming at %.1f s from checkpoint.\n", resume / (double)AV_TIME_BASE);
+        if (avformat_seek_file(ic, -1, INT64_MIN, resume - PREROLL, resume - PREROLL, 0) < 0 &&
+            (resume_pos < 0 || avformat_seek_file(ic, -1, INT64_MIN, resume_pos, resume_pos, AVSEEK_FLAG_BYTE) < 0))
+            panic("failed to seek to checkpoint");
+    }
+    next_checkpoint = rootcalc->nb_samples + (int64_t)conf->checkpoint_sec * rootcalc->sample_rate;
 
     starttime = av_gettime();
     while (ret == 0) {
@@ -561,7 +1199,68 @@ static int lufscalc_file(const char *filename, LufscalcConfig *conf)
                         break;
                     }
 
-                    output_samples(decoded_frame, &out[i], conf->downmix);
+                    ts = decoded_frame->best_effort_timestamp;
+                    if (ts != AV_NOPTS_VALUE)
+                        ts = av_rescale_q(ts, ic->streams[audio_streams[i]]->time_base, AV_TIME_BASE_Q);
+                    if (seg) {
+                        if (ts == AV_NOPTS_VALUE)
+                            panic("cannot decode segments without frame timestamps");
+                        if (ts >= seg->stop) {
+                            done = 1;
+                            break;
+                        }
+                        if (ts < seg->from)
+                            continue;
+                        if (!windowed && seg->from != INT64_MIN) {
+                            int64_t first = seg->origin + (ts - seg->origin + SEGMENT_HOP - 1) / SEGMENT_HOP * SEGMENT_HOP;
+                            int skip = av_rescale(first - ts, decoded_frame->sample_rate, AV_TIME_BASE);
+
+                            if (skip >= decoded_frame->nb_samples)
+                                continue;
+                            if (skip > 0) {
+                                if (av_frame_make_writable(decoded_frame) < 0)
+                                    panic("malloc error");
+                                av_samples_copy(decoded_frame->extended_data, decoded_frame->extended_data, 0, skip,
+                                                decoded_frame->nb_samples - skip, decoded_frame->channels, decoded_frame->format);
+                                decoded_frame->nb_samples -= skip;
+                            }
+                            ts = first;
+                        }
+                        if (!windowed) {
+                            /* the blocks of a track are timed from its first sample */
+                            for (calc = rootcalc; calc; calc = calc->next)
+                                bs1770_ctx_track_window(calc->bs1770_ctx, calc->bs1770_index,
+                                                        seg->from == INT64_MIN ? 0.0 : (seg->start - ts) / (double)AV_TIME_BASE,
+                                                        seg->stop == INT64_MAX ? HUGE_VAL : (seg->end - ts) / (double)AV_TIME_BASE);
+                            windowed = 1;
+                        }
+                        /* nor is the peak taken over the warm-up of the decoder and
+                         * the true-peak resampler after the seek, or the post-roll */
+                        peak = (seg->from == INT64_MIN || ts + av_rescale(decoded_frame->nb_samples, AV_TIME_BASE, decoded_frame->sample_rate) > seg->start) &&
+                               (seg->stop == INT64_MAX || ts < seg->end);
+                    }
+                    if (resume != INT64_MIN) {
+                        if (ts == AV_NOPTS_VALUE)
+                            panic("cannot resume without frame timestamps");
+                        if (ts < resume)
+                            continue;
+                        resume = INT64_MIN;
+                    }
+                    if (checkpoint) {
+                        checkpoint_time = ts == AV_NOPTS_VALUE ? AV_NOPTS_VALUE : ts + av_rescale(decoded_frame->nb_samples, AV_TIME_BASE, decoded_frame->sample_rate);
+                        checkpoint_pos = pkt->pos;
+                    }
+
+                    if (native_frame(decoded_frame, &out[i], rootcalc, nb_audio_streams, conf->downmix)) {
+                        int64_t pos = rootcalc->nb_samples;
+                        calc_lufs_native(decoded_frame, rootcalc);
+                        if (peak) {
+                            calc_peak_native(decoded_frame, &out[i], sample_fmt, rootcalc);
+                            log_peaks(rootcalc, NULL, 0, pos, out[i].tgt_sample_rate, peak_log_limit, logfile, conf->crlf);
+                        }
+                    } else {
+                        output_samples(decoded_frame, &out[i], conf->downmix, sample_fmt);
+                    }
                 }
 
             }
@@ -569,7 +1268,22 @@ static int lufscalc_file(const char *filename, LufscalcConfig *conf)
 
         av_packet_unref(pkt);
 
-        nb_decoded_samples += calc_available_audio_samples(rootcalc, out, nb_audio_streams, nb_decoded_samples, peak_log_limit, logfile, conf->crlf);
+        if (per_stream_rate)
+            calc_available_stream_samples(rootcalc, out, nb_audio_streams, sample_fmt, peak, peak_log_limit, logfile, conf->crlf);
+        else
+            calc_available_audio_samples(rootcalc, NULL, 0, out, nb_audio_streams, sample_fmt, peak, peak_log_limit, logfile, conf->crlf);
+        nb_decoded_samples = av_rescale(rootcalc->nb_samples, SAMPLE_RATE, rootcalc->sample_rate);
+
+        /* only once the buffered samples up to the end of the last frame are measured */
+        if (checkpoint && !out[0].buffer_pos && checkpoint_time != AV_NOPTS_VALUE && rootcalc->nb_samples >= next_checkpoint) {
+            write_checkpoint(conf, filename, rootcalc, nb_calcs, checkpoint_time, checkpoint_pos);
+            next_checkpoint = rootcalc->nb_samples + (int64_t)conf->checkpoint_sec * rootcalc->sample_rate;
+        }
+
+        if (done) {
+            eof = 1;
+            break;
+        }
 
         if (conf->speedlimit || conf->status) {
             starttime_diff = av_gettime() - starttime;
@@ -592,21 +1306,44 @@ static int lufscalc_file(const char *filename, LufscalcConfig *conf)
         for (i=0; i<nb_audio_streams; i++)
             if (out[i].buffer_pos)
                 av_log(conf, AV_LOG_WARNING, "Buffer #%d is not empty after eof.\n", i);
-        av_log(conf, AV_LOG_INFO, "Decoding finished.\n");
+        if (!seg)
+            av_log(conf, AV_LOG_INFO, "Decoding finished.\n");
+        if (checkpoint)
+            unlink(conf->checkpoint);
+
+        if (conf->histfile)
+            write_histograms(conf, rootcalc);
 
         for (calc = rootcalc; calc; calc = calc->next) {
-            calc->lufs = bs1770_ctx_track_lufs_r128(calc->bs1770_ctx,0);
-            calc->lra = conf->lra ? bs1770_ctx_track_lra_default(calc->bs1770_ctx,0) : -1;
+            calc->max_momentary = conf->plr ? bs1770_ctx_track_max_momentary(calc->bs1770_ctx, calc->bs1770_index) : NAN;
+            calc->max_shortterm = conf->plr ? bs1770_ctx_track_max_shortterm(calc->bs1770_ctx, calc->bs1770_index) : NAN;
         }
+        if (seg) {
+            /* the histograms are merged with those of the other segments */
+            for (calc = rootcalc; calc; calc = calc->next) {
+                calc->hist_size = bs1770_ctx_track_write(calc->bs1770_ctx, calc->bs1770_index, NULL, 0);
+                if (!(calc->hist = av_malloc(calc->hist_size)))
+                    panic("malloc error");
+                bs1770_ctx_track_write(calc->bs1770_ctx, calc->bs1770_index, calc->hist, calc->hist_size);
+            }
+            seg->rootcalc = rootcalc;
+        } else {
+            for (calc = rootcalc; calc; calc = calc->next) {
+                calc->lufs = bs1770_ctx_track_lufs_r128(calc->bs1770_ctx, calc->bs1770_index);
+                calc->lra = conf->lra ? bs1770_ctx_track_lra_default(calc->bs1770_ctx, calc->bs1770_index) : -1;
+                calc->lufs_exact = bs1770_ctx_track_lufs_exact(calc->bs1770_ctx, calc->bs1770_index);
+                calc->lra_exact = bs1770_ctx_track_lra_exact(calc->bs1770_ctx, calc->bs1770_index);
+            }
 
-        print_results(filename, conf, rootcalc);
+            print_results(filename, conf, rootcalc);
+        }
     } else {
         char errbuf[256] = "Unknown error";
         av_strerror(ret, errbuf, sizeof(errbuf));
         av_log(conf, AV_LOG_ERROR, "Decoding failed. %s.\n", errbuf);
     }
 
-    if (logfile != stdout)
+    if (logfile != conf->out)
         fclose(logfile);
 
     for (i=0; i<nb_audio_streams; i++)
@@ -616,7 +1353,10 @@ static int lufscalc_file(const char *filename, LufscalcConfig *conf)
     av_packet_free(&pkt);
 
     for (calc = rootcalc; calc; calc = calc->next) {
-        bs1770_ctx_close(calc->bs1770_ctx);
+        if (!calc->bs1770_index && seg)
+            bs1770_ctx_close(calc->bs1770_ctx);
+        else if (!calc->bs1770_index)
+            bs1770_pool_put(conf->pool, calc->bs1770_ctx);
         av_free(calc->peak.buffers[0]);
         for (j=0; j<calc->nb_channels; j++)
             swr_free(&calc->peak.swr_ctx[j]);
@@ -630,17 +1370,333 @@ static int lufscalc_file(const char *filename, LufscalcConfig *conf)
     return eof?0:ret;
 }
 
+static void *segment_thread(void *arg) {
+    Segment *seg = arg;
+    seg->ret = lufscalc_file(seg->filename, seg->conf, seg);
+    return NULL;
+}
+
+/*
+ * Decode a file in conf->segments parallel segments of at least SEGMENT_MIN
+ * and merge their histograms, or fall back to decoding it in one go if it
+ * is too short, not seekable or has more than one audio stream.
+ */
+static int lufscalc_segments(const char *filename, LufscalcConfig *conf)
+{
+    AVFormatContext *ic = NULL;
+    Segment *seg;
+    CalcContext *calc, *next;
+    bs1770_ctx_t *album;
+    int64_t start, duration;
+    int i, nb_segments, nb_audio_streams = 0, ret = 0;
+
+    if (avformat_open_input(&ic, filename, NULL, NULL) < 0)
+        panic("failed to open file");
+    if (avformat_find_stream_info(ic, NULL) < 0)
+        panic("could not find codec parameters");
+    for (i = 0; i < ic->nb_streams; i++)
+        if (ic->streams[i]->codecpar->codec_type == AVMEDIA_TYPE_AUDIO)
+            nb_audio_streams++;
+    start = ic->start_time != AV_NOPTS_VALUE ? ic->start_time : 0;
+    duration = ic->duration;
+    nb_segments = duration > 0 ? FFMIN(conf->segments, duration / SEGMENT_MIN) : 1;
+    if (!ic->pb || !(ic->pb->seekable & AVIO_SEEKABLE_NORMAL) || FFMIN(nb_audio_streams, conf->track_limit) != 1)
+        nb_segments = 1;
+    avformat_close_input(&ic);
+
+    if (nb_segments < 2)
+        return lufscalc_file(filename, conf, NULL);
+
+    av_log(conf, AV_LOG_INFO, "Starting audio decoding of %s in %d segments ...\n", filename, nb_segments);
+    if (!(seg = av_calloc(nb_segments, sizeof(*seg))))
+        panic("malloc error");
+    for (i = 0; i < nb_segments; i++) {
+        seg[i].filename = filename;
+        seg[i].conf = conf;
+        seg[i].origin = start;
+        seg[i].start = start + av_rescale(duration, i, (int64_t)nb_segments * SEGMENT_HOP) * SEGMENT_HOP;
+        seg[i].end = start + av_rescale(duration, i + 1, (int64_t)nb_segments * SEGMENT_HOP) * SEGMENT_HOP;
+        seg[i].from = i ? seg[i].start - PREROLL : INT64_MIN;
+        seg[i].stop = i < nb_segments - 1 ? seg[i].end + POSTROLL : INT64_MAX;
+        if (pthread_create(&seg[i].thread, NULL, segment_thread, &seg[i]))
+            panic("failed to create thread");
+    }
+    for (i = 0; i < nb_segments; i++) {
+        pthread_join(seg[i].thread, NULL);
+        if (seg[i].ret && !ret)
+            ret = seg[i].ret;
+        seg[i].calc = seg[i].rootcalc;
+    }
+
+    if (!ret) {
+        /* every segment has the same tracks, add them up one at a time */
+        for (calc = seg[0].rootcalc; calc; calc = calc->next) {
+            if (!(album = get_bs1770_ctx(conf, 1)))
+                panic("failed to initialize bs1770 context");
+            for (i = 0; i < nb_segments; i++) {
+                if (!seg[i].calc || !bs1770_ctx_album_read(album, seg[i].calc->hist, seg[i].calc->hist_size))
+                    panic("failed to merge segments");
+                calc->peak.peak = FFMAX(calc->peak.peak, seg[i].calc->peak.peak);
+                calc->max_momentary = FFMAX(calc->max_momentary, seg[i].calc->max_momentary);
+                calc->max_shortterm = FFMAX(calc->max_shortterm, seg[i].calc->max_shortterm);
+                seg[i].calc = seg[i].calc->next;
+            }
+            calc->lufs = bs1770_ctx_album_lufs_r128(album);
+            calc->lra = conf->lra ? bs1770_ctx_album_lra_default(album) : -1;
+            calc->lufs_exact = bs1770_ctx_album_lufs_exact(album);
+            calc->lra_exact = bs1770_ctx_album_lra_exact(album);
+            calc->nb_samples = av_rescale(duration, calc->sample_rate, AV_TIME_BASE);
+            bs1770_pool_put(conf->pool, album);
+        }
+        print_results(filename, conf, seg[0].rootcalc);
+    }
+
+    for (i = 0; i < nb_segments; i++) {
+        for (calc = seg[i].rootcalc; calc; calc = next) {
+            next = calc->next;
+            av_free(calc->hist);
+            av_free(calc);
+        }
+    }
+    av_free(seg);
+    return ret;
+}
+
+/*
+ * Jobs: with -jobs the input files are measured by that many threads at a
+ * time.  The container durations are probed first, then each thread takes
+ * the longest file left, unknown durations counting as longest, so a batch
+ * does not end with one long file decoding alone.  Only local files are
+ * probed, a pipe or stream could not be opened a second time to measure it,
+ * so their durations are unknown.  Each file writes its
+ * results, peak log and histograms to memory, passed on in the order of the
+ * arguments as soon as all the files before are done.  After a failed file
+ * the later ones are skipped, as without jobs.
+ */
+typedef struct Job {
+    const char *filename;
+    int index;
+    int64_t duration;
+    int done;
+    int ret;
+    char *out;
+    size_t out_size;
+    char *hist;
+    size_t hist_size;
+} Job;
+
+typedef struct JobQueue {
+    LufscalcConfig *conf;
+    Job *jobs;
+    Job **order;
+    int nb_jobs;
+    int next;
+    int probe;
+    int stop;
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+} JobQueue;
+
+typedef struct Worker {
+    JobQueue *queue;
+    int index;
+    pthread_t thread;
+} Worker;
+
+/* pins the calling thread to the index-th cpu it may run on, its memory
+ * then being taken from that cpu's node first */
+static void pin_thread(int index) {
+#ifdef __linux__
+    cpu_set_t cpus, set;
+    int cpu;
+
+    if (sched_getaffinity(0, sizeof(cpus), &cpus) || !CPU_COUNT(&cpus))
+        return;
+    index %= CPU_COUNT(&cpus);
+    for (cpu = 0; cpu < CPU_SETSIZE; cpu++) {
+        if (CPU_ISSET(cpu, &cpus) && !index--) {
+            CPU_ZERO(&set);
+            CPU_SET(cpu, &set);
+            pthread_setaffinity_np(pthread_self(), sizeof(set), &set);
+            break;
+        }
+    }
+#endif
+}
+
+static int64_t probe_duration(const char *filename) {
+    const char *proto = avio_find_protocol_name(filename);
+    AVFormatContext *ic = NULL;
+    int64_t duration = -1;
+
+    if (!strcmp(filename, "-") || !proto || strcmp(proto, "file"))
+        return -1;
+    if (avformat_open_input(&ic, filename, NULL, NULL) < 0)
+        return -1;
+    if (ic->duration > 0)
+        duration = ic->duration;
+    avformat_close_input(&ic);
+    return duration;
+}
+
+static int compare_jobs(const void *a, const void *b) {
+    const Job *x = *(const Job * const *)a, *y = *(const Job * const *)b;
+    int64_t dx = x->duration < 0 ? INT64_MAX : x->duration;
+    int64_t dy = y->duration < 0 ? INT64_MAX : y->duration;
+
+    if (dx != dy)
+        return dx < dy ? 1 : -1;
+    return x->index - y->index;
+}
+
+static void *job_thread(void *arg) {
+    Worker *worker = arg;
+    JobQueue *q = worker->queue;
+    LufscalcConfig conf = *q->conf;
+    Job *job;
+    int ret;
+
+    if (conf.pin)
+        pin_thread(worker->index);
+    conf.pool = NULL;
+    conf.histfp = NULL;
+    for (;;) {
+        pthread_mutex_lock(&q->lock);
+        while (q->next < q->nb_jobs && q->order[q->next]->index > q->stop)
+            q->next++;
+        job = q->next < q->nb_jobs ? q->order[q->next++] : NULL;
+        pthread_mutex_unlock(&q->lock);
+        if (!job)
+            break;
+        if (q->probe) {
+            job->duration = probe_duration(job->filename);
+            continue;
+        }
+
+        conf.file_index = job->index;
+        if (!(conf.out = open_memstream(&job->out, &job->out_size)))
+            panic("failed to buffer the results");
+        if (conf.histfile && !(conf.histfp = open_memstream(&job->hist, &job->hist_size)))
+            panic("failed to buffer the histograms");
+        ret = lufscalc_file(job->filename, &conf, NULL);
+        fclose(conf.out);
+        if (conf.histfp)
+            fclose(conf.histfp);
+        conf.histfp = NULL;
+
+        pthread_mutex_lock(&q->lock);
+        job->ret = ret;
+        job->done = 1;
+        if (ret && job->index < q->stop)
+            q->stop = job->index;
+        pthread_cond_broadcast(&q->cond);
+        pthread_mutex_unlock(&q->lock);
+    }
+    if (conf.pool)
+        bs1770_pool_close(conf.pool);
+    return NULL;
+}
+
+static void start_jobs(JobQueue *q, Worker *workers, int nb_workers) {
+    int i;
+
+    q->next = 0;
+    for (i = 0; i < nb_workers; i++) {
+        workers[i].queue = q;
+        workers[i].index = i;
+        if (pthread_create(&workers[i].thread, NULL, job_thread, &workers[i]))
+            panic("failed to start job");
+    }
+}
+
+static void join_jobs(Worker *workers, int nb_workers) {
+    int i;
+
+    for (i = 0; i < nb_workers; i++)
+        pthread_join(workers[i].thread, NULL);
+}
+
+static int lufscalc_jobs(const char **filenames, int nb_files, LufscalcConfig *conf)
+{
+    JobQueue q = { 0 };
+    Worker *workers;
+    int i, ret = 0, nb_workers = FFMIN(conf->jobs, nb_files);
+
+    q.conf = conf;
+    q.nb_jobs = nb_files;
+    q.stop = INT_MAX;
+    if (!(q.jobs = av_calloc(nb_files, sizeof(*q.jobs))) ||
+        !(q.order = av_calloc(nb_files, sizeof(*q.order))) ||
+        !(workers = av_calloc(nb_workers, sizeof(*workers))))
+        panic("malloc error");
+    for (i = 0; i < nb_files; i++) {
+        q.jobs[i].filename = filenames[i];
+        q.jobs[i].index = i;
+        q.order[i] = &q.jobs[i];
+    }
+    pthread_mutex_init(&q.lock, NULL);
+    pthread_cond_init(&q.cond, NULL);
+
+    q.probe = 1;
+    start_jobs(&q, workers, nb_workers);
+    join_jobs(workers, nb_workers);
+    qsort(q.order, nb_files, sizeof(*q.order), compare_jobs);
+    av_log(conf, AV_LOG_INFO, "Measuring %d files in %d jobs ...\n", nb_files, nb_workers);
+
+    q.probe = 0;
+    start_jobs(&q, workers, nb_workers);
+    for (i = 0; i < nb_files; i++) {
+        Job *job = &q.jobs[i];
+
+        pthread_mutex_lock(&q.lock);
+        while (!job->done)
+            pthread_cond_wait(&q.cond, &q.lock);
+        pthread_mutex_unlock(&q.lock);
+
+        if (job->out_size && fwrite(job->out, 1, job->out_size, conf->out) != job->out_size)
+            panic("failed to write the results");
+        if (job->hist_size) {
+            open_histograms(conf);
+            if (fwrite(job->hist, 1, job->hist_size, conf->histfp) != job->hist_size)
+                panic("failed to write histogram file");
+        }
+        free(job->out);
+        free(job->hist);
+        job->out = job->hist = NULL;
+        if ((ret = job->ret))
+            break;
+    }
+    join_jobs(workers, nb_workers);
+
+    for (i = 0; i < nb_files; i++) {
+        free(q.jobs[i].out);
+        free(q.jobs[i].hist);
+    }
+    pthread_cond_destroy(&q.cond);
+    pthread_mutex_destroy(&q.lock);
+    av_free(workers);
+    av_free(q.order);
+    av_free(q.jobs);
+    return ret;
+}
+
 int main(int argc, char **argv)
 {
     int ret = 0;
     LufscalcConfig conf;
     int filecount = 0;
+    bs1770_ctx_t *album = NULL;
+    int nb_album_tracks = 0;
+    const char **files = NULL;
+    int nb_files = 0;
 
     avformat_network_init();
+    bs1770_set_allocator(&bs1770_av_allocator);
 
     memset(&conf, 0, sizeof(conf));
     conf.class = &lufscalc_config_class;
     av_opt_set_defaults(&conf);
+    conf.out = stdout;
 
     while (!ret) {
         argv++;
@@ -694,9 +1750,48 @@ int main(int argc, char **argv)
         if (conf.downmix && conf.track_spec)
             panic("downmix and track_spec are mutually exclusive");
         filecount++;
-        ret = lufscalc_file(argv[0], &conf);
+        if (conf.merge) {
+            if (!album && !(album = open_bs1770_ctx(&conf, 1)))
+                panic("failed to initialize bs1770 context");
+            nb_album_tracks += merge_file(argv[0], album);
+            continue;
+        }
+        if (conf.jobs > 1) {
+            if (conf.segments > 1 || conf.checkpoint || conf.seriesfile || conf.logfile || conf.status || conf.speedlimit)
+                panic("jobs cannot be combined with segments, checkpoint, series, logfile, status or speedlimit");
+            if (!files && !(files = av_calloc(argc, sizeof(*files))))
+                panic("malloc error");
+            files[nb_files++] = argv[0];
+            continue;
+        }
+        conf.file_index = filecount - 1;
+        if (conf.checkpoint && (conf.segments > 1 || conf.seriesfile || conf.logfile || pow(10, conf.peak_log_limit / 20.0) < 100))
+            panic("checkpoint cannot be combined with segments, series or peak logging");
+        if (conf.segments > 1) {
+            if (conf.seriesfile || conf.histfile || conf.logfile || pow(10, conf.peak_log_limit / 20.0) < 100 || conf.status || conf.speedlimit)
+                panic("segments cannot be combined with series, histfile, peak logging, status or speedlimit");
+            ret = lufscalc_segments(argv[0], &conf);
+        } else {
+            ret = lufscalc_file(argv[0], &conf, NULL);
+        }
     }
-    
+
+    if (nb_files && !ret)
+        ret = lufscalc_jobs(files, nb_files, &conf);
+    av_free(files);
+
+    if (album) {
+        if (!ret)
+            print_merge_results(&conf, album, nb_album_tracks);
+        bs1770_ctx_close(album);
+    }
+    if (conf.histfp && fclose(conf.histfp))
+        panic("failed to write histogram file");
+    if (conf.seriesfp)
+        fclose(conf.seriesfp);
+    if (conf.pool)
+        bs1770_pool_close(conf.pool);
+
     avformat_network_deinit();
     av_opt_free(&conf);
 
@@ -0,0 +1,230 @@
+/*
+ * tests/aggr.c
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ * 
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ * 
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston,
+ * MA  02110-1301  USA
+ */
+// Checks the aggregator, which sums its input per hop and hands each hop
+// to the overlapping blocks, against a ring of blocks each sample is added
+// to one at a time, for several rates and sizes of the chunks it is fed
+// in.  Run by "make check".
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include "bs1770.h"
+
+#define SECONDS   12
+#define TOLERANCE 1.0e-9  // dB.
+
+typedef struct block {
+  double t;
+  double momentary;
+  double shortterm;
+} block_t;
+
+typedef struct blocks {
+  size_t size;
+  size_t count;
+  block_t *block;
+} blocks_t;
+
+static void series(void *data, double t, double momentary, double shortterm)
+{
+  blocks_t *blocks=data;
+
+  if (blocks->count<blocks->size) {
+    blocks->block[blocks->count].t=t;
+    blocks->block[blocks->count].momentary=momentary;
+    blocks->block[blocks->count].shortterm=shortterm;
+  }
+
+  ++blocks->count;
+}
+
+#define LUFS(wmsq) \
+  (0.0<(wmsq)?-0.691+10.0*log10(wmsq):-HUGE_VAL)
+
+// the blocks as the aggregator gave them before it summed per hop: every
+// sample is added to each of the "partition" blocks of the ring it falls
+// into, the short-term window is summed up from the samples.
+static size_t naive(const double *wssqs, size_t n, double fs, int partition,
+    size_t hops, block_t *block)
+{
+  size_t overlap=round(0.4*fs/partition);
+  double scale=1.0/(double)(partition*overlap);
+  double *ring=calloc(partition,sizeof ring[0]);
+  size_t used=1,offs=0,count=0,nblocks=0;
+  size_t i,j;
+
+  if (NULL==ring)
+    return 0;
+
+  for (i=0;i<n;++i) {
+    for (j=0;j<used;++j)
+      ring[j]+=scale*wssqs[i];
+
+    if (++count<overlap)
+      continue;
+
+    count=0;
+    offs=(offs+1)%partition;
+
+    if (used==(size_t)partition) {
+      size_t end=i+1;
+      size_t size=hops*overlap<end?hops*overlap:end;
+      double sum=0.0;
+
+      for (j=end-size;j<end;++j)
+        sum+=wssqs[j];
+
+      block[nblocks].t=(double)end/fs;
+      block[nblocks].momentary=LUFS(ring[offs]);
+      block[nblocks].shortterm=LUFS(sum/(double)size);
+      ++nblocks;
+    }
+
+    ring[offs]=0.0;
+
+    if (used<(size_t)partition)
+      ++used;
+  }
+
+  free(ring);
+
+  return nblocks;
+}
+
+static int differ(double a, double b)
+{
+  if (isinf(a)||isinf(b))
+    return a!=b;
+  else
+    return TOLERANCE<fabs(a-b);
+}
+
+static int check(const double *wssqs, size_t n, double fs, size_t chunk,
+    const block_t *expected, size_t nexpected)
+{
+  bs1770_ps_t ps={ 400.0, 4, -10.0, 0 };
+  bs1770_arena_t arena={ NULL, 0, 0 };
+  bs1770_hist_t track,album;
+  bs1770_aggr_t aggr;
+  blocks_t blocks;
+  size_t i;
+  int ret=-1;
+
+  memset(&track,0,sizeof track);
+  memset(&album,0,sizeof album);
+  blocks.size=nexpected;
+  blocks.count=0;
+
+  if (NULL==(blocks.block=calloc(nexpected+1,sizeof blocks.block[0])))
+    goto error;
+  else if (NULL==bs1770_hist_init(&track,&ps,&arena))
+    goto track;
+  else if (NULL==bs1770_hist_init(&album,&ps,&arena))
+    goto album;
+  else if (NULL==bs1770_aggr_init(&aggr,&ps,&track,&album))
+    goto aggr;
+
+  bs1770_aggr_set_series(&aggr,series,&blocks);
+
+  for (i=0;i<n;i+=chunk)
+    bs1770_aggr_add_sqs(&aggr,fs,wssqs+i,chunk<n-i?chunk:n-i);
+
+  if (blocks.count!=nexpected) {
+    fprintf(stderr,"%.0f Hz, chunks of %lu: %lu blocks, expected %lu\n",
+        fs,(unsigned long)chunk,(unsigned long)blocks.count,
+        (unsigned long)nexpected);
+    goto check;
+  }
+
+  for (i=0;i<nexpected;++i) {
+    const block_t *b=blocks.block+i,*e=expected+i;
+
+    if (b->t!=e->t||differ(b->momentary,e->momentary)
+        ||differ(b->shortterm,e->shortterm)) {
+      fprintf(stderr,"%.0f Hz, chunks of %lu, block %lu at %g s: "
+          "%.12f/%.12f LUFS, expected %.12f/%.12f\n",
+          fs,(unsigned long)chunk,(unsigned long)i,e->t,
+          b->momentary,b->shortterm,e->momentary,e->shortterm);
+      goto check;
+    }
+  }
+
+  ret=0;
+check:
+  bs1770_aggr_cleanup(&aggr);
+aggr:
+  bs1770_hist_cleanup(&album);
+album:
+  bs1770_hist_cleanup(&track);
+track:
+  free(blocks.block);
+error:
+  return ret;
+}
+
+int main(void)
+{
+  static const double rates[]={ 8000.0, 11025.0, 44100.0, 48000.0, 96000.0 };
+  static const size_t chunks[]={ 1, 7, 64, 1000, 4410, 48000, 0 };
+  int failed=0;
+  size_t r,c;
+
+  srand(1770);
+
+  for (r=0;r<sizeof rates/sizeof rates[0];++r) {
+    double fs=rates[r];
+    size_t n=SECONDS*(size_t)fs;
+    double *wssqs=malloc(n*sizeof wssqs[0]);
+    block_t *expected=malloc(n*sizeof expected[0]);
+    size_t nexpected,i;
+
+    if (NULL==wssqs||NULL==expected) {
+      fprintf(stderr,"out of memory\n");
+      return 1;
+    }
+
+    // a loudness swinging over some 80 dB, with a silent and a near silent
+    // second as well as samples far below the silence gate.
+    for (i=0;i<n;++i) {
+      double level=-80.0*(0.5+0.5*sin(i/fs))-5.0;
+
+      if (i/(size_t)fs==3)
+        wssqs[i]=0.0;
+      else if (i/(size_t)fs==7||0==rand()%97)
+        wssqs[i]=1.0e-18*rand()/RAND_MAX;
+      else
+        wssqs[i]=pow(10.0,0.1*level)*2.0*rand()/RAND_MAX;
+    }
+
+    nexpected=naive(wssqs,n,fs,4,30,expected);
+
+    for (c=0;c<sizeof chunks/sizeof chunks[0];++c) {
+      if (check(wssqs,n,fs,0==chunks[c]?n:chunks[c],expected,nexpected)<0)
+        failed=1;
+    }
+
+    free(expected);
+    free(wssqs);
+  }
+
+  if (!failed)
+    printf("aggr: ok\n");
+
+  return failed;
+}